@@ -19,10 +19,14 @@
   #include <unistd.h>
   #include <iostream>
   #include <algorithm>
+  #if !defined (RF24_NETWORK_VIRTUAL_RADIO)
   #include <RF24/RF24.h>
+  #endif
   #include "RF24Network.h"
 #else  
+  #if !defined (RF24_NETWORK_VIRTUAL_RADIO)
   #include "RF24.h"
+  #endif
   #include "RF24Network.h"
 #endif
 
@@ -40,53 +44,109 @@
 
 uint16_t RF24NetworkHeader::next_id = 1;
 #if defined ENABLE_NETWORK_STATS
-uint32_t RF24Network::nFails = 0;
-uint32_t RF24Network::nOK = 0;
+uint32_t RF24NetworkBase::nFails = 0;
+uint32_t RF24NetworkBase::nOK = 0;
 #endif
 uint64_t pipe_address( uint16_t node, uint8_t pipe );
+static const uint8_t address_translation[] = { 0xc3,0x3c,0x33,0xce,0x3e,0xe3,0xec }; // Radio address bytes for the octal digits of node addresses
 #if defined (RF24NetworkMulticast)
 uint16_t levelToAddress( uint8_t level );
 #endif
 bool is_valid_address( uint16_t node );
 
 /******************************************************************/
-#if defined (RF24_LINUX) 
-  #if !defined (DUAL_HEAD_RADIO)
-  RF24Network::RF24Network( RF24& _radio ): radio(_radio), frame_size(MAX_FRAME_SIZE)
+#if !defined (DUAL_HEAD_RADIO)
+RF24NetworkBase::RF24NetworkBase( RF24& _radio, uint8_t* _queue, uint16_t _queue_size, uint8_t* _frag_buffer, uint16_t _max_payload_size, uint8_t* _priority_queue, uint16_t _priority_queue_size ): radio(_radio)
+#else
+RF24NetworkBase::RF24NetworkBase( RF24& _radio, RF24& _radio1, uint8_t* _queue, uint16_t _queue_size, uint8_t* _frag_buffer, uint16_t _max_payload_size, uint8_t* _priority_queue, uint16_t _priority_queue_size ): radio(_radio), radio1(_radio1)
+#endif
+{
+  max_payload_size = _max_payload_size;
+  #if defined (RF24_LINUX)
+  capture_file = NULL;
+  replay_file = NULL;
+  #endif
+  #if defined (NETWORK_TRACE_DEPTH)
+  trace_count = 0;
+  #endif
+  #if defined ENABLE_NETWORK_STATS
+  resetStats();
+  #endif
+  #if defined (RF24_LINUX)
+  frame_size = MAX_FRAME_SIZE;
+  // The queues and the fragment buffer are members on Linux
+  (void)_queue; (void)_queue_size; (void)_frag_buffer; (void)_priority_queue; (void)_priority_queue_size;
   #else
-  RF24Network::RF24Network( RF24& _radio, RF24& _radio1 ): radio(_radio), radio1(_radio1),frame_size(MAX_FRAME_SIZE)
+  frame_queue.buffer = _queue; frame_queue.size = _queue_size;
+  frame_queue.head = 0; frame_queue.tail = 0; frame_queue.wrap = 0;
+  priority_queue.buffer = _priority_queue; priority_queue.size = _priority_queue_size;
+  priority_queue.head = 0; priority_queue.tail = 0; priority_queue.wrap = 0;
   #endif
-{
-  txTime=0; networkFlags=0; returnSysMsgs=0; multicastRelay=0;
-}
-#elif !defined (DUAL_HEAD_RADIO)
-RF24Network::RF24Network( RF24& _radio ): radio(_radio), next_frame(frame_queue) 
-{
+  // The system types, 128 and up, go ahead of user messages
+  memset(priority_types,0,sizeof(priority_types)/2);
+  memset(priority_types+sizeof(priority_types)/2,0xFF,sizeof(priority_types)/2);
+  priority_borrowed = false;
   #if !defined ( DISABLE_FRAGMENTATION )
-  frag_queue.message_buffer=&frag_queue_message_buffer[0];
+    #if !defined (RF24_LINUX)
+  frag_queue_message_buffer = _frag_buffer;
+  frag_queue.message_buffer = frag_queue_message_buffer;
   frag_ptr = &frag_queue;
+  memset(&frag_map,0,sizeof(frag_map));
+  frag_done = 0;
+    #endif
+  frag_report_id = 0; frag_report_ready = 0;
   #endif
-  txTime=0; networkFlags=0; returnSysMsgs=0; multicastRelay=0;
-}
-#else
-RF24Network::RF24Network( RF24& _radio, RF24& _radio1 ): radio(_radio), radio1(_radio1), next_frame(frame_queue)
-{
-  #if !defined ( DISABLE_FRAGMENTATION )
-  frag_queue.message_buffer=&frag_queue_message_buffer[0];
-  frag_ptr = &frag_queue;
+  txTime=0; networkFlags=0; returnSysMsgs=0; multicastRelay=0; radio_state=0; ack_waiting=0;
+  #if defined (NUM_ASYNC_WRITES)
+  async_next=0; async_sending=0; async_ack_pending=0;
+  #endif
+  #if defined (BULK_WINDOW)
+  bulk_tx.state = BULK_IDLE; bulk_sending = 0;
+  memset(&bulk_rx,0,sizeof(bulk_rx));
+  #endif
+  #if defined (ENABLE_TYPE_HANDLERS)
+  memset(type_handlers,0,sizeof(type_handlers));
+  #endif
+  #if defined (RX_BATCH_SIZE)
+  rx_batch_next = 0; rx_batch_count = 0;
+  #endif
+  #if defined (AGGREGATE_WINDOW)
+  aggregate_size = 0; aggregate_count = 0;
+  #endif
+  #if defined (FORWARD_QUEUE_DEPTH)
+  forward_order = 0; forward_sending = 0;
+  #endif
+  #if defined (DUPLICATE_CACHE_SIZE)
+  memset(recent,0xFF,sizeof(recent)); // No node has address 0xFFFF
+  recent_next = 0;
   #endif
-  txTime=0; networkFlags=0; returnSysMsgs=0; multicastRelay=0;
 }
-#endif
+
 /******************************************************************/
 
-void RF24Network::begin(uint8_t _channel, uint16_t _node_address )
+void RF24NetworkBase::begin(uint8_t _channel, uint16_t _node_address )
 {
-  if (! is_valid_address(_node_address) )
+  if (! is_valid_address(_node_address) ){
+    IF_SERIAL_DEBUG_MINIMAL(printf_P(PSTR("*** WARNING *** Invalid address 0%o\n\r"),_node_address););
     return;
+  }
 
   node_address = _node_address;
 
+  // Setup our address helper cache
+  setup_address();
+
+  uint64_t pipes[6];
+  for(uint8_t i = 0; i < 6; i++){
+    pipes[i] = pipe_address(_node_address,i);
+  }
+  begin_radio(_channel,pipes);
+}
+
+/******************************************************************/
+
+void RF24NetworkBase::begin_radio(uint8_t _channel, const uint64_t* pipes)
+{
   if ( ! radio.isValid() ){
     return;
   }
@@ -115,34 +175,238 @@ void RF24Network::begin(uint8_t _channel, uint16_t _node_address )
   radio1.enableDynamicPayloads();
 #endif
 
-  // Setup our address helper cache
-  setup_address();
-
   // Open up all listening pipes
   uint8_t i = 6;
   while (i--){
-    radio.openReadingPipe(i,pipe_address(_node_address,i));	
+    radio.openReadingPipe(i,pipes[i]);
   }
   radio.startListening();
+  radio_state = RADIO_LISTENING;
+  tx_pipe_address = 0;
 
 }
 
 /******************************************************************/
 
 #if defined ENABLE_NETWORK_STATS
-void RF24Network::failures(uint32_t *_fails, uint32_t *_ok){
+void RF24NetworkBase::failures(uint32_t *_fails, uint32_t *_ok){
 	*_fails = nFails;
 	*_ok = nOK;
 }
+
+/******************************************************************/
+
+void RF24NetworkBase::stats(RF24NetworkStats* snapshot)
+{
+  memcpy(snapshot,&net_stats,sizeof(net_stats));
+}
+
+/******************************************************************/
+
+void RF24NetworkBase::resetStats(void)
+{
+  memset(&net_stats,0,sizeof(net_stats));
+}
+
+/******************************************************************/
+
+// Counts a frame sent to @p node, the parent or a child, or another node for anything else
+void RF24NetworkBase::stats_tx(uint16_t node, bool ok)
+{
+  RF24NetworkNeighborStats& neighbor = net_stats.neighbors[rf24_min(neighbor_index(node),6)];
+  neighbor.tx_attempts++;
+  if(ok){
+    neighbor.tx_ok++;
+  }
+}
+
+/******************************************************************/
+
+// Counts a NETWORK_ACK that arrived @p rtt ms after the frame was sent
+void RF24NetworkBase::stats_ack(uint32_t rtt)
+{
+  uint8_t bucket = 0;
+  while(bucket < 7 && rtt >= (1UL << bucket)){
+    bucket++;
+  }
+  net_stats.ack_rtt[bucket]++;
+}
+
+/******************************************************************/
+
+// Counts a message of @p type written, or a frame of it received
+void RF24NetworkBase::stats_type(uint8_t type, bool tx)
+{
+  uint8_t i = 0;
+  while(i < net_stats.types_used && net_stats.types[i].type != type){
+    i++;
+  }
+  if(i == net_stats.types_used){
+    if(i == NETWORK_STATS_TYPES){
+      net_stats.types_other++;
+      return;
+    }
+    net_stats.types[i].type = type;
+    net_stats.types_used++;
+  }
+  if(tx){
+    net_stats.types[i].tx++;
+  }else{
+    net_stats.types[i].rx++;
+  }
+}
+#endif
+
+#if defined (NETWORK_TRACE_DEPTH)
+/******************************************************************/
+
+uint16_t RF24NetworkBase::trace(RF24NetworkTraceEvent* events, uint16_t max)
+{
+  uint16_t count = rf24_min(rf24_min(trace_count,(uint32_t)NETWORK_TRACE_DEPTH),(uint32_t)max);
+  for(uint16_t i = 0; i < count; i++){
+    events[i] = trace_ring[(trace_count - count + i) & (NETWORK_TRACE_DEPTH - 1)];
+  }
+  return count;
+}
+
+#if defined (RF24_LINUX)
+/******************************************************************/
+
+void RF24NetworkBase::printTrace(void)
+{
+  static const char* const names[] = { "?", "MAC RX", "MAC TX", "ROUTE", "FWD DROP", "FRAG", "FRAG DROP", "ACK WAIT", "ACK DONE", "HOLD" };
+  RF24NetworkTraceEvent events[NETWORK_TRACE_DEPTH];
+  uint16_t count = trace(events,NETWORK_TRACE_DEPTH);
+  for(uint16_t i = 0; i < count; i++){
+    const RF24NetworkTraceEvent& e = events[i];
+    printf("%u: %s node 0%o id %u arg %u\n",e.time,e.event < sizeof(names) / sizeof(names[0]) ? names[e.event] : names[0],e.node,e.id,e.arg);
+  }
+}
+#endif
+#endif
+
+#if defined (RF24_LINUX)
+/******************************************************************/
+
+bool RF24NetworkBase::capture(const char* path)
+{
+  if(capture_file){
+    fclose(capture_file);
+    capture_file = NULL;
+  }
+  if(!path){
+    return true;
+  }
+  capture_file = fopen(path,"wb");
+  if(!capture_file){
+    return false;
+  }
+  // The pcap file header: magic, version 2.4, time zone, timestamp accuracy, largest packet and link type
+  const uint32_t magic = 0xa1b2c3d4;
+  const uint16_t version[2] = { 2, 4 };
+  const uint32_t fields[4] = { 0, 0, sizeof(replay_frame), CAPTURE_LINKTYPE };
+  fwrite(&magic,sizeof(magic),1,capture_file);
+  fwrite(version,sizeof(version),1,capture_file);
+  fwrite(fields,sizeof(fields),1,capture_file);
+  return true;
+}
+
+/******************************************************************/
+
+void RF24NetworkBase::capture_frame(uint8_t direction, uint8_t pipe, const uint8_t* frame, uint8_t size)
+{
+  uint32_t now = millis();
+  const uint32_t record[4] = { now / 1000, (now % 1000) * 1000, size + 2U, size + 2U };
+  const uint8_t prefix[2] = { direction, pipe };
+  fwrite(record,sizeof(record),1,capture_file);
+  fwrite(prefix,sizeof(prefix),1,capture_file);
+  fwrite(frame,size,1,capture_file);
+}
+
+/******************************************************************/
+
+bool RF24NetworkBase::replay(const char* path, bool realtime)
+{
+  if(replay_file){
+    fclose(replay_file);
+  }
+  replay_file = fopen(path,"rb");
+  if(!replay_file){
+    return false;
+  }
+  uint32_t header[6];
+  if( fread(header,sizeof(header),1,replay_file) != 1 || header[0] != 0xa1b2c3d4 || header[5] != CAPTURE_LINKTYPE ){
+    fclose(replay_file);
+    replay_file = NULL;
+    return false;
+  }
+  replay_realtime = realtime;
+  replay_start = millis();
+  replay_first = 0xFFFFFFFF;
+  replay_size = 0;
+  #if defined (DUPLICATE_CACHE_SIZE)
+  // The file may hold messages that just came over the radio
+  memset(recent,0xFF,sizeof(recent));
+  #endif
+  return true;
+}
+
+/******************************************************************/
+
+// Puts the next received frame of the replay() file in frame_buffer, returns false if it is not due yet or there is no room.
+// At the end of the file, the radio takes over again.
+bool RF24NetworkBase::replay_next(uint8_t& pipe_num)
+{
+  while(!replay_size){
+    uint32_t record[4];
+    if( fread(record,sizeof(record),1,replay_file) != 1 || record[2] < 2 + sizeof(RF24NetworkHeader) || record[2] > sizeof(replay_frame) ||
+        fread(replay_frame,record[2],1,replay_file) != 1 ){
+      fclose(replay_file);
+      replay_file = NULL;
+      return false;
+    }
+    uint32_t time = record[0] * 1000 + record[1] / 1000;
+    if(replay_first == 0xFFFFFFFF){
+      replay_first = time;
+    }
+    if(replay_frame[0] == CAPTURE_RX){
+      replay_size = record[2];
+      replay_time = time - replay_first;
+    }
+  }
+  if( (replay_realtime && millis() - replay_start < replay_time) || !rx_room(0,replay_size - 2) ){
+    return false;
+  }
+  frame_size = replay_size - 2;
+  memcpy(frame_buffer,replay_frame + 2,frame_size);
+  pipe_num = replay_frame[1];
+  replay_size = 0;
+  return true;
+}
 #endif
 
 /******************************************************************/
 
-uint8_t RF24Network::update(void)
+uint8_t RF24NetworkBase::update(void)
 {
   // if there is data ready
   uint8_t pipe_num;
   uint8_t returnVal = 0;
+
+  #if defined (NUM_ASYNC_WRITES)
+  async_update();
+  #endif
+  #if defined (BULK_WINDOW)
+  bulk_update();
+  #endif
+  #if defined (FORWARD_QUEUE_DEPTH)
+  forward_update();
+  #endif
+  #if defined (AGGREGATE_WINDOW)
+  if( aggregate_size && millis() - aggregate_time >= AGGREGATE_WINDOW ){
+    aggregate_flush();
+  }
+  #endif
   
   // If bypass is enabled, continue although incoming user data may be dropped
   // Allows system payloads to be read while user cache is full
@@ -150,7 +414,7 @@ uint8_t RF24Network::update(void)
   
   #if !defined (RF24_LINUX)
   if(!(networkFlags & FLAG_BYPASS_HOLDS)){
-    if( (networkFlags & FLAG_HOLD_INCOMING) || (next_frame-frame_queue) + 34 > MAIN_BUFFER_SIZE ){
+    if( (networkFlags & FLAG_HOLD_INCOMING) || queue_space(frame_queue) < MAX_FRAME_SIZE + 2 ){
       if(!available()){
         networkFlags &= ~FLAG_HOLD_INCOMING;
       }else{
@@ -158,21 +422,18 @@ uint8_t RF24Network::update(void)
       }
     }
   }
+  #else
+  networkFlags &= ~FLAG_HOLD_INCOMING;
+  #endif
+
+  #if defined (FLOW_CONTROL_TIMEOUT)
+  // The application has made room, let the neighbors that were held back send again
+  if( credit_refused && credit_available() ){
+    credit_grant();
+  }
   #endif
   
-  while ( radio.isValid() && radio.available(&pipe_num) ){
-
-    #if defined (ENABLE_DYNAMIC_PAYLOADS) && !defined (XMEGA_D3)
-      if( (frame_size = radio.getDynamicPayloadSize() ) < sizeof(RF24NetworkHeader)){
-	    delay(10);
-		continue;
-	  }
-    #else
-      frame_size=32;
-    #endif
-      // Dump the payloads until we've gotten everything
-      // Fetch the payload, and see if this was the last one.
-	  radio.read( frame_buffer, frame_size );
+  while ( next_frame(pipe_num) ){
 	  
       // Read the beginning of the frame as the header
 	  RF24NetworkHeader *header = (RF24NetworkHeader*)(&frame_buffer);
@@ -188,38 +449,119 @@ uint8_t RF24Network::update(void)
       IF_SERIAL_DEBUG(const uint16_t* i = reinterpret_cast<const uint16_t*>(frame_buffer + sizeof(RF24NetworkHeader));printf_P(PSTR("%lu: NET message %04x\n\r"),millis(),*i));
       #endif
 	  
+      IF_NETWORK_TRACE( trace_event(TRACE_MAC_RX,header->from_node,header->id,header->type); );
+	  #if defined (RF24_LINUX)
+	  if(capture_file){
+	    capture_frame(CAPTURE_RX,pipe_num,frame_buffer,frame_size);
+	  }
+	  #endif
+
       // Throw it away if it's not a valid address
       if ( !is_valid_address(header->to_node) ){
 		continue;
 	  }
+	  #if defined ENABLE_NETWORK_STATS
+	  RF24NetworkNeighborStats& neighbor = net_stats.neighbors[rf24_min(neighbor_index(neighbor_of(header->from_node)),6)];
+	  neighbor.rx_frames++;
+	  #endif
 	  
 	  uint8_t returnVal = header->type;
 
 	  // Is this for us?
       if ( header->to_node == node_address   ){
-			
-			if(header->type == NETWORK_PING){
-			   continue;
+			#if defined ENABLE_NETWORK_STATS
+			stats_type(header->type,false);
+			#endif
+			#if defined (DUPLICATE_CACHE_SIZE)
+			// Fragments and the system messages have their own sequence checks
+			if( (header->type <= MAX_USER_DEFINED_HEADER_TYPE || header->type == EXTERNAL_DATA_TYPE || header->type == NETWORK_AGGREGATE) && is_repeat(header) ){
+				IF_SERIAL_DEBUG_ROUTING( printf_P(PSTR("%lu: NET Dropping copy of frame id %d from 0%o\n\r"),(unsigned long)millis(),header->id,header->from_node); );
+				continue;
 			}
-		    if(header->type == NETWORK_ADDR_RESPONSE ){	
-			    uint16_t requester = 04444;
-				if(requester != node_address){
-					header->to_node = requester;
-					write(header->to_node,USER_TX_TO_PHYSICAL_ADDRESS);
-					delay(10);
-                    write(header->to_node,USER_TX_TO_PHYSICAL_ADDRESS);
-					//printf("Fwd add response to 0%o\n",requester);
+			#endif
+			
+			switch(header->type){
+			case NETWORK_PING:
+				continue;
+			case NETWORK_ADDR_RESPONSE:
+				{
+					uint16_t requester = 04444;
+					if(requester != node_address){
+						header->to_node = requester;
+						write(header->to_node,USER_TX_TO_PHYSICAL_ADDRESS);
+						delay(10);
+						write(header->to_node,USER_TX_TO_PHYSICAL_ADDRESS);
+						//printf("Fwd add response to 0%o\n",requester);
+						continue;
+					}
+				}
+				break;
+			case NETWORK_REQ_ADDRESS:
+				if(node_address){
+					//printf("Fwd add req to 0\n");
+					header->from_node = node_address;
+					header->to_node = 0;
+					write(header->to_node,TX_NORMAL);
 					continue;
 				}
+				break;
+			#if !defined (DISABLE_FRAGMENTATION)
+			case NETWORK_FRAGMENT_NACK:
+				// Report on a message write_selective() is sending, stale ones are dropped
+				if(header->id == frag_report_id){
+					frag_report_size = rf24_min((uint16_t)(frame_size-sizeof(RF24NetworkHeader)),sizeof(frag_report));
+					memcpy(frag_report,frame_buffer+sizeof(RF24NetworkHeader),frag_report_size);
+					frag_report_ready = true;
+				}
+				continue;
+			#endif
+			#if defined (FLOW_CONTROL_TIMEOUT)
+			case NETWORK_CREDIT:
+				{
+					uint8_t i = neighbor_index(header->from_node);
+					if(i < 6){
+						neighbor_credit[i] = header->reserved;
+						neighbor_credit_time[i] = millis();
+					}
+				}
+				continue;
+			#endif
+			#if defined (AGGREGATE_WINDOW)
+			case NETWORK_AGGREGATE:
+				aggregate_split(header);
+				continue;
+			#endif
+			#if defined (BULK_WINDOW)
+			case NETWORK_BULK_OPEN:
+			case NETWORK_BULK_DATA:
+			case NETWORK_BULK_ACK:
+				bulk_frame(header);
+				continue;
+			#endif
+			#if defined (NUM_ASYNC_WRITES)
+			case NETWORK_ACK:
+				{
+					// Complete the writeAsync() frame waiting for this ACK, without returning it to a blocking write()
+					uint8_t i = NUM_ASYNC_WRITES;
+					while(i--){
+						if(async_writes[i].state == ASYNC_SLOT_WAIT_ACK && async_writes[i].header.id == header->id){
+							#if defined ENABLE_NETWORK_STATS
+							stats_ack(millis() - async_writes[i].time);
+							#endif
+							async_frame_done(i,true);
+							break;
+						}
+					}
+					if(i < NUM_ASYNC_WRITES){
+						continue;
+					}
+				}
+				break;
+			#endif
 			}
-			if(header->type == NETWORK_REQ_ADDRESS && node_address){
-				//printf("Fwd add req to 0\n");
-				header->from_node = node_address;
-				header->to_node = 0;
-				write(header->to_node,TX_NORMAL);
+			if( dispatch(*header,frame_buffer+sizeof(RF24NetworkHeader),frame_size-sizeof(RF24NetworkHeader)) ){
 				continue;
 			}
-			
 			if( (returnSysMsgs && header->type > 127) || header->type == NETWORK_ACK ){	
 				IF_SERIAL_DEBUG_ROUTING( printf_P(PSTR("%lu MAC: System payload rcvd %d\n"),millis(),returnVal); );
 				//if( (header->type < 148 || header->type > 150) && header->type != NETWORK_MORE_FRAGMENTS_NACK && header->type != EXTERNAL_DATA_TYPE && header->type!= NETWORK_LAST_FRAGMENT){
@@ -234,6 +576,17 @@ uint8_t RF24Network::update(void)
 				#endif
 				return EXTERNAL_DATA_TYPE;				
 			}
+			#if defined (FLOW_CONTROL_TIMEOUT)
+			// Frames on pipe 0 were sent to the physical address, not by the parent or a child
+			if( pipe_num && !credit_available() ){
+				uint16_t neighbor = neighbor_of(header->from_node);
+				uint8_t i = neighbor_index(neighbor);
+				if( i < 6 && !(credit_refused & _BV(i)) ){
+					credit_refused |= _BV(i);
+					credit_send(neighbor,0);
+				}
+			}
+			#endif
 	  }else{	  
 
 	  #if defined	(RF24NetworkMulticast)	
@@ -250,7 +603,7 @@ uint8_t RF24Network::update(void)
                     }
 					continue;
 				}
-				uint8_t val = enqueue(header);
+				uint8_t val = dispatch(*header,frame_buffer+sizeof(RF24NetworkHeader),frame_size-sizeof(RF24NetworkHeader)) ? 0 : enqueue(header);
 				
 				if(multicastRelay){					
 					IF_SERIAL_DEBUG_ROUTING( printf_P(PSTR("%u MAC: FWD multicast frame from 0%o to level %u\n"),millis(),header->from_node,multicast_level+1); );
@@ -262,563 +615,2089 @@ uint8_t RF24Network::update(void)
 				}
 
 			}else{
-				write(header->to_node,1);	//Send it on, indicate it is a routed payload
+				#if defined ENABLE_NETWORK_STATS
+				neighbor.routed++;
+				#endif
+				forward(header->to_node);	//Send it on, indicate it is a routed payload
 			}
 		#else
-		write(header->to_node,1);	//Send it on, indicate it is a routed payload
+		#if defined ENABLE_NETWORK_STATS
+		neighbor.routed++;
+		#endif
+		forward(header->to_node);	//Send it on, indicate it is a routed payload
 		#endif
 	  }
 	  
   }
+  #if defined (FORWARD_QUEUE_DEPTH)
+  forward_update();
+  #endif
   return returnVal;
 }
 
-
-#if defined (RF24_LINUX)
 /******************************************************************/
 
-uint8_t RF24Network::enqueue(RF24NetworkHeader* header) {
-  uint8_t result = false;
-  
-  RF24NetworkFrame frame = RF24NetworkFrame(*header,frame_buffer+sizeof(RF24NetworkHeader),frame_size-sizeof(RF24NetworkHeader)); 
-  
-  bool isFragment = ( frame.header.type == NETWORK_FIRST_FRAGMENT || frame.header.type == NETWORK_MORE_FRAGMENTS || frame.header.type == NETWORK_LAST_FRAGMENT || frame.header.type == NETWORK_MORE_FRAGMENTS_NACK);
-  
-  
-  
-  // This is sent to itself
-  if (frame.header.from_node == node_address) {    
-    if (isFragment) {
-      printf("Cannot enqueue multi-payload frames to self\n");
-      result = false;
-    }else{
-    frame_queue.push(frame);
-    result = true;
-	}
-  }else  
-  if (isFragment)
-  {
-    //The received frame contains the a fragmented payload
-    //Set the more fragments flag to indicate a fragmented frame
-    IF_SERIAL_DEBUG_FRAGMENTATION_L2(printf("%u: FRG Payload type %d of size %i Bytes with fragmentID '%i' received.\n\r",millis(),frame.header.type,frame.message_size,frame.header.reserved););
-    //Append payload
-    result = appendFragmentToFrame(frame);
-   
-    //The header.reserved contains the actual header.type on the last fragment 
-    if ( result && frame.header.type == NETWORK_LAST_FRAGMENT) {
-	  IF_SERIAL_DEBUG_FRAGMENTATION(printf("%u: FRG Last fragment received. \n",millis() ););
-      IF_SERIAL_DEBUG(printf_P(PSTR("%u: NET Enqueue assembled frame @%x "),millis(),frame_queue.size()));
-
-	  RF24NetworkFrame *f = &(frameFragmentsCache[ frame.header.from_node ] );
-	  
-	  
-	  result=f->header.type == EXTERNAL_DATA_TYPE ? 2 : 1;
-	  
-	  //Load external payloads into a separate queue on linux
-	  if(result == 2){
-	    external_queue.push( frameFragmentsCache[ frame.header.from_node ] );
-	  }else{
-        frame_queue.push( frameFragmentsCache[ frame.header.from_node ] );
-	  }
-      frameFragmentsCache.erase( frame.header.from_node );
-	}
+// Whether the queues have room for the waiting payload of @p size bytes, after the @p staged ones already read from the radio.
+// Payloads are left in the radio until the application makes room in the queues.
+// With FLAG_BYPASS_HOLDS, frames for a full queue are dropped, while priority frames still have their own room.
+bool RF24NetworkBase::rx_room(uint8_t staged, uint8_t size)
+{
+  if(networkFlags & FLAG_BYPASS_HOLDS){
+    return true;
+  }
+  #if defined (RF24_LINUX)
+  // A full external_queue does not hold routed and system frames back, external data is dropped on its own in enqueue()
+  if( frame_queue.size() + staged >= FRAME_QUEUE_DEPTH ){
+    if(!staged){
+      hold_incoming();
+    }
+    return false;
+  }
+  #else
+  // Staged frames are counted at their largest, the waiting payload as it will be queued, with its header expanded.
+  // Neither is larger than the messages this node takes.
+  uint16_t largest = rf24_min((uint16_t)FRAME_BUFFER_SIZE,(uint16_t)(max_payload_size + sizeof(RF24NetworkHeader)));
+  uint16_t next_size = rf24_min((uint16_t)(size + FRAME_BUFFER_SIZE - MAX_FRAME_SIZE),largest);
+  if( queue_space(frame_queue) < (largest + 2) * staged + next_size + 2 ){
+    return false;
+  }
+  #endif
+  return true;
+}
 
-  }else{//  if (frame.header.type <= MAX_USER_DEFINED_HEADER_TYPE) {
-    //This is not a fragmented payload but a whole frame.
+/******************************************************************/
 
-    IF_SERIAL_DEBUG(printf_P(PSTR("%u: NET Enqueue @%x "),millis(),frame_queue.size()));
-    // Copy the current frame into the frame queue
-	result=frame.header.type == EXTERNAL_DATA_TYPE ? 2 : 1;
-    //Load external payloads into a separate queue on linux
-	if(result == 2){
-	  external_queue.push( frame );
-	}else{
-      frame_queue.push( frame );
-	}
-	
+// Size of the payload waiting in the radio, each call takes an SPI transaction
+uint8_t RF24NetworkBase::payload_size(void)
+{
+  #if defined (ENABLE_DYNAMIC_PAYLOADS) && !defined (XMEGA_D3)
+  return radio.getDynamicPayloadSize();
+  #else
+  return 32;
+  #endif
+}
 
-  }/* else {
-    //Undefined/Unknown header.type received. Drop frame!
-    IF_SERIAL_DEBUG_MINIMAL( printf("%u: FRG Received unknown or system header type %d with fragment id %d\n",millis(),frame.header.type, frame.header.reserved); );
-    //The frame is not explicitly dropped, but the given object is ignored.
-    //FIXME: does this causes problems with memory management?
-  }*/
+/******************************************************************/
 
-  if (result) {
-    //IF_SERIAL_DEBUG(printf("ok\n\r"));
-  } else {
-    IF_SERIAL_DEBUG(printf("failed\n\r"));
+// Reads the payload of @p size bytes from the radio into @p buffer, returns the frame size or 0 if it was not a frame
+uint8_t RF24NetworkBase::read_payload(uint8_t* buffer, uint8_t size)
+{
+  #if defined (ENABLE_DYNAMIC_PAYLOADS) && !defined (XMEGA_D3)
+  #if defined (COMPACT_HEADERS)
+  if( size < COMPACT_HEADER_SIZE ){
+  #else
+  if( size < sizeof(RF24NetworkHeader) ){
+  #endif
+    delay(10);
+    return 0;
   }
-
-  return result;
+  #endif
+  radio.read( buffer, size );
+  #if defined (COMPACT_HEADERS)
+  return frame_expand(buffer,size);
+  #else
+  return size;
+  #endif
 }
 
 /******************************************************************/
 
-bool RF24Network::appendFragmentToFrame(RF24NetworkFrame frame) {
+#if defined (COMPACT_HEADERS)
+// Leaves to_node and reserved out of the header in @p buffer, returns the new size of the frame.
+// Only for frames sent straight to their recipient, which knows its own address.
+uint8_t RF24NetworkBase::frame_compact(uint8_t* buffer, uint8_t size)
+{
+  RF24NetworkHeader header;
+  memcpy(&header,buffer,sizeof(header));
+  header.from_node |= COMPACT_HEADER_FLAG;
+  memcpy(buffer,&header.from_node,sizeof(header.from_node));
+  memcpy(buffer + 2,&header.id,sizeof(header.id));
+  buffer[4] = header.type;
+  memmove(buffer + COMPACT_HEADER_SIZE,buffer + sizeof(RF24NetworkHeader),size - sizeof(RF24NetworkHeader));
+  return size - sizeof(RF24NetworkHeader) + COMPACT_HEADER_SIZE;
+}
 
-  // This is the first of 2 or more fragments.
-  if (frame.header.type == NETWORK_FIRST_FRAGMENT){
-      if( frameFragmentsCache.count(frame.header.from_node) != 0 ){
-	    RF24NetworkFrame *f = &(frameFragmentsCache[ frame.header.from_node ]);
-	    //Already rcvd first frag
-	    if (f->header.id == frame.header.id){
-	      return false;
-		}
-	  }
-	  if(frame.header.reserved > (uint16_t(MAX_PAYLOAD_SIZE) / max_frame_payload_size) ){
-		IF_SERIAL_DEBUG_FRAGMENTATION( printf("%u FRG Too many fragments in payload %u, dropping...",millis(),frame.header.reserved); );
-		// If there are more fragments than we can possibly handle, return
-		return false;
-	  }
-	  frameFragmentsCache[ frame.header.from_node ] = frame;
-	  return true;
-  }else
-  
-  if ( frame.header.type == NETWORK_MORE_FRAGMENTS || frame.header.type == NETWORK_MORE_FRAGMENTS_NACK ){
-	
-	if( frameFragmentsCache.count(frame.header.from_node) < 1 ){
-	  return false;
-    }	
-	RF24NetworkFrame *f = &(frameFragmentsCache[ frame.header.from_node ]);	
-	if( f->header.reserved - 1 == frame.header.reserved && f->header.id == frame.header.id){	
-      // Cache the fragment
-      memcpy(f->message_buffer+f->message_size, frame.message_buffer, frame.message_size);
-	  f->message_size += frame.message_size;  //Increment message size
-      f->header = frame.header; //Update header
-	  return true;
-	  
-    } else {
-      IF_SERIAL_DEBUG_FRAGMENTATION(printf("%u: FRG Dropping fragment for frame with header id:%d, out of order fragment(s).\n",millis(),frame.header.id););
-	  return false;
-    }
+/******************************************************************/
 
-  }else
-  if ( frame.header.type == NETWORK_LAST_FRAGMENT ){
-  
-    //We have received the last fragment
-	if(frameFragmentsCache.count(frame.header.from_node) < 1){
-		return false;
-	}	
-	//Create pointer to the cached frame
-    RF24NetworkFrame *f = &(frameFragmentsCache[ frame.header.from_node ]);
+// Puts the full header back into a frame received with a compact one, returns the new size of the frame,
+// or 0 if it is too short. @p buffer must have room for FRAME_BUFFER_SIZE bytes.
+uint8_t RF24NetworkBase::frame_expand(uint8_t* buffer, uint8_t size)
+{
+  RF24NetworkHeader header;
+  memcpy(&header.from_node,buffer,sizeof(header.from_node));
+  if( !(header.from_node & COMPACT_HEADER_FLAG) ){
+    return size < sizeof(RF24NetworkHeader) ? 0 : size;
+  }
+  header.from_node &= ~COMPACT_HEADER_FLAG;
+  header.to_node = node_address;
+  memcpy(&header.id,buffer + 2,sizeof(header.id));
+  header.type = buffer[4];
+  header.reserved = 0;
+  memmove(buffer + sizeof(RF24NetworkHeader),buffer + COMPACT_HEADER_SIZE,size - COMPACT_HEADER_SIZE);
+  memcpy(buffer,&header,sizeof(header));
+  return size - COMPACT_HEADER_SIZE + sizeof(RF24NetworkHeader);
+}
+#endif
 
-	if( f->message_size + frame.message_size > MAX_PAYLOAD_SIZE){
-		IF_SERIAL_DEBUG_FRAGMENTATION( printf("%u FRG Frame of size %u plus enqueued frame of size %u exceeds max payload size \n",millis(),frame.message_size,f->message_size); );
-		return false;
-	}
-    //Error checking for missed fragments and payload size
-    if ( f->header.reserved-1 != 1 || f->header.id != frame.header.id) {
-        IF_SERIAL_DEBUG_FRAGMENTATION(printf("%u: FRG Duplicate or out of sequence frame %d, expected %d. Cleared.\n",millis(),frame.header.reserved,f->header.reserved););
-            //frameFragmentsCache.erase( std::make_pair(frame.header.id,frame.header.from_node) );
-        return false;
-    }
-	//The user specified header.type is sent with the last fragment in the reserved field
-    frame.header.type = frame.header.reserved;
-    frame.header.reserved = 1;
+/******************************************************************/
 
-    //Append the received fragment to the cached frame
-    memcpy(f->message_buffer+f->message_size, frame.message_buffer, frame.message_size);
-    f->message_size += frame.message_size;  //Increment message size
-    f->header = frame.header; //Update header	
-	return true;
+// Puts the next received frame in frame_buffer, returns false when there is none or no room for it.
+// With RX_BATCH_SIZE, everything waiting in the radio is read at once, before the frames are handled,
+// so the RX FIFO is empty while this node sends.
+bool RF24NetworkBase::next_frame(uint8_t& pipe_num)
+{
+  #if defined (RF24_LINUX)
+  if(replay_file){
+    return replay_next(pipe_num);
+  }
+  #endif
+  #if defined (RX_BATCH_SIZE)
+  if( rx_batch_next == rx_batch_count ){
+    rx_batch_next = 0;
+    rx_batch_count = 0;
+    while( rx_batch_count < RX_BATCH_SIZE && radio.isValid() && radio.available(&pipe_num) ){
+      // Read once, for both the room check and the read
+      uint8_t size = payload_size();
+      if( !rx_room(rx_batch_count,size) ){
+        break;
+      }
+      RF24NetworkRxFrame& rx = rx_batch[rx_batch_count];
+      rx.size = read_payload(rx.frame,size);
+      if(rx.size){
+        rx.pipe = pipe_num;
+        rx_batch_count++;
+      }
+    }
+    if(!rx_batch_count){
+      return false;
+    }
+  }
+  // Frames are taken off the batch before they are handled, a nested update() goes on with the next one
+  RF24NetworkRxFrame& rx = rx_batch[rx_batch_next++];
+  memcpy(frame_buffer,rx.frame,rx.size);
+  frame_size = rx.size;
+  pipe_num = rx.pipe;
+  return true;
+  #else
+  while( radio.isValid() && radio.available(&pipe_num) ){
+    uint8_t size = payload_size();
+    if( !rx_room(0,size) ){
+      break;
+    }
+    if( (frame_size = read_payload(frame_buffer,size)) ){
+      return true;
+    }
   }
   return false;
+  #endif
 }
 
 /******************************************************************/
+
+#if defined (DUPLICATE_CACHE_SIZE)
 /******************************************************************/
 
-#else // Not defined RF24_Linux:
+// Whether the frame in frame_buffer is a copy of a recent one, and remembers it if not. A relay's forward queue sends
+// a frame again as a new payload when the radio ACK is lost, which the receiving radio does not recognise as a repeat.
+// Writes that reuse a header are told apart by the checksum of their payload.
+bool RF24NetworkBase::is_repeat(const RF24NetworkHeader* header)
+{
+  uint16_t sum = header->type;
+  for(uint8_t i = sizeof(RF24NetworkHeader); i < frame_size; i++){
+    sum = (sum << 1 | sum >> 15) + frame_buffer[i];
+  }
+  uint32_t now = millis();
+  for(uint8_t i = 0; i < DUPLICATE_CACHE_SIZE; i++){
+    RF24NetworkRecent& r = recent[i];
+    if(r.from_node == header->from_node && r.id == header->id && r.sum == sum && now - r.time <= DUPLICATE_WINDOW){
+      return true;
+    }
+  }
+  RF24NetworkRecent& r = recent[recent_next];
+  recent_next = (recent_next + 1) % DUPLICATE_CACHE_SIZE;
+  r.from_node = header->from_node;
+  r.id = header->id;
+  r.sum = sum;
+  r.time = now;
+  return false;
+}
+#endif
 
-/******************************************************************/
 /******************************************************************/
 
-uint8_t RF24Network::enqueue(RF24NetworkHeader* header)
+// Sends the routed frame in frame_buffer on towards @p to_node, or keeps it for forward_update() to send
+bool RF24NetworkBase::forward(uint16_t to_node)
 {
-  bool result = false;
-  uint16_t message_size = frame_size - sizeof(RF24NetworkHeader);
-  
-  IF_SERIAL_DEBUG(printf_P(PSTR("%lu: NET Enqueue @%x "),millis(),next_frame-frame_queue));
-  
-#if !defined ( DISABLE_FRAGMENTATION ) 
+  #if defined (FORWARD_QUEUE_DEPTH)
+  for(uint8_t i = 0; i < FORWARD_QUEUE_DEPTH; i++){
+    RF24NetworkForward& slot = forward_queue[i];
+    if(!slot.size){
+      logicalToPhysicalStruct conversion = { to_node,TX_ROUTED,0 };
+      logicalToPhysicalAddress(&conversion);
+      memcpy(slot.frame,frame_buffer,frame_size);
+      slot.size = frame_size;
+      slot.retries = 0;
+      slot.order = forward_order++;
+      slot.next_hop = conversion.send_node;
+      return true;
+    }
+  }
+  IF_SERIAL_DEBUG_ROUTING( printf_P(PSTR("%lu: NET Forward queue full, sending to 0%o now\n\r"),(unsigned long)millis(),to_node); );
+  #endif
+  return write(to_node,TX_ROUTED);
+}
 
-  bool isFragment = header->type == NETWORK_FIRST_FRAGMENT || header->type == NETWORK_MORE_FRAGMENTS || header->type == NETWORK_LAST_FRAGMENT || header->type == NETWORK_MORE_FRAGMENTS_NACK ;
+#if defined (FORWARD_QUEUE_DEPTH)
+/******************************************************************/
 
-  if(isFragment){
+// Sends the queued routed frames, the oldest first, to each next hop that is not backing off.
+// The frames go out as they are, in one TX session: the radio stops listening once, and the writing pipe
+// is only opened again for another next hop (see radio_listen()).
+void RF24NetworkBase::forward_update(void)
+{
+  if(forward_sending || (networkFlags & FLAG_FAST_FRAG)){
+    return;
+  }
+  for(uint8_t n = 0; n < FORWARD_QUEUE_DEPTH; n++){
+    uint32_t now = millis();
+    uint8_t next = FORWARD_QUEUE_DEPTH;
+    uint16_t next_age = 0;
+    uint8_t hop = 255;
+
+    for(uint8_t i = 0; i < FORWARD_QUEUE_DEPTH; i++){
+      RF24NetworkForward& slot = forward_queue[i];
+      if(!slot.size){
+        continue;
+      }
+      uint16_t age = forward_order - slot.order;
+      if(next < FORWARD_QUEUE_DEPTH && age <= next_age){
+        continue;
+      }
+      uint8_t h = neighbor_index(slot.next_hop);
+      if(h < 6 && (int32_t)(now - forward_backoff[h]) < 0){
+        continue;
+      }
+      #if defined (FLOW_CONTROL_TIMEOUT)
+      if(!credit_ok(slot.next_hop)){
+        continue;
+      }
+      #endif
+      next = i;
+      next_age = age;
+      hop = h;
+    }
+    if(next == FORWARD_QUEUE_DEPTH){
+      break;
+    }
 
-	if(header->type == NETWORK_FIRST_FRAGMENT){
-	    // Drop frames exceeding max size and duplicates (MAX_PAYLOAD_SIZE needs to be divisible by 24)
-        if(header->reserved > (uint16_t(MAX_PAYLOAD_SIZE) / max_frame_payload_size) ){
+    RF24NetworkForward& slot = forward_queue[next];
+    RF24NetworkHeader* header = (RF24NetworkHeader*)slot.frame;
+    bool ok;
+    #if !defined (DUAL_HEAD_RADIO)
+    // The last hop answers acknowledged types with a NETWORK_ACK, which write() sends
+    if(hop < 6 && !(header->to_node == slot.next_hop && header->type > 64 && header->type < 192)){
+      uint64_t out_pipe = parent_pipe_address;
+      if(hop){
+        out_pipe = child_pipe_address;
+        reinterpret_cast<uint8_t*>(&out_pipe)[node_level + 1] = address_translation[hop];
+      }
+      radio_listen(false);
+      radio_auto_ack(true);
+      radio_writing_pipe(out_pipe);
+      // Only the radio's own retries, the frame is tried again later
+      radio.writeFast(slot.frame,slot.size,0);
+      ok = radio.txStandBy();
+      #if defined ENABLE_NETWORK_STATS
+      if(ok){ ++nOK; }else{ ++nFails; }
+      stats_tx(slot.next_hop,ok);
+      #endif
+      IF_NETWORK_TRACE( trace_event(TRACE_MAC_TX,slot.next_hop,header->id,ok); );
+      #if defined (RF24_LINUX)
+      if(capture_file){
+        capture_frame(ok ? CAPTURE_TX_OK : CAPTURE_TX_FAIL,hop ? 5 : parent_pipe,slot.frame,slot.size);
+      }
+      #endif
+    }else
+    #endif
+    {
+      memcpy(frame_buffer,slot.frame,slot.size);
+      frame_size = slot.size;
+      forward_sending = true;
+      ok = write(header->to_node,TX_ROUTED);
+      forward_sending = false;
+    }
+    if(ok || ++slot.retries > 3){
+      if(!ok){
+        IF_SERIAL_DEBUG_ROUTING( printf_P(PSTR("%lu: NET Forward to 0%o dropped\n\r"),(unsigned long)millis(),header->to_node); );
+        IF_NETWORK_TRACE( trace_event(TRACE_FORWARD_DROP,header->to_node,header->id,header->type); );
+      }
+      slot.size = 0;
+    }else if(hop < 6){
+      // Give the next hop time to clear whatever kept it from answering, longer each time
+      forward_backoff[hop] = now + (5UL << slot.retries);
+    }
+  }
 
-  #if defined (SERIAL_DEBUG_FRAGMENTATION) || defined (SERIAL_DEBUG_MINIMAL)
-			printf_P(PSTR("Frag frame with %d frags exceeds MAX_PAYLOAD_SIZE or out of sequence\n"),header->reserved);
+  #if !defined (DUAL_HEAD_RADIO)
+  radio_listen(true);
   #endif
-			frag_queue.header.reserved = 0;
-			return false;
-		}else
-        if(frag_queue.header.id == header->id && frag_queue.header.from_node == header->from_node){
-            return true;
-        }
-        
-        if( (header->reserved * 24) > (MAX_PAYLOAD_SIZE - (next_frame-frame_queue)) ){
-          networkFlags |= FLAG_HOLD_INCOMING;
-          radio.stopListening();
-        }
-  		  
-		memcpy(&frag_queue,&frame_buffer,8);
-		memcpy(frag_queue.message_buffer,frame_buffer+sizeof(RF24NetworkHeader),message_size);
-		
-//IF_SERIAL_DEBUG_FRAGMENTATION( Serial.print(F("queue first, total frags ")); Serial.println(header->reserved); );
-		//Store the total size of the stored frame in message_size
-	    frag_queue.message_size = message_size;
-		--frag_queue.header.reserved;
-		  
-IF_SERIAL_DEBUG_FRAGMENTATION_L2(  for(int i=0; i<frag_queue.message_size;i++){  Serial.println(frag_queue.message_buffer[i],HEX);  } );
-		
-		return true;		
+}
+#endif
 
-	}else // NETWORK_MORE_FRAGMENTS	
-	if(header->type == NETWORK_LAST_FRAGMENT || header->type == NETWORK_MORE_FRAGMENTS || header->type == NETWORK_MORE_FRAGMENTS_NACK){
-		
-        if(frag_queue.message_size + message_size > MAX_PAYLOAD_SIZE){
-          #if defined (SERIAL_DEBUG_FRAGMENTATION) || defined (SERIAL_DEBUG_MINIMAL)
-          Serial.print(F("Drop frag ")); Serial.print(header->reserved);          
-          Serial.println(F(" Size exceeds max"));
-          #endif
-          frag_queue.header.reserved=0;
-          return false;
-        }
-		if(  frag_queue.header.reserved == 0 || (header->type != NETWORK_LAST_FRAGMENT && header->reserved != frag_queue.header.reserved ) || frag_queue.header.id != header->id ){
-			#if defined (SERIAL_DEBUG_FRAGMENTATION) || defined (SERIAL_DEBUG_MINIMAL)
-			Serial.print(F("Drop frag ")); Serial.print(header->reserved);
-			//Serial.print(F(" header id ")); Serial.print(header->id);
-			Serial.println(F(" Out of order "));
-			#endif
-			return false;
-		}
-		
-		memcpy(frag_queue.message_buffer+frag_queue.message_size,frame_buffer+sizeof(RF24NetworkHeader),message_size);
-	    frag_queue.message_size += message_size;
-		
-		if(header->type != NETWORK_LAST_FRAGMENT){
-		  --frag_queue.header.reserved;
-		  return true;
-		}
-		frag_queue.header.reserved = 0;
-        frag_queue.header.type = header->reserved;
-		
-IF_SERIAL_DEBUG_FRAGMENTATION( printf_P(PSTR("fq 3: %d\n"),frag_queue.message_size); );
-IF_SERIAL_DEBUG_FRAGMENTATION_L2(for(int i=0; i< frag_queue.message_size;i++){ Serial.println(frag_queue.message_buffer[i],HEX); }  );		
-	
-		//Frame assembly complete, copy to main buffer if OK		
-        if(frag_queue.header.type == EXTERNAL_DATA_TYPE){
-           return 2;
-        }
-        #if defined (DISABLE_USER_PAYLOADS)
-		  return 0;
-		#endif
-            
-        if(MAX_PAYLOAD_SIZE - (next_frame-frame_queue) >= frag_queue.message_size){
-          memcpy(next_frame,&frag_queue,10);
-          memcpy(next_frame+10,frag_queue.message_buffer,frag_queue.message_size);
-          next_frame += (10+frag_queue.message_size);
-          #if !defined(ARDUINO_ARCH_AVR)
-          if(uint8_t padding = (frag_queue.message_size+10)%4){
-            next_frame += 4 - padding;
-          }
-          #endif
-          IF_SERIAL_DEBUG_FRAGMENTATION( printf_P(PSTR("enq size %d\n"),frag_queue.message_size); );
-		  return true;
-		}else{
-          radio.stopListening();
-          networkFlags |= FLAG_HOLD_INCOMING;          
-        }
-        IF_SERIAL_DEBUG_FRAGMENTATION( printf_P(PSTR("Drop frag payload, queue full\n")); );
-        return false;
-	}//If more or last fragments
+/******************************************************************/
 
-  }else //else is not a fragment
- #endif // End fragmentation enabled
+#if defined (ENABLE_TYPE_HANDLERS)
+bool RF24NetworkBase::setHandler(uint8_t type, void (*handler)(const RF24NetworkHeader& header, const uint8_t* message, uint16_t len))
+{
+  // The system types are handled by update(), a handler would take NETWORK_ACK from a blocking write() and the
+  // like. Fragments are handed over as the assembled message, by its own type.
+  if(type > MAX_USER_DEFINED_HEADER_TYPE && type != EXTERNAL_DATA_TYPE){
+    return false;
+  }
+  type_handlers[type] = handler;
+  return true;
+}
+#endif
 
-  // Copy the current frame into the frame queue
+/******************************************************************/
 
-#if !defined( DISABLE_FRAGMENTATION )
+// Passes a message for this node to the handler of its type, returns false if it has to be queued
+bool RF24NetworkBase::dispatch(const RF24NetworkHeader& header, const uint8_t* message, uint16_t len)
+{
+  #if defined (ENABLE_TYPE_HANDLERS)
+  if(type_handlers[header.type]){
+    type_handlers[header.type](header,message,len);
+    return true;
+  }
+  #endif
+  return false;
+}
 
-	if(header->type == EXTERNAL_DATA_TYPE){
-		memcpy(&frag_queue,&frame_buffer,8);
-		frag_queue.message_buffer = frame_buffer+sizeof(RF24NetworkHeader);
-		frag_queue.message_size = message_size;
-		return 2;
-	}
-#endif		
-#if defined (DISABLE_USER_PAYLOADS)
-	return 0;
- }
-#else
-  if(message_size + (next_frame-frame_queue) <= MAIN_BUFFER_SIZE){
-	memcpy(next_frame,&frame_buffer,8);
-    memcpy(next_frame+8,&message_size,2);
-	memcpy(next_frame+10,frame_buffer+8,message_size);
-    
-	//IF_SERIAL_DEBUG_FRAGMENTATION( for(int i=0; i<message_size;i++){ Serial.print(next_frame[i],HEX); Serial.print(" : "); } Serial.println(""); );
-    
-	next_frame += (message_size + 10);
-    #if !defined(ARDUINO_ARCH_AVR)
-    if(uint8_t padding = (message_size+10)%4){
-      next_frame += 4 - padding;
-    }
-    #endif
-  //IF_SERIAL_DEBUG_FRAGMENTATION( Serial.print("Enq "); Serial.println(next_frame-frame_queue); );//printf_P(PSTR("enq %d\n"),next_frame-frame_queue); );
-  
-    result = true;
-  }else{
-    result = false;
-    IF_SERIAL_DEBUG(printf_P(PSTR("NET **Drop Payload** Buffer Full")));
+/******************************************************************/
+
+// The slot of a neighbor in per-neighbor state: 0 for the parent, the digit for a direct child, 255 for other nodes
+uint8_t RF24NetworkBase::neighbor_index(uint16_t node)
+{
+  if( node_address && node == parent_node ){
+    return 0;
   }
-  return result;
+  if( node != node_address && is_direct_child(node) ){
+    return (node >> (node_level * 3)) & 07;
+  }
+  return 255;
 }
-#endif //USER_PAYLOADS_ENABLED
 
-#endif //End not defined RF24_Linux
 /******************************************************************/
 
-bool RF24Network::available(void)
+// The parent or child a routed frame from @p from_node arrived through
+uint16_t RF24NetworkBase::neighbor_of(uint16_t from_node)
 {
-#if defined (RF24_LINUX)
-  return (!frame_queue.empty());
-#else
-  // Are there frames on the queue for us?
-  return (next_frame > frame_queue);
-#endif
+  return is_descendant(from_node) ? direct_child_route_to(from_node) : parent_node;
 }
 
 /******************************************************************/
 
-uint16_t RF24Network::parent() const
+// Leaves further payloads in the radio until the queues have room
+void RF24NetworkBase::hold_incoming(void)
 {
-  if ( node_address == 0 )
-    return -1;
-  else
-    return parent_node;
+  #if defined ENABLE_NETWORK_STATS
+  if( !(networkFlags & FLAG_HOLD_INCOMING) ){
+    net_stats.holds++;
+  }
+  #endif
+  IF_NETWORK_TRACE( if( !(networkFlags & FLAG_HOLD_INCOMING) ){ trace_event(TRACE_HOLD,0,0,0); } );
+  networkFlags |= FLAG_HOLD_INCOMING;
 }
 
+#if defined (FLOW_CONTROL_TIMEOUT)
+
 /******************************************************************/
-/*uint8_t RF24Network::peekData(){
-		
-		return frame_queue[0];
-}*/
 
-uint16_t RF24Network::peek(RF24NetworkHeader& header)
+// How many more frames the receive queue can take
+uint8_t RF24NetworkBase::credit_available(void)
 {
-  if ( available() )
-  {
   #if defined (RF24_LINUX)
-    RF24NetworkFrame frame = frame_queue.front();
-    memcpy(&header,&frame.header,sizeof(RF24NetworkHeader));
-    return frame.message_size;
+  return rf24_min(FRAME_QUEUE_DEPTH - frame_queue.size(),255);
   #else
-	RF24NetworkFrame *frame = (RF24NetworkFrame*)(frame_queue);
-	memcpy(&header,&frame->header,sizeof(RF24NetworkHeader));
-    uint16_t msg_size;
-    memcpy(&msg_size,frame_queue+8,2);
-    return msg_size;
+  if( networkFlags & FLAG_HOLD_INCOMING ){
+    return 0;
+  }
+  return rf24_min(queue_space(frame_queue) / (MAX_FRAME_SIZE + 2),255);
   #endif
+}
+
+/******************************************************************/
+
+// Whether data may be sent to @p next_hop, which has not said it is full, or not recently
+bool RF24NetworkBase::credit_ok(uint16_t next_hop)
+{
+  uint8_t i = neighbor_index(next_hop);
+  if( i > 5 || neighbor_credit[i] ){
+    return true;
   }
-  return 0;
+  if( millis() - neighbor_credit_time[i] > FLOW_CONTROL_TIMEOUT ){
+    // The update may have been lost, try again
+    neighbor_credit[i] = 255;
+    return true;
+  }
+  return false;
 }
 
 /******************************************************************/
 
-uint16_t RF24Network::read(RF24NetworkHeader& header,void* message, uint16_t maxlen)
+void RF24NetworkBase::credit_send(uint16_t neighbor, uint8_t credit)
 {
-  uint16_t bufsize = 0;
+  RF24NetworkHeader* header = (RF24NetworkHeader*)frame_buffer;
+  header->from_node = node_address;
+  header->to_node = neighbor;
+  header->id = RF24NetworkHeader::next_id++;
+  header->type = NETWORK_CREDIT;
+  header->reserved = credit;
+  frame_size = sizeof(RF24NetworkHeader);
+  write(neighbor,TX_NORMAL);
+  #if !defined (RF24_LINUX)
+  if( networkFlags & FLAG_HOLD_INCOMING ){
+    // write() listens again when done
+    radio_listen(false);
+  }
+  #endif
+}
 
- #if defined (RF24_LINUX)
-   if ( available() ) {
-    RF24NetworkFrame frame = frame_queue.front();
+/******************************************************************/
 
-    // How much buffer size should we actually copy?
-    bufsize = rf24_min(frame.message_size,maxlen);
-    memcpy(&header,&(frame.header),sizeof(RF24NetworkHeader));
-    memcpy(message,frame.message_buffer,bufsize);
+// Tells the neighbors that were sent a count of 0 how much room there is now
+void RF24NetworkBase::credit_grant(void)
+{
+  uint8_t credit = credit_available();
+  for( uint8_t i = 0; i < 6; i++ ){
+    if( credit_refused & _BV(i) ){
+      credit_send(i ? node_address | (i << (node_level * 3)) : parent_node, credit);
+    }
+  }
+  credit_refused = 0;
+}
 
-    IF_SERIAL_DEBUG(printf("%u: FRG message size %i\n",millis(),frame.message_size););
-    IF_SERIAL_DEBUG(printf("%u: FRG message ",millis()); const char* charPtr = reinterpret_cast<const char*>(message); for (uint16_t i = 0; i < bufsize; i++) { printf("%02X ", charPtr[i]); }; printf("\n\r"));	
-	
-    IF_SERIAL_DEBUG(printf_P(PSTR("%u: NET read %s\n\r"),millis(),header.toString()));
+/******************************************************************/
 
-    frame_queue.pop();
+// Runs update() until the next hop toward @p to_node has room, or has not said so for FLOW_CONTROL_TIMEOUT ms.
+// The fragments of a blocking write() would otherwise be given up without trying the radio.
+void RF24NetworkBase::credit_wait(uint16_t to_node)
+{
+  logicalToPhysicalStruct conversion = { to_node,TX_NORMAL,0 };
+  logicalToPhysicalAddress(&conversion);
+  while( !credit_ok(conversion.send_node) ){
+    update();
+    #if defined (RF24_LINUX)
+    delayMicroseconds(900);
+    #endif
   }
-#else  
-  if ( available() )
-  {
-    
-	memcpy(&header,frame_queue,8);
-    memcpy(&bufsize,frame_queue+8,2);
+}
+#endif
 
-    if (maxlen > 0)
-    {		
-		maxlen = rf24_min(maxlen,bufsize);
-		memcpy(message,frame_queue+10,maxlen);
-	    IF_SERIAL_DEBUG(printf("%lu: NET message size %d\n",millis(),bufsize););
 
-	
-	IF_SERIAL_DEBUG( uint16_t len = maxlen; printf_P(PSTR("%lu: NET r message "),millis());const uint8_t* charPtr = reinterpret_cast<const uint8_t*>(message);while(len--){ printf("%02x ",charPtr[len]);} printf_P(PSTR("\n\r") ) );      
+#if defined (RF24_LINUX)
+/******************************************************************/
+
+uint8_t RF24NetworkBase::enqueue(RF24NetworkHeader* header) {
+  uint8_t result = false;
+  
+  bool isFragment = ( header->type == NETWORK_FIRST_FRAGMENT || header->type == NETWORK_MORE_FRAGMENTS || header->type == NETWORK_LAST_FRAGMENT || header->type == NETWORK_MORE_FRAGMENTS_NACK);
+  
+  // This is sent to itself
+  bool toSelf = header->from_node == node_address;
+  if (toSelf && isFragment) {    
+    printf("Cannot enqueue multi-payload frames to self\n");
+    result = false;
+  }else  
+#if !defined (DISABLE_FRAGMENTATION)
+  if (isFragment)
+  {
+    //The received frame contains the a fragmented payload
+    //Set the more fragments flag to indicate a fragmented frame
+    IF_SERIAL_DEBUG_FRAGMENTATION_L2(printf("%u: FRG Payload type %d of size %i Bytes with fragmentID '%i' received.\n\r",millis(),header->type,frame_size-sizeof(RF24NetworkHeader),header->reserved););
+    RF24NetworkFragment* f = fragmentCacheFind(header->from_node,header->id,true);
+    if (f->state == FRAGMENT_SLOT_DONE) {
+      // A copy of a fragment of a message that was already delivered, the sender missed the report. Only the copies
+      // that ask for one are answered, not those a sender falls back to sending without selective repeat
+      if (f->map.nack && (header->type == NETWORK_LAST_FRAGMENT || (header->reserved & FRAGMENT_REPORT))) {
+        fragmentReport(*header,NULL);
+      }
+      return false;
+    }
+    result = fragmentStore(f->map,f->frame.message_buffer,*header,frame_buffer+sizeof(RF24NetworkHeader),frame_size-sizeof(RF24NetworkHeader));
+    if (result) {
+      f->updated = millis();
+    }
+
+    bool dropped = false;
+    uint16_t message_size = result ? fragmentAssemble(f->map,f->frame.message_buffer,*header,dropped) : 0;
+    if ( dropped ) {
+      // Sending it again would not help, copies of its fragments are answered like those of a delivered message
+      f->state = FRAGMENT_SLOT_DONE;
+      if (f->map.nack) {
+        fragmentReport(*header,NULL);
+      }
+      return false;
+    }
+    if ( message_size ) {
+	  IF_SERIAL_DEBUG_FRAGMENTATION(printf("%u: FRG All fragments received. \n",millis() ););
+      IF_SERIAL_DEBUG(printf_P(PSTR("%u: NET Enqueue assembled frame @%x "),millis(),frame_queue.size()));
+	  
+      f->frame.header = *header;
+      //The user specified header.type is sent with the last fragment in the reserved field
+      f->frame.header.type = f->map.type;
+      f->frame.header.reserved = 1;
+      f->frame.message_size = message_size;
+	  result=f->frame.header.type == EXTERNAL_DATA_TYPE ? 2 : 1;
 	  
+	  //Load external payloads into a separate queue on linux, unless a handler takes the message
+	  if( dispatch(f->frame.header,f->frame.message_buffer,message_size) ){
+	    result = true;
+	  }else
+	  if( !(result == 2 ? external_queue : queue_for(f->frame.header.type)).push(f->frame) ){
+	    IF_SERIAL_DEBUG(printf_P(PSTR("NET **Drop Payload** Buffer Full")));
+	    #if defined ENABLE_NETWORK_STATS
+	    net_stats.frag_queue_full++;
+	    #endif
+	    IF_NETWORK_TRACE( trace_event(TRACE_FRAGMENT_DROP,header->from_node,header->id,2); );
+	    fragmentCacheDelete(f);
+	    return false;
+	  }
+      f->state = FRAGMENT_SLOT_DONE;
+      if (f->map.nack) {
+        fragmentReport(*header,NULL);
+      }
+	}else
+	if ( header->type == NETWORK_LAST_FRAGMENT && f->map.nack ) {
+	  // Tell the sender which fragments are still missing
+	  fragmentReport(*header,&f->map);
+	}
+
+  }else
+#endif // End fragmentation enabled
+  {//  if (frame.header.type <= MAX_USER_DEFINED_HEADER_TYPE) {
+    //This is not a fragmented payload but a whole frame.
+
+    IF_SERIAL_DEBUG(printf_P(PSTR("%u: NET Enqueue @%x "),millis(),frame_queue.size()));
+	result=header->type == EXTERNAL_DATA_TYPE && !toSelf ? 2 : 1;
+    //Load external payloads into a separate queue on linux
+    RF24NetworkFrameQueue& queue = result == 2 ? external_queue : queue_for(header->type);
+
+    // Build the frame directly in the queue
+    RF24NetworkFrame* frame = queue.reserve();
+    if ( frame ){
+      frame->header = *header;
+      frame->message_size = frame_size-sizeof(RF24NetworkHeader);
+      memcpy(frame->message_buffer,frame_buffer+sizeof(RF24NetworkHeader),frame->message_size);
+      queue.commit();
+    }else{
+      IF_SERIAL_DEBUG(printf_P(PSTR("NET **Drop Payload** Buffer Full")));
+      #if defined ENABLE_NETWORK_STATS
+      net_stats.queue_drops++;
+      #endif
+      result = false;
+    }
+
+  }/* else {
+    //Undefined/Unknown header.type received. Drop frame!
+    IF_SERIAL_DEBUG_MINIMAL( printf("%u: FRG Received unknown or system header type %d with fragment id %d\n",millis(),frame.header.type, frame.header.reserved); );
+    //The frame is not explicitly dropped, but the given object is ignored.
+    //FIXME: does this causes problems with memory management?
+  }*/
+
+  if (result) {
+    //IF_SERIAL_DEBUG(printf("ok\n\r"));
+    #if defined ENABLE_NETWORK_STATS
+    net_stats.queue_high_water = rf24_max(net_stats.queue_high_water,(uint16_t)frame_queue.size());
+    #endif
+  } else {
+    IF_SERIAL_DEBUG(printf("failed\n\r"));
+  }
+
+  return result;
+}
+
+/******************************************************************/
+#if !defined (DISABLE_FRAGMENTATION)
+
+RF24NetworkBase::RF24NetworkFragment* RF24NetworkBase::fragmentCacheFind(uint16_t from_node, uint16_t id, bool create) {
+
+  // Open addressing with linear probing. Deleted slots keep the probe chain intact,
+  // and slots not updated for FRAGMENT_CACHE_TIMEOUT ms count as deleted.
+  // The same probe finds the slot a new message goes to.
+  uint32_t now = millis();
+  RF24NetworkFragment* freeSlot = NULL;
+  RF24NetworkFragment* oldest = NULL;
+  uint16_t i = (uint16_t)(from_node * 31 + id) % FRAGMENT_CACHE_SLOTS;
+
+  for (uint16_t probes = 0; probes < FRAGMENT_CACHE_SLOTS; probes++, i = (i + 1) % FRAGMENT_CACHE_SLOTS) {
+    RF24NetworkFragment* f = &frameFragmentsCache[i];
+    if ((f->state == FRAGMENT_SLOT_USED || f->state == FRAGMENT_SLOT_DONE) && now - f->updated > FRAGMENT_CACHE_TIMEOUT) {
+      IF_SERIAL_DEBUG_FRAGMENTATION(if (f->state == FRAGMENT_SLOT_USED) printf("%u: FRG Partial frame id %d from 0%o timed out\n",millis(),f->frame.header.id,f->frame.header.from_node););
+      fragmentCacheDelete(f);
+    }
+    if (f->state == FRAGMENT_SLOT_USED || f->state == FRAGMENT_SLOT_DONE) {
+      if (f->frame.header.from_node == from_node && f->frame.header.id == id) {
+        return f;
+      }
+    }
+    if (f->state == FRAGMENT_SLOT_USED) {
+      if (!oldest || now - f->updated > now - oldest->updated) {
+        oldest = f;
+      }
+      continue;
+    }
+    if (!freeSlot) {
+      freeSlot = f;
+    }
+    if (f->state == FRAGMENT_SLOT_EMPTY) {
+      break;
+    }
+  }
+  if (!create) {
+    return NULL;
+  }
+  // All slots hold partial messages, drop the one that waited longest
+  if (!freeSlot) {
+    IF_SERIAL_DEBUG_FRAGMENTATION(printf("%u: FRG Cache full, dropping partial frame id %d from 0%o\n",millis(),oldest->frame.header.id,oldest->frame.header.from_node););
+    freeSlot = oldest;
+  }
+  freeSlot->state = FRAGMENT_SLOT_USED;
+  freeSlot->updated = now;
+  freeSlot->frame.header.from_node = from_node;
+  freeSlot->frame.header.id = id;
+  memset(&freeSlot->map,0,sizeof(freeSlot->map));
+  return freeSlot;
+}
+
+/******************************************************************/
+
+void RF24NetworkBase::fragmentCacheDelete(RF24NetworkFragment* f) {
+
+  // A deleted slot only has to stay a tombstone while a probe chain runs on past it. When the slots after it are
+  // deleted up to an empty one, or the whole table is deleted, that run of tombstones goes back to empty,
+  // so misses do not probe the whole table once every slot was used.
+  f->state = FRAGMENT_SLOT_DELETED;
+  uint16_t end = f - frameFragmentsCache;
+  uint16_t run = 0;
+  do {
+    end = (end + 1) % FRAGMENT_CACHE_SLOTS;
+    run++;
+  } while (run < FRAGMENT_CACHE_SLOTS && frameFragmentsCache[end].state == FRAGMENT_SLOT_DELETED);
+  if (run < FRAGMENT_CACHE_SLOTS && frameFragmentsCache[end].state != FRAGMENT_SLOT_EMPTY) {
+    return;
+  }
+  for (uint16_t i = (end + FRAGMENT_CACHE_SLOTS - 1) % FRAGMENT_CACHE_SLOTS; run; run--, i = (i + FRAGMENT_CACHE_SLOTS - 1) % FRAGMENT_CACHE_SLOTS) {
+    frameFragmentsCache[i].state = FRAGMENT_SLOT_EMPTY;
+  }
+}
+#endif
+
+/******************************************************************/
+
+// The queue for a message of @p type
+RF24NetworkFrameQueue& RF24NetworkBase::queue_for(uint8_t type)
+{
+  if( is_priority(type) && PRIORITY_QUEUE_DEPTH ){
+    return priority_queue;
+  }
+  return frame_queue;
+}
+
+/******************************************************************/
+
+/******************************************************************/
+/******************************************************************/
+
+#else // Not defined RF24_Linux:
+
+/******************************************************************/
+/******************************************************************/
+
+uint16_t RF24NetworkBase::queue_record_size(uint16_t message_size)
+{
+  uint16_t size = message_size + 10;
+  #if !defined(ARDUINO_ARCH_AVR)
+  // Keep frames 4-byte aligned
+  if(uint8_t padding = size%4){
+    size += 4 - padding;
+  }
+  #endif
+  return size;
+}
+
+/******************************************************************/
+
+uint16_t RF24NetworkBase::queue_space(const RF24NetworkByteQueue& queue)
+{
+  #if defined (DISABLE_USER_PAYLOADS)
+  // Nothing is stored, there is always room
+  return max_payload_size + 10;
+  #endif
+  // The queue is a ring of frames that never wrap around the end of the buffer.
+  // When there is no room at the end, storing continues at the start, and wrap marks where the older frames end.
+  if( queue.wrap ){
+    return queue.head - queue.tail;
+  }
+  return rf24_max((uint16_t)(queue.size - queue.tail), queue.head);
+}
+
+/******************************************************************/
+
+uint8_t* RF24NetworkBase::queue_alloc(RF24NetworkByteQueue& queue, uint16_t message_size)
+{
+  uint16_t size = message_size + 10;
+
+  if( !queue.wrap && queue.size - queue.tail < size && queue.head >= size ){
+    // No room left at the end, wrap around
+    queue.wrap = queue.tail;
+    queue.tail = 0;
+  }
+  if( (queue.wrap ? queue.head - queue.tail : queue.size - queue.tail) < size ){
+    return NULL;
+  }
+  uint8_t* frame = queue.buffer + queue.tail;
+  // Padding is skipped, but never past the end of the buffer
+  queue.tail = rf24_min(queue.tail + queue_record_size(message_size), queue.size);
+  #if defined ENABLE_NETWORK_STATS
+  if(&queue == &frame_queue){
+    uint16_t used = queue.wrap ? queue.wrap - queue.head + queue.tail : queue.tail - queue.head;
+    net_stats.queue_high_water = rf24_max(net_stats.queue_high_water,used);
+  }
+  #endif
+  return frame;
+}
+
+/******************************************************************/
+
+// The queue for a message of @p type, priority messages that can never fit the priority queue go with the others
+RF24NetworkBase::RF24NetworkByteQueue& RF24NetworkBase::queue_for(uint8_t type, uint16_t message_size)
+{
+  if( is_priority(type) && priority_queue.size >= message_size + 10 ){
+    return priority_queue;
+  }
+  return frame_queue;
+}
+
+/******************************************************************/
+
+uint8_t RF24NetworkBase::enqueue(RF24NetworkHeader* header)
+{
+  uint8_t result = false;
+  uint16_t message_size = frame_size - sizeof(RF24NetworkHeader);
+  
+  IF_SERIAL_DEBUG(printf_P(PSTR("%lu: NET Enqueue @%x "),millis(),frame_queue.tail));
+  
+#if !defined ( DISABLE_FRAGMENTATION ) 
+
+  bool isFragment = header->type == NETWORK_FIRST_FRAGMENT || header->type == NETWORK_MORE_FRAGMENTS || header->type == NETWORK_LAST_FRAGMENT || header->type == NETWORK_MORE_FRAGMENTS_NACK ;
+
+  if(isFragment){
+
+	if(frag_queue.header.id != header->id || frag_queue.header.from_node != header->from_node){
+		// Fragments of a new message, whatever was being assembled is dropped
+		frag_queue.header = *header;
+		frag_queue.message_buffer = frag_queue_message_buffer;
+		frag_queue.message_size = 0;
+		memset(&frag_map,0,sizeof(frag_map));
+		frag_done = false;
+	}else
+	if(frag_done){
+		// A copy of a fragment of a message that was already delivered, the sender missed the report. Only the copies
+		// that ask for one are answered, not those a sender falls back to sending without selective repeat
+		if(frag_map.nack && (header->type == NETWORK_LAST_FRAGMENT || (header->reserved & FRAGMENT_REPORT))){
+			fragmentReport(*header,NULL);
+		}
+		return false;
+	}
+
+	result = fragmentStore(frag_map,frag_queue_message_buffer,*header,frame_buffer+sizeof(RF24NetworkHeader),message_size);
+
+	// The countdown of the first fragment, without the FRAGMENT_COMPRESSED and FRAGMENT_REPORT flags, tells the size of the message
+	if(result && header->type == NETWORK_FIRST_FRAGMENT && ((header->reserved & ~(FRAGMENT_COMPRESSED | FRAGMENT_REPORT)) * 24) + 10 > queue_space(frame_queue) ){
+		hold_incoming();
+		radio_listen(false);
+	}
+
+	bool dropped = false;
+	uint16_t size = result ? fragmentAssemble(frag_map,frag_queue_message_buffer,*header,dropped) : 0;
+	if(dropped){
+		// Sending it again would not help, copies of its fragments are answered like those of a delivered message
+		frag_done = true;
+		if(frag_map.nack){
+			fragmentReport(*header,NULL);
+		}
+		return false;
+	}
+	if(!size){
+		if(header->type == NETWORK_LAST_FRAGMENT && frag_map.nack){
+			// Tell the sender which fragments are still missing
+			fragmentReport(*header,&frag_map);
+		}
+		return result;
+	}
+
+	frag_done = true;
+	frag_queue.header.type = frag_map.type;
+	frag_queue.header.reserved = 0;
+	frag_queue.message_size = size;
+
+IF_SERIAL_DEBUG_FRAGMENTATION( printf_P(PSTR("fq 3: %d\n"),frag_queue.message_size); );
+IF_SERIAL_DEBUG_FRAGMENTATION_L2(for(int i=0; i< frag_queue.message_size;i++){ Serial.println(frag_queue.message_buffer[i],HEX); }  );		
+
+	//Frame assembly complete, copy to main buffer if OK		
+	if(dispatch(frag_queue.header,frag_queue.message_buffer,size)){
+		result = true;
+	}else
+	if(frag_queue.header.type == EXTERNAL_DATA_TYPE){
+		result = 2;
+	}else{
+	#if defined (DISABLE_USER_PAYLOADS)
+		result = 0;
+	#else
+		if(uint8_t* next_frame = queue_alloc(queue_for(frag_queue.header.type,frag_queue.message_size),frag_queue.message_size)){
+			memcpy(next_frame,&frag_queue,10);
+			memcpy(next_frame+10,frag_queue.message_buffer,frag_queue.message_size);
+			IF_SERIAL_DEBUG_FRAGMENTATION( printf_P(PSTR("enq size %d\n"),frag_queue.message_size); );
+			result = true;
+		}else{
+			radio_listen(false);
+			hold_incoming();
+			#if defined ENABLE_NETWORK_STATS
+			net_stats.frag_queue_full++;
+			#endif
+			IF_NETWORK_TRACE( trace_event(TRACE_FRAGMENT_DROP,header->from_node,header->id,2); );
+			IF_SERIAL_DEBUG_FRAGMENTATION( printf_P(PSTR("Drop frag payload, queue full\n")); );
+			return false;
+		}
+	#endif
+	}
+	if(frag_map.nack){
+		fragmentReport(*header,NULL);
+	}
+	return result;
+
+  }else //else is not a fragment
+ #endif // End fragmentation enabled
+
+  // Copy the current frame into the frame queue
+
+#if !defined( DISABLE_FRAGMENTATION )
+
+	if(header->type == EXTERNAL_DATA_TYPE){
+		frag_queue.header = *header;
+		frag_queue.message_buffer = frame_buffer+sizeof(RF24NetworkHeader);
+		frag_queue.message_size = message_size;
+		return 2;
+	}
+#endif		
+#if defined (DISABLE_USER_PAYLOADS)
+	return 0;
+ }
+#else
+  if(uint8_t* next_frame = queue_alloc(queue_for(header->type,message_size),message_size)){
+	memcpy(next_frame,&frame_buffer,8);
+    memcpy(next_frame+8,&message_size,2);
+	memcpy(next_frame+10,frame_buffer+8,message_size);
+    
+	//IF_SERIAL_DEBUG_FRAGMENTATION( for(int i=0; i<message_size;i++){ Serial.print(next_frame[i],HEX); Serial.print(" : "); } Serial.println(""); );
+  
+    result = true;
+  }else{
+    result = false;
+    IF_SERIAL_DEBUG(printf_P(PSTR("NET **Drop Payload** Buffer Full")));
+  }
+  return result;
+}
+#endif //USER_PAYLOADS_ENABLED
+
+#endif //End not defined RF24_Linux
+#if !defined (DISABLE_FRAGMENTATION)
+#if defined (ENABLE_COMPRESSION)
+/******************************************************************/
+
+// Compressed messages are a byte aligned LZ77: a control byte below 0x80 is followed by that many plus one literal
+// bytes, a control byte from 0x80 up by one byte d, and copies (control & 0x7F) + 3 bytes from d + 1 bytes back.
+// The window is the 256 bytes before, within the message, so no tables are needed on either end.
+// Returns the compressed size, or 0 if it is @p max bytes or more, or too far ahead to be uncompressed in place
+// in a buffer of @p room bytes.
+static uint16_t compress_payload(const uint8_t* in, uint16_t len, uint8_t* out, uint16_t max, uint16_t room)
+{
+  uint16_t i = 0, o = 0, run = 0, control = 0, ahead = 0;
+  while(i < len){
+    uint8_t best = 0;
+    uint16_t distance = 0;
+    for(uint16_t d = 1; d <= 256 && d <= i; d++){
+      uint8_t n = 0;
+      while(n < 130 && i + n < len && in[i + n] == in[i + n - d]){
+        n++;
+      }
+      if(n > best){
+        best = n;
+        distance = d;
+      }
+    }
+    if(best >= 3){
+      if(o + 2 >= max){
+        return 0;
+      }
+      out[o++] = 0x80 | (best - 3);
+      out[o++] = distance - 1;
+      i += best;
+      run = 0;
+    }else{
+      if(run == 0 || run == 128){
+        control = o++;
+        run = 0;
+      }
+      if(o + 1 >= max){
+        return 0;
+      }
+      out[control] = run++;
+      out[o++] = in[i++];
+    }
+    if(i > o && i - o > ahead){
+      ahead = i - o;
+    }
+  }
+  // The receiver unpacks from the end of its buffer to the start, the output must stay behind the input
+  return ahead + o <= room ? o : 0;
+}
+
+/******************************************************************/
+
+// Uncompresses @p len bytes at @p in to @p out, which may start before @p in in the same buffer.
+// Returns the size of the message, or 0 if the data is invalid, does not fit in @p max bytes, or would overwrite input not read yet
+static uint16_t uncompress_payload(const uint8_t* in, uint16_t len, uint8_t* out, uint16_t max)
+{
+  const uint8_t* end = in + len;
+  uint16_t o = 0;
+  while(in < end){
+    uint8_t control = *in++;
+    if(control < 0x80){
+      uint8_t n = control + 1;
+      if(in + n > end || o + n > max || out + o > in){
+        return 0;
+      }
+      while(n--){
+        out[o++] = *in++;
+      }
+    }else{
+      if(in == end){
+        return 0;
+      }
+      uint16_t d = *in++ + 1;
+      uint8_t n = (control & 0x7F) + 3;
+      if(d > o || o + n > max || (in < end && out + o + n > in)){
+        return 0;
+      }
+      while(n--){
+        out[o] = out[o - d];
+        o++;
+      }
+    }
+  }
+  return o;
+}
+#endif
+/******************************************************************/
+
+// Fragment n of the countdown is stored at (max_payload_size/24 - n) * 24 in the buffer, so fragments can be
+// placed in any order, even before the first one tells how many there are
+bool RF24NetworkBase::fragmentStore(RF24NetworkFragmentMap& map, uint8_t* buffer, const RF24NetworkHeader& header, const uint8_t* message, uint16_t len)
+{
+  uint8_t fragments = max_payload_size / max_frame_payload_size;
+  uint8_t n = header.type == NETWORK_LAST_FRAGMENT ? 1 : header.reserved;
+  if(header.type != NETWORK_LAST_FRAGMENT && (n & FRAGMENT_REPORT)){
+    n &= ~FRAGMENT_REPORT;
+    map.nack = true;
+  }
+  #if defined (ENABLE_COMPRESSION)
+  if(header.type != NETWORK_LAST_FRAGMENT && (n & FRAGMENT_COMPRESSED)){
+    n &= ~FRAGMENT_COMPRESSED;
+    map.compressed = true;
+  }
+  #endif
+  bool valid = buffer && n > 0 && n <= fragments && (!map.total || n <= map.total) && len <= max_frame_payload_size;
+
+  if(header.type == NETWORK_FIRST_FRAGMENT){
+    valid = valid && n > 1 && !map.total;
+  }else
+  if(header.type != NETWORK_LAST_FRAGMENT){
+    valid = valid && n > 1 && n != map.total;
+  }
+  if(n > 1 && len != max_frame_payload_size){
+    valid = false;
+  }
+  if(!valid || (map.received[n/8] & _BV(n%8)) ){
+    #if defined ENABLE_NETWORK_STATS
+    if(!buffer || n > fragments){
+      net_stats.frag_oversize++;
+    }else{
+      net_stats.frag_invalid++;
+    }
+    #endif
+    IF_NETWORK_TRACE( trace_event(TRACE_FRAGMENT_DROP,header.from_node,header.id,!buffer || n > fragments); );
+    IF_SERIAL_DEBUG_FRAGMENTATION( printf_P(PSTR("%lu: FRG Dropping duplicate or invalid fragment %d of frame id %d\n\r"),(unsigned long)millis(),n,header.id); );
+    return false;
+  }
+
+  IF_NETWORK_TRACE( trace_event(TRACE_FRAGMENT,header.from_node,header.id,n); );
+  memcpy(buffer + (fragments - n) * max_frame_payload_size,message,len);
+  map.received[n/8] |= _BV(n%8);
+  if(header.type == NETWORK_FIRST_FRAGMENT){
+    map.total = n;
+  }else
+  if(header.type == NETWORK_LAST_FRAGMENT){
+    map.last_size = len;
+    map.type = header.reserved; //The user specified header.type is sent with the last fragment in the reserved field
+  }
+  return true;
+}
+
+/******************************************************************/
+
+// Moves a complete message to the start of the buffer and returns its size, or returns 0 if fragments are missing.
+// Sets @p dropped and returns 0 if the message is complete but cannot be delivered.
+uint16_t RF24NetworkBase::fragmentAssemble(const RF24NetworkFragmentMap& map, uint8_t* buffer, const RF24NetworkHeader& header, bool& dropped)
+{
+  dropped = false;
+  if(!map.total){
+    return 0;
+  }
+  for(uint8_t n = 1; n <= map.total; n++){
+    if( !(map.received[n/8] & _BV(n%8)) ){
+      return 0;
+    }
+  }
+  uint16_t size = (map.total - 1) * max_frame_payload_size + map.last_size;
+  uint8_t* message = buffer + (max_payload_size / max_frame_payload_size - map.total) * max_frame_payload_size;
+  #if defined (ENABLE_COMPRESSION)
+  if(map.compressed){
+    // The uncompressed size comes first, the rest is uncompressed from the end of that many bytes to their start
+    uint16_t message_size = message[0] | message[1] << 8;
+    size -= 2;
+    if(message_size > max_payload_size){
+      #if defined ENABLE_NETWORK_STATS
+      net_stats.frag_oversize++;
+      #endif
+      IF_NETWORK_TRACE( trace_event(TRACE_FRAGMENT_DROP,header.from_node,header.id,1); );
+      IF_SERIAL_DEBUG_FRAGMENTATION( printf_P(PSTR("%lu: FRG Dropping compressed frame id %d of %d bytes, too large\n\r"),(unsigned long)millis(),header.id,message_size); );
+      dropped = true;
+      return 0;
+    }
+    if(message_size >= size){
+      memmove(buffer + message_size - size,message + 2,size);
+      if(uncompress_payload(buffer + message_size - size,size,buffer,message_size) == message_size){
+        return message_size;
+      }
+    }
+    #if defined ENABLE_NETWORK_STATS
+    net_stats.frag_corrupt++;
+    #endif
+    IF_NETWORK_TRACE( trace_event(TRACE_FRAGMENT_DROP,header.from_node,header.id,3); );
+    IF_SERIAL_DEBUG_FRAGMENTATION( printf_P(PSTR("%lu: FRG Dropping compressed frame id %d, it does not uncompress\n\r"),(unsigned long)millis(),header.id); );
+    dropped = true;
+    return 0;
+  }
+  #endif
+  memmove(buffer,message,size);
+  return size;
+}
+
+/******************************************************************/
+
+// Sends a NETWORK_FRAGMENT_NACK to the sender of @p header, listing the fragments in @p map, or none if the message is complete
+void RF24NetworkBase::fragmentReport(const RF24NetworkHeader& header, const RF24NetworkFragmentMap* map)
+{
+  RF24NetworkHeader report;
+  report.to_node = header.from_node;
+  report.id = header.id;
+  report.type = NETWORK_FRAGMENT_NACK;
+  report.reserved = map ? map->total : 0;
+  uint8_t len = map ? sizeof(map->received) : 0;
+  frame_size = sizeof(RF24NetworkHeader) + len;
+  _write(report,map ? map->received : NULL,len,070);
+}
+
+#endif
+/******************************************************************/
+
+bool RF24NetworkBase::available(void)
+{
+  // Are there frames on the queues for us?
+  return !frame_queue.empty() || !priority_queue.empty();
+}
+
+/******************************************************************/
+
+uint16_t RF24NetworkBase::parent() const
+{
+  if ( node_address == 0 )
+    return -1;
+  else
+    return parent_node;
+}
+
+/******************************************************************/
+/*uint8_t RF24NetworkBase::peekData(){
+		
+		return frame_queue[0];
+}*/
+
+uint16_t RF24NetworkBase::peek(RF24NetworkHeader& header)
+{
+  const uint8_t* message;
+  uint16_t msg_size = 0;
+  const RF24NetworkHeader* next = borrow(message,msg_size);
+  if ( next )
+  {
+    memcpy(&header,next,sizeof(RF24NetworkHeader));
+  }
+  return msg_size;
+}
+
+/******************************************************************/
+
+const RF24NetworkHeader* RF24NetworkBase::borrow(const uint8_t*& message, uint16_t& len)
+{
+  if ( !available() )
+    return NULL;
+
+  // release() drops the message from the same queue, even if a priority message arrives in between
+  priority_borrowed = !priority_queue.empty();
+#if defined (RF24_LINUX)
+  // Queued frames never move, so the pointers stay valid until pop()
+  const RF24NetworkFrame& frame = priority_borrowed ? priority_queue.front() : frame_queue.front();
+  message = frame.message_buffer;
+  len = frame.message_size;
+  return &frame.header;
+#else
+  // Frames are stored as header, 2-byte size, then message
+  const RF24NetworkByteQueue& queue = priority_borrowed ? priority_queue : frame_queue;
+  const uint8_t* frame = queue.buffer+queue.head;
+  memcpy(&len,frame+8,2);
+  message = frame+10;
+  return (const RF24NetworkHeader*)frame;
+#endif
+}
+
+/******************************************************************/
+
+void RF24NetworkBase::release(void)
+{
+  if ( !available() )
+    return;
+
+  bool priority = priority_borrowed ? !priority_queue.empty() : frame_queue.empty();
+#if defined (RF24_LINUX)
+  if ( priority )
+    priority_queue.pop();
+  else
+    frame_queue.pop();
+#else
+  RF24NetworkByteQueue& queue = priority ? priority_queue : frame_queue;
+  uint16_t bufsize;
+  memcpy(&bufsize,queue.buffer+queue.head+8,2);
+
+  queue.head = rf24_min(queue.head + queue_record_size(bufsize), queue.size);
+  if( queue.wrap && queue.head >= queue.wrap ){
+    // Continue with the frames stored at the start of the buffer
+    queue.head = 0;
+    queue.wrap = 0;
+  }
+  if( queue.empty() ){
+    // Empty, start over to leave the most contiguous space
+    queue.head = queue.tail = 0;
+  }
+#endif
+  // Without a new borrow(), the next release() drops the next message
+  priority_borrowed = !priority_queue.empty();
+}
+
+/******************************************************************/
+
+void RF24NetworkBase::setPriority(uint8_t type, bool priority)
+{
+  if( priority ){
+    priority_types[type>>3] |= _BV(type&7);
+  }else{
+    priority_types[type>>3] &= ~_BV(type&7);
+  }
+}
+
+/******************************************************************/
+
+uint16_t RF24NetworkBase::read(RF24NetworkHeader& header,void* message, uint16_t maxlen)
+{
+  uint16_t bufsize = 0;
+  const uint8_t* payload;
+  const RF24NetworkHeader* next = borrow(payload,bufsize);
+
+  if ( next )
+  {
+    memcpy(&header,next,sizeof(RF24NetworkHeader));
+ #if defined (RF24_LINUX)
+    // How much buffer size should we actually copy?
+    bufsize = rf24_min(bufsize,maxlen);
+    memcpy(message,payload,bufsize);
+
+    IF_SERIAL_DEBUG(printf("%u: FRG message size %i\n",millis(),bufsize););
+    IF_SERIAL_DEBUG(printf("%u: FRG message ",millis()); const char* charPtr = reinterpret_cast<const char*>(message); for (uint16_t i = 0; i < bufsize; i++) { printf("%02X ", charPtr[i]); }; printf("\n\r"));	
+	
+    IF_SERIAL_DEBUG(printf_P(PSTR("%u: NET read %s\n\r"),millis(),header.toString()));
+ #else
+    if (maxlen > 0)
+    {		
+		maxlen = rf24_min(maxlen,bufsize);
+		memcpy(message,payload,maxlen);
+	    IF_SERIAL_DEBUG(printf("%lu: NET message size %d\n",millis(),bufsize););
+
+	
+	IF_SERIAL_DEBUG( uint16_t len = maxlen; printf_P(PSTR("%lu: NET r message "),millis());const uint8_t* charPtr = reinterpret_cast<const uint8_t*>(message);while(len--){ printf("%02x ",charPtr[len]);} printf_P(PSTR("\n\r") ) );      
+	  
+    }
+	//IF_SERIAL_DEBUG(printf_P(PSTR("%lu: NET Received %s\n\r"),millis(),header.toString()));
+ #endif
+    release();
+  }
+  return bufsize;
+}
+
+
+#if defined RF24NetworkMulticast
+/******************************************************************/
+bool RF24NetworkBase::multicast(RF24NetworkHeader& header,const void* message, uint16_t len, uint8_t level){
+	// Fill out the header
+  header.to_node = 0100;
+  header.from_node = node_address;
+  return write(header, message, len, levelToAddress(level));
+}
+#endif
+
+/******************************************************************/
+bool RF24NetworkBase::write(RF24NetworkHeader& header,const void* message, uint16_t len){    
+	return write(header,message,len,070);
+}
+/******************************************************************/
+bool RF24NetworkBase::write(RF24NetworkHeader& header,const void* message, uint16_t len, uint16_t writeDirect){
+
+    // The sketch may have used the radio itself since the last write
+    radio_stale();
+    
+#if defined ENABLE_NETWORK_STATS
+    stats_type(header.type,true);
+#endif
+
+#if defined (AGGREGATE_WINDOW)
+    // Two of these fit in one frame
+    if( (networkFlags & FLAG_AGGREGATE) && writeDirect == 070 && header.type < 65 && header.to_node != 0100 &&
+        len <= (sizeof(aggregate_buffer) - 8) / 2 ){
+      return aggregate(header,message,len);
+    }
+    // Held messages go first
+    if( aggregate_size ){
+      aggregate_flush();
+    }
+#endif
+
+    //Allows time for requests (RF24Mesh) to get through between failed writes on busy nodes
+    while(millis()-txTime < 25){ if(update() > 127){break;} }
+	delayMicroseconds(200);
+
+#if defined (DISABLE_FRAGMENTATION)
+    frame_size = rf24_min(len+sizeof(RF24NetworkHeader),MAX_FRAME_SIZE);
+	return _write(header,message,rf24_min(len,max_frame_payload_size),writeDirect);
+#else  
+  uint16_t frame_payload_size = max_frame_payload_size;
+  #if defined (COMPACT_HEADERS)
+  // A message for the parent or a direct child goes with a compact header, which leaves room for more payload
+  if( writeDirect == 070 && header.type < 128 && !header.reserved && neighbor_index(header.to_node) < 6 ){
+    frame_payload_size = rf24_max(frame_payload_size,rf24_min(max_payload_size,(uint16_t)(MAX_FRAME_SIZE - COMPACT_HEADER_SIZE)));
+  }
+  #endif
+  if(len <= frame_payload_size){
+    //Normal Write (Un-Fragmented)
+	frame_size = len + sizeof(RF24NetworkHeader);
+    if(_write(header,message,len,writeDirect)){
+      return 1;
+    }
+    txTime = millis();
+    return 0;
+  }
+  //Check payload size
+  if (len > max_payload_size) {
+    IF_SERIAL_DEBUG(printf("%u: NET write message failed. Given 'len' %d is bigger than the MAX Payload size %i\n\r",millis(),len,max_payload_size););
+    return false;
+  }
+
+  uint8_t compressed = 0;
+  #if defined (ENABLE_COMPRESSION)
+  uint8_t packed[MAX_PAYLOAD_SIZE];
+  if((networkFlags & FLAG_COMPRESS) && len > max_frame_payload_size){
+    // Only used if it saves fragments, and still needs more than one, which carry the FRAGMENT_COMPRESSED flag.
+    // The size comes first, and a recipient with room for the message has room to uncompress it in place.
+    uint16_t fragments = (len + max_frame_payload_size - 1) / max_frame_payload_size;
+    uint16_t packed_len = compress_payload((const uint8_t*)message,len,packed + 2,rf24_min((uint16_t)(sizeof(packed) - 2),(uint16_t)((fragments - 1) * max_frame_payload_size - 1)),len);
+    if(packed_len + 2U > max_frame_payload_size){
+      IF_SERIAL_DEBUG_FRAGMENTATION(printf("%lu: FRG Compressed %d bytes to %d\n\r",millis(),len,packed_len + 2););
+      packed[0] = len;
+      packed[1] = len >> 8;
+      message = packed;
+      len = packed_len + 2;
+      compressed = FRAGMENT_COMPRESSED;
+    }
+  }
+  #endif
+
+  if( (networkFlags & FLAG_SELECTIVE_REPEAT) && header.to_node != 0100 ){
+    bool unreported = false;
+    bool ok = write_selective(header,message,len,writeDirect,compressed,unreported);
+    if(!unreported){
+      return ok;
+    }
+    // A recipient without selective repeat drops the fragments that ask for a report, send them all the usual way
+    IF_SERIAL_DEBUG_FRAGMENTATION( printf_P(PSTR("%lu: FRG No reports from 0%o, sending frame id %d without selective repeat\n\r"),(unsigned long)millis(),header.to_node,header.id); );
+  }
+
+  //Divide the message payload into chunks of max_frame_payload_size
+  uint8_t fragment_id = (len % max_frame_payload_size != 0) + ((len ) / max_frame_payload_size);  //the number of fragments to send = ceil(len/max_frame_payload_size)
+
+  uint8_t msgCount = 0;
+
+  IF_SERIAL_DEBUG_FRAGMENTATION(printf("%lu: FRG Total message fragments %d\n\r",millis(),fragment_id););
+  
+  if(header.to_node != 0100){
+    #if defined (FLOW_CONTROL_TIMEOUT)
+    credit_wait(writeDirect == 070 ? header.to_node : writeDirect);
+    #endif
+    networkFlags |= FLAG_FAST_FRAG;
+	#if !defined (DUAL_HEAD_RADIO)
+	radio_listen(false);
+	#endif
+  }
+
+  uint8_t retriesPerFrag = 0;
+  uint8_t type = header.type;
+  bool ok = 0;
+  
+  while (fragment_id > 0) {
+
+    //Copy and fill out the header
+    //RF24NetworkHeader fragmentHeader = header;
+   header.reserved = fragment_id | compressed;
+
+    if (fragment_id == 1) {
+      header.type = NETWORK_LAST_FRAGMENT;  //Set the last fragment flag to indicate the last fragment
+      header.reserved = type; //The reserved field is used to transmit the header type
+    } else {
+      if (msgCount == 0) {
+        header.type = NETWORK_FIRST_FRAGMENT;
+      }else{
+        header.type = NETWORK_MORE_FRAGMENTS; //Set the more fragments flag to indicate a fragmented frame
+      }
+    }
+	
+    uint16_t offset = msgCount*max_frame_payload_size;
+	uint16_t fragmentLen = rf24_min((uint16_t)(len-offset),max_frame_payload_size);
+
+    //Try to send the payload chunk with the copied header
+    frame_size = sizeof(RF24NetworkHeader)+fragmentLen;
+	ok = _write(header,((char *)message)+offset,fragmentLen,writeDirect);
+
+	if (!ok) {
+	   delay(2);
+	   ++retriesPerFrag;
+
+	}else{
+	  retriesPerFrag = 0;
+	  fragment_id--;
+      msgCount++;
+	}
+	
+    //if(writeDirect != 070){ delay(2); } //Delay 2ms between sending multicast payloads
+ 
+	if (!ok && retriesPerFrag >= 3) {
+        IF_SERIAL_DEBUG_FRAGMENTATION(printf("%lu: FRG TX with fragmentID '%d' failed after %d fragments. Abort.\n\r",millis(),fragment_id,msgCount););
+		break;
+    }
+
+	
+    //Message was successful sent
+    #if defined SERIAL_DEBUG_FRAGMENTATION_L2 
+	  printf("%lu: FRG message transmission with fragmentID '%d' sucessfull.\n\r",millis(),fragment_id);
+	#endif
+
+  }
+  header.type = type;
+  #if !defined (DUAL_HEAD_RADIO)
+  if(networkFlags & FLAG_FAST_FRAG){	
+    ok = radio.txStandBy(txTimeout);  
+    radio_listen(true);
+  }  
+  networkFlags &= ~FLAG_FAST_FRAG;
+  
+  if(!ok){
+       return false;
+  }
+  #endif
+  //int frag_delay = uint8_t(len/48);
+  //delay( rf24_min(len/48,20));
+
+  //Return true if all the chunks where sent successfully
+ 
+  IF_SERIAL_DEBUG_FRAGMENTATION(printf("%u: FRG total message fragments sent %i. \n",millis(),msgCount); );
+  if(fragment_id > 0){
+    txTime = millis();
+	return false;
+  }
+  return true;
+  
+#endif //Fragmentation enabled
+}
+#if !defined (DISABLE_FRAGMENTATION)
+/******************************************************************/
+
+// Sends a fragmented message with FLAG_SELECTIVE_REPEAT: failed fragments are skipped instead of aborting,
+// and the NETWORK_FRAGMENT_NACK reports of the recipient decide which fragments are sent again.
+// Sets @p unreported if the recipient did not answer the first round that got through, so write() can fall back.
+bool RF24NetworkBase::write_selective(RF24NetworkHeader& header,const void* message, uint16_t len, uint16_t writeDirect, uint8_t compressed, bool& unreported)
+{
+  // Fragments are numbered by the countdown sent in header.reserved, the last one is 1
+  uint8_t total = (len % max_frame_payload_size != 0) + (len / max_frame_payload_size);
+  uint8_t missing[sizeof(frag_report)];
+  memset(missing,0,sizeof(missing));
+  for(uint8_t n = 1; n <= total; n++){
+    missing[n/8] |= _BV(n%8);
+  }
+  uint8_t type = header.type;
+  frag_report_id = header.id;
+  bool reported = false;
+  bool stalled = false; // The last round got nothing through
+
+  for(uint8_t round = 0; round < 4; round++){
+    uint8_t sent[sizeof(missing)];
+    memcpy(sent,missing,sizeof(sent));
+    frag_report_ready = false;
+
+    #if defined (FLOW_CONTROL_TIMEOUT)
+    credit_wait(writeDirect == 070 ? header.to_node : writeDirect);
+    #endif
+    networkFlags |= FLAG_FAST_FRAG;
+	#if !defined (DUAL_HEAD_RADIO)
+	radio_listen(false);
+	#endif
+    for(uint8_t n = total; n > 0; n--){
+      if( !(missing[n/8] & _BV(n%8)) ){
+        continue;
+      }
+      uint16_t offset = (total - n) * max_frame_payload_size;
+      uint16_t fragmentLen = rf24_min((uint16_t)(len-offset),max_frame_payload_size);
+      header.reserved = n | compressed;
+      header.type = NETWORK_FIRST_FRAGMENT;
+      if(n < total){
+        header.type = NETWORK_MORE_FRAGMENTS;
+        header.reserved |= FRAGMENT_REPORT;
+      }
+      if(n == 1){
+        header.type = NETWORK_LAST_FRAGMENT;
+        header.reserved = type; //The reserved field is used to transmit the header type
+      }
+      for(uint8_t retries = 0; retries < 3; retries++){
+        frame_size = sizeof(RF24NetworkHeader)+fragmentLen;
+        if(_write(header,((char *)message)+offset,fragmentLen,writeDirect)){
+          missing[n/8] &= ~_BV(n%8);
+          break;
+        }
+        delay(2);
+      }
+    }
+    header.type = type;
+    #if !defined (DUAL_HEAD_RADIO)
+    if(networkFlags & FLAG_FAST_FRAG){
+      // Unsure whether the fragments still in the TX FIFO arrived, send the last one again to get a report
+      if(!radio.txStandBy(txTimeout)){
+        missing[0] |= _BV(1);
+      }
+      radio_listen(true);
+    }
+    #endif
+    networkFlags &= ~FLAG_FAST_FRAG;
+
+    bool done = true;
+    for(uint8_t i = 0; i < sizeof(missing); i++){
+      done = done && !missing[i];
+    }
+    if(missing[0] & _BV(1)){
+      // No report without the last fragment, give up if nothing got through twice in a row
+      if( !memcmp(missing,sent,sizeof(missing)) ){
+        if(stalled){
+          break;
+        }
+        stalled = true;
+        continue;
+      }
+      stalled = false;
+      continue;
+    }
+    if(total < 3){
+      // Without middle fragments there is no report, the first and last ones are acknowledged
+      if(done){
+        return true;
+      }
+      continue;
+    }
+
+    uint32_t reply_time = millis();
+    while( !frag_report_ready && millis() - reply_time <= routeTimeout ){
+      update();
+    }
+    if(!frag_report_ready){
+      IF_SERIAL_DEBUG_FRAGMENTATION( printf_P(PSTR("%lu: FRG No report for frame id %d\n\r"),(unsigned long)millis(),header.id); );
+      if(!reported){
+        // A recipient without selective repeat, or the first report was lost. Either way the fragments are sent again
+        // without FRAGMENT_REPORT, copies of those of a completed message are dropped.
+        unreported = true;
+        return false;
+      }
+      if(done){
+        // Copies of fragments of a completed message are answered with a report, so nothing is lost by sending them again
+        memcpy(missing,sent,sizeof(missing));
+      }
+      continue;
+    }
+    reported = true;
+    if(!frag_report_size){
+      return true;
+    }
+    // Send whatever the recipient does not have
+    for(uint8_t n = 1; n <= total; n++){
+      if( n/8 < frag_report_size && (frag_report[n/8] & _BV(n%8)) ){
+        missing[n/8] &= ~_BV(n%8);
+      }else{
+        missing[n/8] |= _BV(n%8);
+      }
+    }
+    IF_SERIAL_DEBUG_FRAGMENTATION( printf_P(PSTR("%lu: FRG Recipient is missing fragments of frame id %d\n\r"),(unsigned long)millis(),header.id); );
+  }
+  txTime = millis();
+  return false;
+}
+
+#endif
+#if defined (NUM_ASYNC_WRITES)
+/******************************************************************/
+
+uint8_t RF24NetworkBase::writeAsync(RF24NetworkHeader& header, const void* message, uint16_t len, void (*callback)(uint8_t handle, bool ok))
+{
+  #if defined (DISABLE_FRAGMENTATION)
+  if(len > max_frame_payload_size){
+  #else
+  if(len > max_payload_size){
+  #endif
+    return 0;
+  }
+
+  for(uint8_t i = 0; i < NUM_ASYNC_WRITES; i++){
+    RF24NetworkAsyncWrite& slot = async_writes[i];
+    if(slot.state != ASYNC_SLOT_FREE){
+      continue;
+    }
+    // The id is used to match the NETWORK_ACK, so it has to be unique while the message is in progress
+    header.id = RF24NetworkHeader::next_id++;
+    header.from_node = node_address;
+    slot.header = header;
+    slot.message = (const uint8_t*)message;
+    slot.len = len;
+    slot.offset = 0;
+    slot.retries = 0;
+    slot.callback = callback;
+    slot.state = ASYNC_SLOT_SENDING;
+    return i + 1;
+  }
+  return 0;
+}
+
+/******************************************************************/
+
+uint8_t RF24NetworkBase::writeStatus(uint8_t handle)
+{
+  if(handle == 0 || handle > NUM_ASYNC_WRITES){
+    return ASYNC_WRITE_INVALID;
+  }
+  RF24NetworkAsyncWrite& slot = async_writes[handle-1];
+  switch(slot.state){
+    case ASYNC_SLOT_FREE: return ASYNC_WRITE_INVALID;
+    case ASYNC_SLOT_OK: slot.state = ASYNC_SLOT_FREE; return ASYNC_WRITE_OK;
+    case ASYNC_SLOT_FAILED: slot.state = ASYNC_SLOT_FREE; return ASYNC_WRITE_FAILED;
+    default: return ASYNC_WRITE_PENDING;
+  }
+}
+
+/******************************************************************/
+
+// Called by update(): sends at most one frame of the queued messages, and times out missing NETWORK_ACKs
+void RF24NetworkBase::async_update(void)
+{
+  // Not while a blocking write() is sending fragments or waiting for its NETWORK_ACK, or an async frame is being sent
+  if(async_sending || ack_waiting || (networkFlags & FLAG_FAST_FRAG)){
+    return;
+  }
+  uint32_t now = millis();
+
+  // The NETWORK_ACK travels back along the route, and cannot be received while this node is transmitting.
+  // So like write(), nothing else is sent until it has arrived or timed out.
+  for(uint8_t i = 0; i < NUM_ASYNC_WRITES; i++){
+    if(async_writes[i].state == ASYNC_SLOT_WAIT_ACK){
+      if(now - async_writes[i].time <= routeTimeout){
+        return;
+      }
+      IF_SERIAL_DEBUG_ROUTING( printf_P(PSTR("%lu: MAC Network ACK fail for async write to 0%o\n\r"),(unsigned long)now,async_writes[i].header.to_node); );
+      #if defined ENABLE_NETWORK_STATS
+      net_stats.ack_timeouts++;
+      #endif
+      async_frame_done(i,false);
+    }
+  }
+
+  //Allows time for requests (RF24Mesh) to get through after failed writes, like write()
+  if(now - txTime < 25){
+    return;
+  }
+
+  for(uint8_t n = 0; n < NUM_ASYNC_WRITES; n++){
+    uint8_t i = (async_next + n) % NUM_ASYNC_WRITES;
+    RF24NetworkAsyncWrite& slot = async_writes[i];
+    if(slot.state != ASYNC_SLOT_SENDING || (slot.retries && now - slot.time < 2)){
+      continue;
+    }
+    #if defined (FLOW_CONTROL_TIMEOUT)
+    // Wait for the next hop to have room, without using up retries
+    logicalToPhysicalStruct conversion = { slot.header.to_node,TX_NORMAL,0 };
+    logicalToPhysicalAddress(&conversion);
+    if(!credit_ok(conversion.send_node)){
+      continue;
+    }
+    #endif
+
+    RF24NetworkHeader header = slot.header;
+    uint16_t fragmentLen = rf24_min((uint16_t)(slot.len - slot.offset),max_frame_payload_size);
+
+    if(slot.len > max_frame_payload_size){
+      // Receivers reassemble one fragmented message per sender at a time
+      if(slot.offset == 0 && !slot.retries && async_fragmenting(i)){
+        continue;
+      }
+      uint16_t remaining = slot.len - slot.offset;
+      header.reserved = (remaining % max_frame_payload_size != 0) + (remaining / max_frame_payload_size);
+      if(header.reserved == 1){
+        header.type = NETWORK_LAST_FRAGMENT;
+        header.reserved = slot.header.type; //The reserved field is used to transmit the header type
+      }else{
+        header.type = slot.offset ? NETWORK_MORE_FRAGMENTS : NETWORK_FIRST_FRAGMENT;
+      }
+    }
+
+    async_next = i + 1;
+    frame_size = sizeof(RF24NetworkHeader) + fragmentLen;
+    async_sending = true;
+    async_ack_pending = false;
+    bool ok = _write(header,slot.message + slot.offset,fragmentLen,070);
+    async_sending = false;
+
+    if(ok && async_ack_pending){
+      slot.state = ASYNC_SLOT_WAIT_ACK;
+      slot.time = millis();
+    }else{
+      async_frame_done(i,ok);
+    }
+    return;
+  }
+}
+
+/******************************************************************/
+
+// Whether a fragmented message other than @p except has been started and is not complete
+bool RF24NetworkBase::async_fragmenting(uint8_t except)
+{
+  for(uint8_t i = 0; i < NUM_ASYNC_WRITES; i++){
+    RF24NetworkAsyncWrite& slot = async_writes[i];
+    if(i != except && slot.len > max_frame_payload_size &&
+       (slot.state == ASYNC_SLOT_WAIT_ACK || (slot.state == ASYNC_SLOT_SENDING && (slot.offset || slot.retries)))){
+      return true;
+    }
+  }
+  return false;
+}
+
+/******************************************************************/
+
+void RF24NetworkBase::async_frame_done(uint8_t i, bool ok)
+{
+  RF24NetworkAsyncWrite& slot = async_writes[i];
+  slot.time = millis();
+
+  if(ok){
+    slot.retries = 0;
+    slot.offset += rf24_min((uint16_t)(slot.len - slot.offset),max_frame_payload_size);
+    if(slot.offset < slot.len){
+      slot.state = ASYNC_SLOT_SENDING;
+      return;
+    }
+  }else{
+    // Fragments are retried like in write(), single frames already were by the radio
+    if(slot.len > max_frame_payload_size && ++slot.retries < 3){
+      slot.state = ASYNC_SLOT_SENDING;
+      return;
+    }
+    txTime = slot.time;
+    IF_SERIAL_DEBUG_FRAGMENTATION( printf_P(PSTR("%lu: FRG async write to 0%o failed after %u bytes\n\r"),(unsigned long)slot.time,slot.header.to_node,slot.offset); );
+  }
+
+  if(slot.callback){
+    slot.state = ASYNC_SLOT_FREE;
+    slot.callback(i + 1,ok);
+  }else{
+    slot.state = ok ? ASYNC_SLOT_OK : ASYNC_SLOT_FAILED;
+  }
+}
+
+#endif
+#if defined (BULK_WINDOW)
+/******************************************************************/
+
+bool RF24NetworkBase::bulkWrite(RF24NetworkHeader& header, uint32_t size, uint8_t (*source)(uint32_t offset, uint8_t* buffer, uint8_t len))
+{
+  if(bulk_tx.state == BULK_PENDING || !size){
+    return false;
+  }
+  header.from_node = node_address;
+  bulk_tx.header = header;
+  bulk_tx.size = size;
+  bulk_tx.next = 0;
+  bulk_tx.acked = 0;
+  bulk_tx.time = millis();
+  bulk_tx.source = source;
+  bulk_tx.timeouts = 0;
+  bulk_tx.opened = false;
+  bulk_tx.open_sent = false;
+  bulk_tx.probing = false;
+  bulk_tx.state = BULK_PENDING;
+  return true;
+}
+
+/******************************************************************/
+
+uint8_t RF24NetworkBase::bulkStatus(uint32_t* offset)
+{
+  if(offset){
+    *offset = bulk_tx.state == BULK_IDLE ? 0 : bulk_tx.acked;
+  }
+  return bulk_tx.state;
+}
+
+/******************************************************************/
+
+void RF24NetworkBase::bulkSink(bool (*sink)(const RF24NetworkHeader& header, uint32_t size, uint32_t offset, const uint8_t* data, uint8_t len))
+{
+  bulk_rx.sink = sink;
+}
+
+/******************************************************************/
+
+// Called by update(): sends the next frame of the outgoing transfer, or starts over from the acknowledged offset after a timeout
+void RF24NetworkBase::bulk_update(void)
+{
+  if(bulk_tx.state != BULK_PENDING || bulk_sending || ack_waiting || (networkFlags & FLAG_FAST_FRAG)){
+    return;
+  }
+  #if defined (NUM_ASYNC_WRITES)
+  if(async_sending){
+    return;
+  }
+  #endif
+  uint32_t now = millis();
+
+  #if defined (FLOW_CONTROL_TIMEOUT)
+  // Wait for the next hop to have room, the wait does not count as a timeout
+  logicalToPhysicalStruct conversion = { bulk_tx.header.to_node,TX_NORMAL,0 };
+  logicalToPhysicalAddress(&conversion);
+  if(!credit_ok(conversion.send_node)){
+    bulk_tx.time = now;
+    return;
+  }
+  #endif
+
+  if(now - bulk_tx.time > routeTimeout){
+    if(++bulk_tx.timeouts > 5){
+      IF_SERIAL_DEBUG_ROUTING( printf_P(PSTR("%lu: MAC Bulk transfer to 0%o failed at offset %lu\n\r"),(unsigned long)now,bulk_tx.header.to_node,(unsigned long)bulk_tx.acked); );
+      bulk_tx.state = BULK_FAILED;
+      txTime = now;
+      return;
+    }
+    // Nothing heard from the recipient. Send again from the acknowledged offset, but one frame only,
+    // so the answer does not have to cross the rest of the window on its way back
+    bulk_tx.next = bulk_tx.acked;
+    bulk_tx.open_sent = false;
+    bulk_tx.probing = true;
+    bulk_tx.time = now;
+  }
+
+  RF24NetworkHeader header = bulk_tx.header;
+  header.reserved = bulk_tx.header.type; //The reserved field is used to transmit the header type
+  uint8_t payload[max_frame_payload_size];
+  uint8_t len;
+
+  if(!bulk_tx.opened){
+    if(bulk_tx.open_sent){
+      return;
+    }
+    header.type = NETWORK_BULK_OPEN;
+    memcpy(payload,&bulk_tx.size,sizeof(bulk_tx.size));
+    payload[sizeof(bulk_tx.size)] = BULK_WINDOW;
+    len = sizeof(bulk_tx.size) + 1;
+  }else{
+    // Stay within BULK_WINDOW frames of the recipient's acknowledgement
+    const uint8_t chunk = max_frame_payload_size - sizeof(bulk_tx.next);
+    if(bulk_tx.next >= bulk_tx.size || bulk_tx.next - bulk_tx.acked >= (bulk_tx.probing ? 1 : BULK_WINDOW) * (uint32_t)chunk){
+      return;
     }
-	next_frame-=bufsize+10;
-    uint8_t padding = 0;
-    #if !defined(ARDUINO_ARCH_AVR)
-    if( (padding = (bufsize+10)%4) ){
-      padding = 4-padding;
-      next_frame -= padding;
+    len = bulk_tx.source(bulk_tx.next,payload + sizeof(bulk_tx.next),rf24_min(bulk_tx.size - bulk_tx.next,(uint32_t)chunk));
+    if(!len){
+      bulk_tx.state = BULK_FAILED;
+      return;
     }
-    #endif
-    memmove(frame_queue,frame_queue+bufsize+10+padding,sizeof(frame_queue)- bufsize);
-	//IF_SERIAL_DEBUG(printf_P(PSTR("%lu: NET Received %s\n\r"),millis(),header.toString()));
+    header.type = NETWORK_BULK_DATA;
+    memcpy(payload,&bulk_tx.next,sizeof(bulk_tx.next));
+    len += sizeof(bulk_tx.next);
   }
-#endif
-  return bufsize;
-}
 
+  frame_size = sizeof(RF24NetworkHeader) + len;
+  bulk_sending = true;
+  bool ok = _write(header,payload,len,070);
+  bulk_sending = false;
 
-#if defined RF24NetworkMulticast
-/******************************************************************/
-bool RF24Network::multicast(RF24NetworkHeader& header,const void* message, uint16_t len, uint8_t level){
-	// Fill out the header
-  header.to_node = 0100;
-  header.from_node = node_address;
-  return write(header, message, len, levelToAddress(level));
+  // Frames that fail on the first hop are sent again by the next call
+  if(ok){
+    if(header.type == NETWORK_BULK_OPEN){
+      bulk_tx.open_sent = true;
+    }else{
+      bulk_tx.next += len - sizeof(bulk_tx.next);
+    }
+    bulk_tx.time = millis();
+  }
 }
-#endif
 
 /******************************************************************/
-bool RF24Network::write(RF24NetworkHeader& header,const void* message, uint16_t len){    
-	return write(header,message,len,070);
-}
-/******************************************************************/
-bool RF24Network::write(RF24NetworkHeader& header,const void* message, uint16_t len, uint16_t writeDirect){
-    
-    //Allows time for requests (RF24Mesh) to get through between failed writes on busy nodes
-    while(millis()-txTime < 25){ if(update() > 127){break;} }
-	delayMicroseconds(200);
 
-#if defined (DISABLE_FRAGMENTATION)
-    frame_size = rf24_min(len+sizeof(RF24NetworkHeader),MAX_FRAME_SIZE);
-	return _write(header,message,rf24_min(len,max_frame_payload_size),writeDirect);
-#else  
-  if(len <= max_frame_payload_size){
-    //Normal Write (Un-Fragmented)
-	frame_size = len + sizeof(RF24NetworkHeader);
-    if(_write(header,message,len,writeDirect)){
-      return 1;
-    }
-    txTime = millis();
-    return 0;
+// Handles the NETWORK_BULK_* frames addressed to this node: data of the incoming transfer, and acknowledgements of the outgoing one
+void RF24NetworkBase::bulk_frame(RF24NetworkHeader* header)
+{
+  const uint8_t* payload = frame_buffer + sizeof(RF24NetworkHeader);
+  uint8_t len = frame_size - sizeof(RF24NetworkHeader);
+  uint32_t offset;
+  if(len < sizeof(offset)){
+    return;
   }
-  //Check payload size
-  if (len > MAX_PAYLOAD_SIZE) {
-    IF_SERIAL_DEBUG(printf("%u: NET write message failed. Given 'len' %d is bigger than the MAX Payload size %i\n\r",millis(),len,MAX_PAYLOAD_SIZE););
-    return false;
+  memcpy(&offset,payload,sizeof(offset));
+  len -= sizeof(offset);
+  uint32_t now = millis();
+
+  if(header->type == NETWORK_BULK_ACK){
+    // Relays that retry may still deliver answers to an earlier transfer, which carry its id
+    if(bulk_tx.state != BULK_PENDING || header->from_node != bulk_tx.header.to_node || header->id != bulk_tx.header.id){
+      return;
+    }
+    if(header->reserved == BULK_ACK_REFUSED){
+      bulk_tx.state = BULK_FAILED;
+      return;
+    }
+    bulk_tx.probing = false;
+    if(!bulk_tx.opened || offset > bulk_tx.acked){
+      // The first answer may already be past 0, if the recipient kept the data of an earlier attempt
+      bulk_tx.opened = true;
+      bulk_tx.acked = rf24_min(offset,bulk_tx.size);
+      bulk_tx.time = now;
+      bulk_tx.timeouts = 0;
+    }
+    if(bulk_tx.next < bulk_tx.acked || header->reserved == BULK_ACK_GAP){
+      bulk_tx.next = bulk_tx.acked;
+    }
+    if(bulk_tx.acked == bulk_tx.size){
+      bulk_tx.state = BULK_OK;
+    }
+    return;
   }
 
-  //Divide the message payload into chunks of max_frame_payload_size
-  uint8_t fragment_id = (len % max_frame_payload_size != 0) + ((len ) / max_frame_payload_size);  //the number of fragments to send = ceil(len/max_frame_payload_size)
-
-  uint8_t msgCount = 0;
-
-  IF_SERIAL_DEBUG_FRAGMENTATION(printf("%lu: FRG Total message fragments %d\n\r",millis(),fragment_id););
-  
-  if(header.to_node != 0100){
-    networkFlags |= FLAG_FAST_FRAG;
-	#if !defined (DUAL_HEAD_RADIO)
-	radio.stopListening();
-	#endif
+  if(!bulk_rx.sink){
+    return;
   }
-
-  uint8_t retriesPerFrag = 0;
-  uint8_t type = header.type;
-  bool ok = 0;
-  
-  while (fragment_id > 0) {
-
-    //Copy and fill out the header
-    //RF24NetworkHeader fragmentHeader = header;
-   header.reserved = fragment_id;
-
-    if (fragment_id == 1) {
-      header.type = NETWORK_LAST_FRAGMENT;  //Set the last fragment flag to indicate the last fragment
-      header.reserved = type; //The reserved field is used to transmit the header type
-    } else {
-      if (msgCount == 0) {
-        header.type = NETWORK_FIRST_FRAGMENT;
-      }else{
-        header.type = NETWORK_MORE_FRAGMENTS; //Set the more fragments flag to indicate a fragmented frame
+  // The sink sees the user header type
+  RF24NetworkHeader sinkHeader = *header;
+  sinkHeader.type = header->reserved;
+  bool current = bulk_rx.size && header->from_node == bulk_rx.from_node && header->reserved == bulk_rx.type;
+
+  if(header->type == NETWORK_BULK_OPEN){
+    uint32_t size = offset;
+    if(!current || size != bulk_rx.size){
+      if(bulk_rx.size && header->from_node != bulk_rx.from_node && !bulk_rx.refused && bulk_rx.offset < bulk_rx.size && now - bulk_rx.time < 1000){
+        // Busy with a transfer from another node
+        bulk_ack(header,BULK_ACK_REFUSED);
+        return;
       }
+      bulk_rx.from_node = header->from_node;
+      bulk_rx.type = header->reserved;
+      bulk_rx.size = size;
+      bulk_rx.offset = 0;
+      bulk_rx.acked = 0;
+      bulk_rx.refused = !size || !bulk_rx.sink(sinkHeader,size,0,NULL,0);
     }
-	
-    uint16_t offset = msgCount*max_frame_payload_size;
-	uint16_t fragmentLen = rf24_min((uint16_t)(len-offset),max_frame_payload_size);
+    // Otherwise the sender is resuming, and continues from bulk_rx.offset
+    bulk_rx.window = len ? rf24_max(payload[sizeof(offset)],1) : 1;
+    bulk_rx.gap = false;
+    bulk_rx.time = now;
+    bulk_ack(header,bulk_rx.refused ? BULK_ACK_REFUSED : BULK_ACK_PROGRESS);
+    return;
+  }
 
-    //Try to send the payload chunk with the copied header
-    frame_size = sizeof(RF24NetworkHeader)+fragmentLen;
-	ok = _write(header,((char *)message)+offset,fragmentLen,writeDirect);
+  if(!current || bulk_rx.refused){
+    // Not announced, or this node restarted since: the sender has to open the transfer again
+    bulk_ack(header,BULK_ACK_REFUSED);
+    return;
+  }
+  bulk_rx.time = now;
+
+  // Acknowledgements are sent once the sender's window is used up, when it waits for them and the route is quiet
+  const uint32_t window = (uint32_t)bulk_rx.window * (max_frame_payload_size - sizeof(offset));
+  if(offset == bulk_rx.offset && len && len <= bulk_rx.size - offset){
+    if(!bulk_rx.sink(sinkHeader,bulk_rx.size,offset,payload + sizeof(offset),len)){
+      bulk_rx.refused = true;
+      bulk_ack(header,BULK_ACK_REFUSED);
+      return;
+    }
+    bulk_rx.offset += len;
+    bulk_rx.gap = false;
+    if(bulk_rx.offset - bulk_rx.acked >= window || bulk_rx.offset == bulk_rx.size){
+      bulk_ack(header,BULK_ACK_PROGRESS);
+    }
+  }else
+  if( (offset < bulk_rx.offset || offset + len >= bulk_rx.acked + window) && (!bulk_rx.gap || now - bulk_rx.gap_time > routeTimeout) ){
+    // Data went missing and this is the end of the window, or data arrived again because an acknowledgement
+    // was lost: tell the sender where to continue
+    bulk_rx.gap = true;
+    bulk_rx.gap_time = now;
+    bulk_ack(header,BULK_ACK_GAP);
+  }
+}
 
-	if (!ok) {
-	   delay(2);
-	   ++retriesPerFrag;
+/******************************************************************/
 
-	}else{
-	  retriesPerFrag = 0;
-	  fragment_id--;
-      msgCount++;
-	}
-	
-    //if(writeDirect != 070){ delay(2); } //Delay 2ms between sending multicast payloads
- 
-	if (!ok && retriesPerFrag >= 3) {
-        IF_SERIAL_DEBUG_FRAGMENTATION(printf("%lu: FRG TX with fragmentID '%d' failed after %d fragments. Abort.\n\r",millis(),fragment_id,msgCount););
-		break;
-    }
+void RF24NetworkBase::bulk_ack(RF24NetworkHeader* header, uint8_t status)
+{
+  RF24NetworkHeader ack;
+  ack.to_node = header->from_node;
+  ack.id = header->id;
+  ack.type = NETWORK_BULK_ACK;
+  ack.reserved = status;
+  bulk_rx.acked = bulk_rx.offset;
+  frame_size = sizeof(RF24NetworkHeader) + sizeof(bulk_rx.offset);
+  _write(ack,&bulk_rx.offset,sizeof(bulk_rx.offset),070);
+}
 
-	
-    //Message was successful sent
-    #if defined SERIAL_DEBUG_FRAGMENTATION_L2 
-	  printf("%lu: FRG message transmission with fragmentID '%d' sucessfull.\n\r",millis(),fragment_id);
-	#endif
+#endif
+#if defined (AGGREGATE_WINDOW)
+/******************************************************************/
 
+// Holds a small message for the next NETWORK_AGGREGATE frame to its next hop
+bool RF24NetworkBase::aggregate(RF24NetworkHeader& header, const void* message, uint16_t len)
+{
+  if( !is_valid_address(header.to_node) ){
+    return false;
   }
-  header.type = type;
-  #if !defined (DUAL_HEAD_RADIO)
-  if(networkFlags & FLAG_FAST_FRAG){	
-    ok = radio.txStandBy(txTimeout);  
-    radio.startListening();
-    radio.setAutoAck(0,0);
-  }  
-  networkFlags &= ~FLAG_FAST_FRAG;
-  
-  if(!ok){
-       return false;
+  logicalToPhysicalStruct conversion = { header.to_node,TX_NORMAL,0 };
+  logicalToPhysicalAddress(&conversion);
+  if( aggregate_size && (conversion.send_node != aggregate_hop || (uint16_t)(aggregate_size + 4 + len) > sizeof(aggregate_buffer)) ){
+    aggregate_flush();
   }
-  #endif
-  //int frag_delay = uint8_t(len/48);
-  //delay( rf24_min(len/48,20));
-
-  //Return true if all the chunks where sent successfully
- 
-  IF_SERIAL_DEBUG_FRAGMENTATION(printf("%u: FRG total message fragments sent %i. \n",millis(),msgCount); );
-  if(fragment_id > 0){
-    txTime = millis();
-	return false;
+  if( !aggregate_size ){
+    aggregate_hop = conversion.send_node;
+    aggregate_time = millis();
   }
+  header.from_node = node_address;
+  uint8_t* packed = aggregate_buffer + aggregate_size;
+  memcpy(packed,&header.to_node,sizeof(header.to_node));
+  packed[2] = header.type;
+  packed[3] = len;
+  memcpy(packed + 4,message,len);
+  aggregate_size += 4 + len;
+  aggregate_count++;
   return true;
-  
-#endif //Fragmentation enabled
 }
+
+/******************************************************************/
+
+// Sends the held messages, a single one as a frame of its own
+bool RF24NetworkBase::aggregate_flush(void)
+{
+  if( !aggregate_size ){
+    return true;
+  }
+  RF24NetworkHeader* header = (RF24NetworkHeader*)frame_buffer;
+  header->from_node = node_address;
+  header->id = RF24NetworkHeader::next_id++;
+  header->reserved = 0;
+  if( aggregate_count == 1 ){
+    memcpy(&header->to_node,aggregate_buffer,sizeof(header->to_node));
+    header->type = aggregate_buffer[2];
+    memcpy(frame_buffer + sizeof(RF24NetworkHeader),aggregate_buffer + 4,aggregate_buffer[3]);
+    frame_size = sizeof(RF24NetworkHeader) + aggregate_buffer[3];
+  }else{
+    header->to_node = aggregate_hop;
+    header->type = NETWORK_AGGREGATE;
+    memcpy(frame_buffer + sizeof(RF24NetworkHeader),aggregate_buffer,aggregate_size);
+    frame_size = sizeof(RF24NetworkHeader) + aggregate_size;
+  }
+  // write() may run update(), which must not send them again
+  aggregate_size = 0;
+  aggregate_count = 0;
+  return write(header->to_node,TX_NORMAL);
+}
+
+/******************************************************************/
+
+// Handles the messages of a NETWORK_AGGREGATE frame one by one, as if each had come in a frame of its own
+void RF24NetworkBase::aggregate_split(RF24NetworkHeader* header)
+{
+  uint8_t packed[MAX_FRAME_SIZE - sizeof(RF24NetworkHeader)];
+  uint8_t size = frame_size - sizeof(RF24NetworkHeader);
+  memcpy(packed,frame_buffer + sizeof(RF24NetworkHeader),size);
+  RF24NetworkHeader outer = *header;
+
+  for(uint8_t i = 0; i + 4 <= size && i + 4 + packed[i + 3] <= size; i += 4 + packed[i + 3]){
+    memcpy(&header->to_node,packed + i,sizeof(header->to_node));
+    header->from_node = outer.from_node;
+    header->id = outer.id;
+    header->type = packed[i + 2];
+    header->reserved = 0;
+    uint8_t len = packed[i + 3];
+    memcpy(frame_buffer + sizeof(RF24NetworkHeader),packed + i + 4,len);
+    frame_size = sizeof(RF24NetworkHeader) + len;
+
+    if( header->to_node == node_address ){
+      if( !dispatch(*header,frame_buffer + sizeof(RF24NetworkHeader),len) ){
+        enqueue(header);
+      }
+    }else
+    if( is_valid_address(header->to_node) ){
+      forward(header->to_node);
+    }
+  }
+}
+
+#endif
 /******************************************************************/
 
-bool RF24Network::_write(RF24NetworkHeader& header,const void* message, uint16_t len, uint16_t writeDirect)
+bool RF24NetworkBase::_write(RF24NetworkHeader& header,const void* message, uint16_t len, uint16_t writeDirect)
 {
   // Fill out the header
   header.from_node = node_address;
@@ -874,7 +2753,7 @@ bool RF24Network::_write(RF24NetworkHeader& header,const void* message, uint16_t
 
 /******************************************************************/
 
-bool RF24Network::write(uint16_t to_node, uint8_t directTo)  // Direct To: 0 = First Payload, standard routing, 1=routed payload, 2=directRoute to host, 3=directRoute to Route
+bool RF24NetworkBase::write(uint16_t to_node, uint8_t directTo)  // Direct To: 0 = First Payload, standard routing, 1=routed payload, 2=directRoute to host, 3=directRoute to Route
 {
   bool ok = false;
   bool isAckType = false;
@@ -891,14 +2770,43 @@ bool RF24Network::write(uint16_t to_node, uint8_t directTo)  // Direct To: 0 = F
   //Load info into our conversion structure, and get the converted address info
   logicalToPhysicalStruct conversion = { to_node,directTo,0};
   logicalToPhysicalAddress(&conversion);
+
+  #if defined (FLOW_CONTROL_TIMEOUT)
+  // Hold back data for a neighbor that has no room, rather than sending it into a full queue
+  uint8_t type = frame_buffer[6];
+  bool isData = type < 128 || type == EXTERNAL_DATA_TYPE || (type >= NETWORK_FIRST_FRAGMENT && type <= NETWORK_LAST_FRAGMENT) ||
+                type == NETWORK_MORE_FRAGMENTS_NACK || type == NETWORK_BULK_OPEN || type == NETWORK_BULK_DATA || type == NETWORK_AGGREGATE;
+  if( directTo <= TX_ROUTED && isData && !credit_ok(conversion.send_node) ){
+    IF_SERIAL_DEBUG_ROUTING( printf_P(PSTR("%lu: MAC No credit for 0%o via 0%o\n\r"),(unsigned long)millis(),to_node,conversion.send_node); );
+    return false;
+  }
+  #endif
   
   #if defined (RF24_LINUX)
   IF_SERIAL_DEBUG(printf_P(PSTR("%u: MAC Sending to 0%o via 0%o on pipe %x\n\r"),millis(),to_node,conversion.send_node,conversion.send_pipe));
   #else
   IF_SERIAL_DEBUG(printf_P(PSTR("%lu: MAC Sending to 0%o via 0%o on pipe %x\n\r"),millis(),to_node,conversion.send_node,conversion.send_pipe));
   #endif
+  IF_NETWORK_TRACE( trace_event(TRACE_ROUTE,conversion.send_node,((RF24NetworkHeader*)frame_buffer)->id,conversion.send_pipe); );
+  #if defined (COMPACT_HEADERS)
+  // A frame that goes straight to its recipient is sent with a compact header, the full one is put back afterwards
+  RF24NetworkHeader sent_header;
+  memcpy(&sent_header,frame_buffer,sizeof(sent_header));
+  bool compact = directTo <= TX_ROUTED && conversion.send_node == to_node && sent_header.type < 128 && !sent_header.reserved;
+  if(compact){
+    frame_size = frame_compact(frame_buffer,frame_size);
+  }
+  #endif
   /**Write it*/
   ok=write_to_pipe(conversion.send_node, conversion.send_pipe, conversion.multicast);  	
+  #if defined (COMPACT_HEADERS)
+  if(compact){
+    memmove(frame_buffer + sizeof(RF24NetworkHeader),frame_buffer + COMPACT_HEADER_SIZE,frame_size - COMPACT_HEADER_SIZE);
+    memcpy(frame_buffer,&sent_header,sizeof(sent_header));
+    frame_size += sizeof(RF24NetworkHeader) - COMPACT_HEADER_SIZE;
+  }
+  #endif
+  IF_NETWORK_TRACE( trace_event(TRACE_MAC_TX,conversion.send_node,((RF24NetworkHeader*)frame_buffer)->id,ok); );
   
   
     if(!ok){	
@@ -935,18 +2843,30 @@ bool RF24Network::write(uint16_t to_node, uint8_t directTo)  // Direct To: 0 = F
  
 
 
+#if defined (NUM_ASYNC_WRITES)
+	if( ok && async_sending && conversion.send_node != to_node && (directTo==0 || directTo==3) && isAckType){
+		async_ack_pending = true; // update() completes the frame when the NETWORK_ACK arrives
+	}else
+#endif
 	if( ok && conversion.send_node != to_node && (directTo==0 || directTo==3) && isAckType){
 	    #if !defined (DUAL_HEAD_RADIO)
           // Now, continue listening
 		  if(networkFlags & FLAG_FAST_FRAG){
 			 radio.txStandBy(txTimeout);
              networkFlags &= ~FLAG_FAST_FRAG;
-             radio.setAutoAck(0,0); 
 		  }
-          radio.startListening();
+          radio_listen(true);
         #endif
 		uint32_t reply_time = millis(); 
+		#if defined (NETWORK_TRACE_DEPTH)
+		// frame_buffer is used by update() while waiting
+		uint16_t sent_id = ((RF24NetworkHeader*)frame_buffer)->id;
+		trace_event(TRACE_ACK_WAIT,to_node,sent_id,0);
+		#endif
 
+		// update() sends no async or bulk frames of its own meanwhile, they would take frame_buffer and the radio
+		bool was_waiting = ack_waiting;
+		ack_waiting = true;
 		while( update() != NETWORK_ACK){
 			#if defined (RF24_LINUX)
             delayMicroseconds(900);
@@ -961,11 +2881,22 @@ bool RF24Network::write(uint16_t to_node, uint8_t directTo)  // Direct To: 0 = F
 				break;					
 			}
 		}
+		ack_waiting = was_waiting;
+		#if defined ENABLE_NETWORK_STATS
+		if(ok){
+		  stats_ack(millis() - reply_time);
+		}else{
+		  net_stats.ack_timeouts++;
+		}
+		#endif
+		#if defined (NETWORK_TRACE_DEPTH)
+		trace_event(TRACE_ACK_DONE,to_node,sent_id,ok);
+		#endif
     }
     if( !(networkFlags & FLAG_FAST_FRAG) ){
 	   #if !defined (DUAL_HEAD_RADIO)
          // Now, continue listening
-         radio.startListening();
+         radio_listen(true);
        #endif	
 	}
 
@@ -981,7 +2912,7 @@ bool RF24Network::write(uint16_t to_node, uint8_t directTo)  // Direct To: 0 = F
 /******************************************************************/
 
 	// Provided the to_node and directTo option, it will return the resulting node and pipe
-bool RF24Network::logicalToPhysicalAddress(logicalToPhysicalStruct *conversionInfo){
+bool RF24NetworkBase::logicalToPhysicalAddress(logicalToPhysicalStruct *conversionInfo){
 
   //Create pointers so this makes sense.. kind of
   //We take in the to_node(logical) now, at the end of the function, output the send_node(physical) address, etc.
@@ -1003,19 +2934,11 @@ bool RF24Network::logicalToPhysicalAddress(logicalToPhysicalStruct *conversionIn
 		pre_conversion_send_pipe=0;
 	//}	
   }     
-  // If the node is a direct child,
-  else
-  if ( is_direct_child(*to_node) )
-  {   
-    // Send directly
-    pre_conversion_send_node = *to_node;
-    // To its listening pipe
-    pre_conversion_send_pipe = 5;
-  }
-  // If the node is a child of a child
-  // talk on our child's listening pipe,
+  // If the node is a descendant, talk on the listening pipe of our child
+  // on the way to it, which is the node itself if it is a direct child,
   // and let the direct child relay it.
-  else if ( is_descendant(*to_node) )
+  else
+  if ( is_descendant(*to_node) )
   {
     pre_conversion_send_node = direct_child_route_to(*to_node);
     pre_conversion_send_pipe = 5;
@@ -1031,36 +2954,56 @@ bool RF24Network::logicalToPhysicalAddress(logicalToPhysicalStruct *conversionIn
 /********************************************************/
 
 
-bool RF24Network::write_to_pipe( uint16_t node, uint8_t pipe, bool multicast )
+bool RF24NetworkBase::write_to_pipe( uint16_t node, uint8_t pipe, bool multicast )
 {
   bool ok = false;
-  uint64_t out_pipe = pipe_address( node, pipe );
+  uint64_t out_pipe;
+  if( node == parent_node && pipe == parent_pipe ){
+    out_pipe = parent_pipe_address;
+  }else
+  if( pipe == 5 && node != node_address && is_direct_child(node) ){
+    out_pipe = child_pipe_address;
+    reinterpret_cast<uint8_t*>(&out_pipe)[node_level + 1] = address_translation[ (node >> (node_level * 3)) & 0x07 ];
+  }else{
+    out_pipe = pipe_address( node, pipe );
+  }
   
   #if !defined (DUAL_HEAD_RADIO)
   // Open the correct pipe for writing.
-  // First, stop listening so we can talk
-
-  if(!(networkFlags & FLAG_FAST_FRAG)){
-    radio.stopListening();
-  }
-  
-  if(multicast){ radio.setAutoAck(0,0);}else{radio.setAutoAck(0,1);}
-  
-  radio.openWritingPipe(out_pipe);
+  // First, stop listening so we can talk. Pipe 0 auto-ack is turned off again when the radio listens.
+  radio_listen(false);
+  radio_auto_ack(!multicast);
+  radio_writing_pipe(out_pipe);
 
   ok = radio.writeFast(frame_buffer, frame_size,0);
   
   if(!(networkFlags & FLAG_FAST_FRAG)){
+    #if defined (FORWARD_QUEUE_DEPTH)
+    // Queued frames are tried again later, leave the radio free to receive meanwhile
+    ok = forward_sending ? radio.txStandBy() : radio.txStandBy(txTimeout);
+    #else
     ok = radio.txStandBy(txTimeout);
-    radio.setAutoAck(0,0);
+    #endif
   }
   
 #else
-  radio1.openWritingPipe(out_pipe);
+  // The second radio only transmits, its writing pipe stays open
+  if( out_pipe != tx_pipe_address ){
+    radio1.openWritingPipe(out_pipe);
+    tx_pipe_address = out_pipe;
+  }
   radio1.writeFast(frame_buffer, frame_size);
   ok = radio1.txStandBy(txTimeout,multicast);
 
 #endif
+  #if defined (RF24_LINUX)
+  if(capture_file){
+    capture_frame(ok ? CAPTURE_TX_OK : CAPTURE_TX_FAIL,pipe,frame_buffer,frame_size);
+  }
+  #endif
+  #if defined ENABLE_NETWORK_STATS
+  stats_tx(node,ok);
+  #endif
 
 /*  #if defined (__arm__) || defined (RF24_LINUX)
   IF_SERIAL_DEBUG(printf_P(PSTR("%u: MAC Sent on %x %s\n\r"),millis(),(uint32_t)out_pipe,ok?PSTR("ok"):PSTR("failed")));
@@ -1073,6 +3016,67 @@ bool RF24Network::write_to_pipe( uint16_t node, uint8_t pipe, bool multicast )
 
 /******************************************************************/
 
+// The radio calls below are made only when they change something. RF24Network keeps track of what it
+// has set in radio_state and tx_pipe_address, each of these calls takes one or more SPI transactions.
+
+void RF24NetworkBase::radio_listen(bool listen)
+{
+  if(listen){
+    // Frames to the multicast address on pipe 0 are not acknowledged
+    radio_auto_ack(false);
+    if( (radio_state & (RADIO_LISTENING | RADIO_LISTENING_STALE)) != RADIO_LISTENING ){
+      radio.startListening();
+      radio_state = (radio_state | RADIO_LISTENING) & ~RADIO_LISTENING_STALE;
+      // startListening() puts the reading address back into pipe 0, where ACKs are received
+      tx_pipe_address = 0;
+    }
+  }else
+  if(radio_state & (RADIO_LISTENING | RADIO_LISTENING_STALE)){
+    radio.stopListening();
+    radio_state &= ~(RADIO_LISTENING | RADIO_LISTENING_STALE);
+  }
+}
+
+/******************************************************************/
+
+void RF24NetworkBase::radio_auto_ack(bool ack)
+{
+  if( ack != !!(radio_state & RADIO_AUTO_ACK) || (radio_state & RADIO_AUTO_ACK_STALE) ){
+    radio.setAutoAck(0,ack);
+    radio_state = (ack ? radio_state | RADIO_AUTO_ACK : radio_state & ~RADIO_AUTO_ACK) & ~RADIO_AUTO_ACK_STALE;
+  }
+}
+
+/******************************************************************/
+
+// The sketch may have used the radio since, the next radio_listen(), radio_auto_ack() and radio_writing_pipe()
+// calls go to the radio whatever they were before
+void RF24NetworkBase::radio_stale(void)
+{
+  radio_state |= RADIO_LISTENING_STALE | RADIO_AUTO_ACK_STALE;
+  tx_pipe_address = 0;
+}
+
+/******************************************************************/
+
+void RF24NetworkBase::resyncRadio(void)
+{
+  radio_stale();
+  radio_listen(true);
+}
+
+/******************************************************************/
+
+void RF24NetworkBase::radio_writing_pipe(uint64_t address)
+{
+  if( address != tx_pipe_address ){
+    radio.openWritingPipe(address);
+    tx_pipe_address = address;
+  }
+}
+
+/******************************************************************/
+
 const char* RF24NetworkHeader::toString(void) const
 {
   static char buffer[45];
@@ -1083,7 +3087,7 @@ const char* RF24NetworkHeader::toString(void) const
 
 /******************************************************************/
 
-bool RF24Network::is_direct_child( uint16_t node )
+bool RF24NetworkBase::is_direct_child( uint16_t node )
 {
   bool result = false;
 
@@ -1105,72 +3109,56 @@ bool RF24Network::is_direct_child( uint16_t node )
 
 /******************************************************************/
 
-bool RF24Network::is_descendant( uint16_t node )
+bool RF24NetworkBase::is_descendant( uint16_t node )
 {
   return ( node & node_mask ) == node_address;
 }
 
 /******************************************************************/
 
-void RF24Network::setup_address(void)
+void RF24NetworkBase::setup_address(void)
 {
-  // First, establish the node_mask
-  uint16_t node_mask_check = 0xFFFF;  
-  #if defined (RF24NetworkMulticast)
-  uint8_t count = 0;
-  #endif
-  
-  while ( node_address & node_mask_check ){
-    node_mask_check <<= 3;
+  node_mask = RF24NetworkAddress::mask(node_address);
+  parent_node = RF24NetworkAddress::parent(node_address);
+  parent_pipe = RF24NetworkAddress::parentPipe(node_address);
+  node_level = RF24NetworkAddress::level(node_address);
   #if defined (RF24NetworkMulticast)
-	  count++;
-  }
-  multicast_level = count;
-  #else
-  }
+  multicast_level = node_level;
   #endif
-  
-  node_mask = ~ node_mask_check;
-
-  // parent mask is the next level down
-  uint16_t parent_mask = node_mask >> 3;
 
-  // parent node is the part IN the mask
-  parent_node = node_address & parent_mask;
+  // The next hop of a routed frame is always the parent or a direct child, look their addresses up once
+  parent_pipe_address = pipe_address(parent_node,parent_pipe);
+  child_pipe_address = pipe_address(node_address,5);
+  tx_pipe_address = 0;
 
-  // parent pipe is the part OUT of the mask
-  uint16_t i = node_address;
-  uint16_t m = parent_mask;
-  while (m)
-  {
-    i >>= 3;
-    m >>= 3;
+  #if defined (FLOW_CONTROL_TIMEOUT)
+  memset(neighbor_credit,255,sizeof(neighbor_credit));
+  credit_refused = 0;
+  #endif
+  #if defined (FORWARD_QUEUE_DEPTH)
+  // Frames kept for the old routes are dropped
+  for(uint8_t i = 0; i < FORWARD_QUEUE_DEPTH; i++){
+    forward_queue[i].size = 0;
   }
-  parent_pipe = i;
+  memset(forward_backoff,0,sizeof(forward_backoff));
+  #endif
 
   IF_SERIAL_DEBUG_MINIMAL( printf_P(PSTR("setup_address node=0%o mask=0%o parent=0%o pipe=0%o\n\r"),node_address,node_mask,parent_node,parent_pipe););
 
 }
 
 /******************************************************************/
-uint16_t RF24Network::addressOfPipe( uint16_t node, uint8_t pipeNo )
+uint16_t RF24NetworkBase::addressOfPipe( uint16_t node, uint8_t pipeNo )
 {
 		//Say this node is 013 (1011), mask is 077 or (00111111)
 		//Say we want to use pipe 3 (11)
         //6 bits in node mask, so shift pipeNo 6 times left and | into address		
-	uint16_t m = node_mask >> 3;
-	uint8_t i=0;
-	
-	while (m){ 	   //While there are bits left in the node mask
-		m>>=1;     //Shift to the right
-		i++;       //Count the # of increments
-	}
-    return node | (pipeNo << i);	
+    return node | (pipeNo << (node_level ? (node_level - 1) * 3 : 0));
 }
 
 /******************************************************************/
 
-uint16_t RF24Network::direct_child_route_to( uint16_t node )
+uint16_t RF24NetworkBase::direct_child_route_to( uint16_t node )
 {
   // Presumes that this is in fact a child!!
   uint16_t child_mask = ( node_mask << 3 ) | 0x07;
@@ -1180,7 +3168,7 @@ uint16_t RF24Network::direct_child_route_to( uint16_t node )
 
 /******************************************************************/
 /*
-uint8_t RF24Network::pipe_to_descendant( uint16_t node )
+uint8_t RF24NetworkBase::pipe_to_descendant( uint16_t node )
 {
   uint16_t i = node;       
   uint16_t m = node_mask;
@@ -1194,37 +3182,13 @@ uint8_t RF24Network::pipe_to_descendant( uint16_t node )
   return i & 0B111;
 }*/
 
-/******************************************************************/
-
-bool RF24Network::is_valid_address( uint16_t node )
-{
-  bool result = true;
-
-  while(node)
-  {
-    uint8_t digit = node & 0x07;
-	#if !defined (RF24NetworkMulticast)
-    if (digit < 1 || digit > 5)
-	#else
-	if (digit < 0 || digit > 5)	//Allow our out of range multicast address
-	#endif
-    {
-      result = false;
-      IF_SERIAL_DEBUG_MINIMAL(printf_P(PSTR("*** WARNING *** Invalid address 0%o\n\r"),node););
-      break;
-    }
-    node >>= 3;
-  }
-
-  return result;
-}
-
 /******************************************************************/
 #if defined (RF24NetworkMulticast)
-void RF24Network::multicastLevel(uint8_t level){
+void RF24NetworkBase::multicastLevel(uint8_t level){
   multicast_level = level;
   //radio.stopListening();  
   radio.openReadingPipe(0,pipe_address(levelToAddress(level),0));
+  tx_pipe_address = 0; // ACKs come in on pipe 0
   //radio.startListening();
   }
   
@@ -1244,7 +3208,6 @@ uint16_t levelToAddress(uint8_t level){
 uint64_t pipe_address( uint16_t node, uint8_t pipe )
 {
   
-  static uint8_t address_translation[] = { 0xc3,0x3c,0x33,0xce,0x3e,0xe3,0xec };
   uint64_t result = 0xCCCCCCCCCCLL;
   uint8_t* out = reinterpret_cast<uint8_t*>(&result);
   
@@ -1299,7 +3262,7 @@ ISR(WDT_vect){
 }
 
 
-bool RF24Network::sleepNode( unsigned int cycles, int interruptPin, uint8_t INTERRUPT_MODE){
+bool RF24NetworkBase::sleepNode( unsigned int cycles, int interruptPin, uint8_t INTERRUPT_MODE){
   sleep_cycles_remaining = cycles;
   set_sleep_mode(SLEEP_MODE_PWR_DOWN); // sleep mode is set here
   sleep_enable();
@@ -1333,7 +3296,7 @@ bool RF24Network::sleepNode( unsigned int cycles, int interruptPin, uint8_t INTE
   return !wasInterrupted;
 }
 
-void RF24Network::setup_watchdog(uint8_t prescalar){
+void RF24NetworkBase::setup_watchdog(uint8_t prescalar){
 
   uint8_t wdtcsr = prescalar & 7;
   if ( prescalar & 8 )
@@ -27,9 +27,6 @@
   #include <sys/time.h>
   #include <stddef.h>
   #include <assert.h>
-  #include <map>
-  #include <utility>      // std::pair
-  #include <queue>
   
 //ATXMega
 #elif defined(XMEGA_D3)
@@ -157,6 +154,59 @@
 
 #define NETWORK_MORE_FRAGMENTS_NACK 200
 
+/**
+ * Set in the countdown in header.reserved of the middle fragments of a message sent with FLAG_SELECTIVE_REPEAT, to
+ * ask the recipient for NETWORK_FRAGMENT_NACK reports. Fragment countdowns go up to 63, below this flag,
+ * which limits MAX_PAYLOAD_SIZE to 1512.
+ */
+#define FRAGMENT_REPORT 0x40
+
+/**
+ * Sent back by the recipient of a message with FRAGMENT_REPORT fragments, when the last fragment arrives
+ * and when the message is complete. The payload is a bitmap of the fragments received so far, bit n standing for the
+ * fragment with the countdown n in header.reserved, with the last fragment being 1. An empty payload means the message is complete.
+ */
+#define NETWORK_FRAGMENT_NACK 199
+
+/**
+ * Set in the countdown in header.reserved of the first and middle fragments of a message that was compressed before
+ * it was fragmented, see FLAG_COMPRESS. The compressed message starts with its uncompressed size (uint16_t), the
+ * recipient uncompresses it once all fragments are in, or drops it if the message is larger than it takes.
+ */
+#define FRAGMENT_COMPRESSED 0x80
+
+/**
+ * Announces a bulk transfer, see RF24Network::bulkWrite(). The payload is the size of the transfer (uint32_t) and the
+ * window of the sender (uint8_t), the user header type is sent in the reserved field.
+ */
+#define NETWORK_BULK_OPEN 202
+
+/**
+ * Carries up to 20 bytes of a bulk transfer. The payload is the offset of the data (uint32_t) followed by the data,
+ * the user header type is sent in the reserved field.
+ */
+#define NETWORK_BULK_DATA 203
+
+/**
+ * Sent back by the recipient of a bulk transfer. The payload is the offset it expects next (uint32_t), the reserved
+ * field tells whether data was missing or the transfer was refused.
+ */
+#define NETWORK_BULK_ACK 204
+
+/**
+ * Flow control: tells a parent or child how many more frames the sender can take. The count is in the reserved
+ * field, capped at 255. It is sent with a count of 0 when the receive queue of the sender fills up, and again with
+ * the free space once the application has read from it. See FLOW_CONTROL_TIMEOUT.
+ */
+#define NETWORK_CREDIT 205
+
+/**
+ * Carries several small messages to the parent or a child, packed by a sender with FLAG_AGGREGATE. Each one is
+ * its to_node (uint16_t), type, length and payload. The recipient handles them as frames from the same node,
+ * with the id of this frame. See AGGREGATE_WINDOW.
+ */
+#define NETWORK_AGGREGATE 206
+
 
 /** Internal defines for handling written payloads */
 #define TX_NORMAL 0
@@ -167,6 +217,18 @@
 
 #define MAX_FRAME_SIZE 32   //Size of individual radio frames
 #define FRAME_HEADER_SIZE 10 //Size of RF24Network frames - data
+#if defined (COMPACT_HEADERS)
+#define COMPACT_HEADER_SIZE 5 //from_node, id and type, to_node and reserved are left out
+#define COMPACT_HEADER_FLAG 0x8000 //Set in from_node of a compact header, never part of a valid address
+#define FRAME_BUFFER_SIZE (MAX_FRAME_SIZE + 8 - COMPACT_HEADER_SIZE) //A received frame with its header expanded
+#else
+#define FRAME_BUFFER_SIZE MAX_FRAME_SIZE
+#endif
+#if !defined (DISABLE_FRAGMENTATION)
+#define MAX_FRAGMENTS (uint16_t(MAX_PAYLOAD_SIZE)/24) //Fragments per message
+// The countdown in header.reserved shares its byte with FRAGMENT_REPORT and FRAGMENT_COMPRESSED
+static_assert(MAX_FRAGMENTS <= 63, "MAX_PAYLOAD_SIZE must not be more than 63 fragments of 24 bytes (1512)");
+#endif
 
 #define USE_CURRENT_CHANNEL 255 // Use current radio channel when setting up the network
 
@@ -186,7 +248,79 @@
  
  #define FLAG_NO_POLL 8
 
+ #define FLAG_SELECTIVE_REPEAT 16
+
+ #define FLAG_AGGREGATE 32
+
+ #define FLAG_COMPRESS 64
+
+/** Results of writeStatus() */
+#define ASYNC_WRITE_INVALID 0  // Unknown handle, or the result was already collected
+#define ASYNC_WRITE_PENDING 1
+#define ASYNC_WRITE_OK 2
+#define ASYNC_WRITE_FAILED 3
+
+/** Results of bulkStatus() */
+#define BULK_IDLE 0  // No transfer was started
+#define BULK_PENDING 1
+#define BULK_OK 2
+#define BULK_FAILED 3
+
+#if !defined (RF24_NETWORK_VIRTUAL_RADIO)
 class RF24;
+#endif
+
+/**
+ * Address math of the tree topology
+ *
+ * A node's place in the tree follows from its address alone. These functions are constexpr, so the compiler
+ * works them out when the address is known at build time, see RF24Network::begin<>().
+ * @note Addresses are specified in octal: 011, 034
+ */
+struct RF24NetworkAddress
+{
+  /** @return The number of octal digits of @p node, which is its depth in the tree */
+  static constexpr uint8_t level(uint16_t node){ return node ? 1 + level(node >> 3) : 0; }
+
+  /** @return The bits which contain significant address information at the level of @p node */
+  static constexpr uint16_t mask(uint16_t node){ return uint16_t((1UL << (3 * level(node))) - 1); }
+
+  /** @return The parent of @p node */
+  static constexpr uint16_t parent(uint16_t node){ return node & (mask(node) >> 3); }
+
+  /** @return The pipe the parent of @p node listens to it on, which is its highest digit */
+  static constexpr uint8_t parentPipe(uint16_t node){ return node ? node >> (3 * (level(node) - 1)) : 0; }
+
+  /**
+   * Digits 6 and 7 are the only ones with both upper bits set. Without multicast, a digit may only be 0
+   * if all the digits above it are 0 too.
+   * @return True if @p node is a valid address
+   */
+  static constexpr bool valid(uint16_t node){
+    return !(node & (node << 1) & 044444)
+    #if !defined (RF24NetworkMulticast)
+      && !((nonzero(node) >> 3) & ~nonzero(node))
+    #endif
+      ;
+  }
+
+  /** @return The radio address of pipe @p pipe of @p node, the same as used by RF24Network::begin() */
+  static constexpr uint64_t pipeAddress(uint16_t node, uint8_t pipe){
+    #if defined (RF24NetworkMulticast)
+    return pipe || !node ? setByte(digits(node,1),0,translate(pipe)) : setByte(0xCCCCCCCCCCULL,1,translate(level(node)));
+    #else
+    return setByte(digits(node,1),0,translate(pipe));
+    #endif
+  }
+
+private:
+  /** Bit 0 of every digit that is not 0 */
+  static constexpr uint16_t nonzero(uint16_t node){ return (node | node >> 1 | node >> 2) & 0111111; }
+  /** The radio address byte for an octal digit: 0xc3,0x3c,0x33,0xce,0x3e,0xe3,0xec */
+  static constexpr uint8_t translate(uint8_t digit){ return uint8_t(0xECE33ECE333CC3ULL >> (8 * digit)); }
+  static constexpr uint64_t setByte(uint64_t address, uint8_t byte, uint8_t value){ return (address & ~(0xFFULL << (8 * byte))) | (uint64_t(value) << (8 * byte)); }
+  static constexpr uint64_t digits(uint16_t node, uint8_t byte){ return node ? setByte(digits(node >> 3,byte + 1),byte,translate(node & 07)) : 0xCCCCCCCCCCULL; }
+};
 
 /**
  * Header which is sent with each message
@@ -342,6 +476,187 @@ struct RF24NetworkHeader
 
 };
 
+#if defined (RF24_LINUX)
+/**
+ * **Linux** <br>
+ * Bounded queue of frames, used for the frame_queue, priority_queue and external_queue
+ *
+ * The slots are allocated along with the queue by RF24NetworkFrameQueueSized, so receiving never allocates
+ * memory. Frames can be built directly in the next free slot with reserve() and commit().
+ * When the queue is full, new frames are refused and counted in @p dropped.
+ *
+ * The std::queue calls used by external systems (empty, size, front, pop) behave the same.
+ */
+class RF24NetworkFrameQueue
+{
+protected:
+  RF24NetworkFrameQueue(RF24NetworkFrame* _slots, uint16_t _depth): dropped(0), slots(_slots), depth(_depth), head(0), count(0) {}
+
+public:
+  bool empty(void) const { return count == 0; }
+  bool full(void) const { return count == depth; }
+  size_t size(void) const { return count; }
+
+  /** The oldest frame. Only valid if the queue is not empty */
+  RF24NetworkFrame& front(void) { return slots[head]; }
+  const RF24NetworkFrame& front(void) const { return slots[head]; }
+
+  /** Remove the oldest frame */
+  void pop(void)
+  {
+    if ( count ){
+      head = (head + 1) % depth;
+      count--;
+    }
+  }
+
+  /**
+   * Get the next free slot, to build a frame in place
+   *
+   * The frame is added to the queue by commit()
+   * @return The slot, or NULL if the queue is full
+   */
+  RF24NetworkFrame* reserve(void)
+  {
+    if ( full() ){
+      dropped++;
+      return NULL;
+    }
+    return &slots[(head + count) % depth];
+  }
+
+  /** Add the frame built in the slot returned by reserve() */
+  void commit(void) { count++; }
+
+  /**
+   * Copy a frame to the end of the queue
+   *
+   * Only the used part of the message buffer is copied
+   * @return False if the queue is full
+   */
+  bool push(const RF24NetworkFrame& frame)
+  {
+    RF24NetworkFrame* slot = reserve();
+    if ( !slot ){
+      return false;
+    }
+    slot->header = frame.header;
+    slot->message_size = frame.message_size;
+    memcpy(slot->message_buffer,frame.message_buffer,frame.message_size);
+    commit();
+    return true;
+  }
+
+  uint32_t dropped; /**< Frames refused because the queue was full */
+
+private:
+  RF24NetworkFrameQueue(const RF24NetworkFrameQueue&); // The slots belong to the derived class
+
+  RF24NetworkFrame* slots;
+  uint16_t depth;
+  uint16_t head;
+  uint16_t count;
+};
+
+/**
+ * **Linux** <br>
+ * RF24NetworkFrameQueue with room for @p _depth frames
+ */
+template<uint16_t _depth>
+class RF24NetworkFrameQueueSized : public RF24NetworkFrameQueue
+{
+public:
+  RF24NetworkFrameQueueSized(): RF24NetworkFrameQueue(storage, _depth) {}
+
+private:
+  RF24NetworkFrame storage[_depth ? _depth : 1];
+};
+
+#if !defined (PRIORITY_QUEUE_DEPTH)
+  #define PRIORITY_QUEUE_DEPTH 0
+#endif
+#endif
+
+#if defined (ENABLE_NETWORK_STATS)
+/**
+ * Counters for the parent, a direct child, or the other nodes this node talks to, see RF24Network::stats()
+ */
+struct RF24NetworkNeighborStats
+{
+  uint32_t tx_attempts; /**< Frames sent to the neighbor */
+  uint32_t tx_ok;       /**< Frames acknowledged by the neighbor's radio */
+  uint32_t rx_frames;   /**< Frames received through the neighbor */
+  uint32_t routed;      /**< Frames received through the neighbor and sent on by this node */
+};
+
+/**
+ * Counters for a header type, see RF24Network::stats()
+ */
+struct RF24NetworkTypeStats
+{
+  uint32_t tx;  /**< Messages of the type written by this node */
+  uint32_t rx;  /**< Frames of the type received for this node */
+  uint8_t type;
+};
+
+/**
+ * A snapshot of the statistics of an instance, see RF24Network::stats()
+ */
+struct RF24NetworkStats
+{
+  RF24NetworkNeighborStats neighbors[7]; /**< The parent at 0, the direct children at their last digit, other nodes and multicast at 6 */
+  RF24NetworkTypeStats types[NETWORK_STATS_TYPES]; /**< The first NETWORK_STATS_TYPES types seen, in the first @p types_used entries */
+  uint8_t types_used;
+  uint32_t types_other;     /**< Messages and frames of types that did not fit in @p types */
+  uint32_t ack_timeouts;    /**< Writes that did not get their NETWORK_ACK within routeTimeout */
+  uint32_t ack_rtt[8];      /**< NETWORK_ACK round trips of less than 1, 2, 4, 8, 16, 32 and 64 ms, and longer */
+  uint32_t frag_invalid;    /**< Fragments dropped as duplicates, out of order or malformed */
+  uint32_t frag_oversize;   /**< Fragments of messages larger than this node takes */
+  uint32_t frag_corrupt;    /**< Compressed messages that did not uncompress to the size they were sent with */
+  uint32_t frag_queue_full; /**< Reassembled messages dropped for lack of queue space */
+  uint32_t queue_drops;     /**< Linux only: Frames dropped for lack of room in their queue, such as a full external or priority queue */
+  uint32_t holds;           /**< Times reading from the radio was held with FLAG_HOLD_INCOMING */
+  uint16_t queue_high_water; /**< The most the frame queue held: bytes, or frames on Linux */
+};
+#endif
+
+#if defined (RF24_LINUX)
+/** Link type of capture() files, LINKTYPE_USER0 of pcap */
+#define CAPTURE_LINKTYPE 147
+/** Directions of the frames in capture() files */
+#define CAPTURE_RX 0
+#define CAPTURE_TX_OK 1
+#define CAPTURE_TX_FAIL 2
+#endif
+
+#if defined (NETWORK_TRACE_DEPTH)
+#if (NETWORK_TRACE_DEPTH & (NETWORK_TRACE_DEPTH - 1))
+  #error NETWORK_TRACE_DEPTH must be a power of 2
+#endif
+/** Events of the trace, see RF24Network::trace(). @p node, @p id and @p arg of RF24NetworkTraceEvent are given for each */
+#define TRACE_MAC_RX 1        // A frame was read: from_node, id, type
+#define TRACE_MAC_TX 2        // A frame was sent: next hop, id, 1 if the radio acknowledged it
+#define TRACE_ROUTE 3         // A frame is sent to a node: next hop, id, the pipe it goes to
+#define TRACE_FORWARD_DROP 4  // A routed frame was given up after its retries: to_node, id, type
+#define TRACE_FRAGMENT 5      // A fragment was stored: from_node, id, its countdown
+#define TRACE_FRAGMENT_DROP 6 // A fragment or reassembled message was dropped: from_node, id, 0 invalid, 1 too large, 2 queue full, 3 corrupt
+#define TRACE_ACK_WAIT 7      // write() waits for a NETWORK_ACK: to_node, id, 0
+#define TRACE_ACK_DONE 8      // The wait ended: to_node, id, 1 if the NETWORK_ACK arrived
+#define TRACE_HOLD 9          // Reading from the radio is held until the queues have room: 0, 0, 0
+
+/**
+ * An event recorded in the trace ring, see RF24Network::trace()
+ */
+struct RF24NetworkTraceEvent
+{
+  uint32_t time;  /**< millis() when it was recorded */
+  uint16_t node;
+  uint16_t id;
+  uint8_t event;  /**< One of the TRACE_ values */
+  uint8_t arg;
+};
+#endif
+
  
 
 /**
@@ -349,9 +664,12 @@ struct RF24NetworkHeader
  *
  * This class implements an OSI Network Layer using nRF24L01(+) radios driven
  * by RF24 library.
+ *
+ * The buffers are provided by the derived class: RF24Network sizes them from RF24Network_config.h,
+ * RF24NetworkSized per instance.
  */
 
-class RF24Network
+class RF24NetworkBase
 {
 
   /**@}*/
@@ -362,15 +680,21 @@ class RF24Network
    */
   /**@{*/
   
-public:
+protected:
   /**
-   * Construct the network
+   * Construct the network with the buffers of the derived class
    *
    * @param _radio The underlying radio driver instance
-   *
+   * @param _queue Space for received frames until they are read (Arduino only)
+   * @param _queue_size The size of @p _queue in bytes
+   * @param _frag_buffer Space to reassemble fragmented messages in, or NULL if fragmentation is not used (Arduino only)
+   * @param _max_payload_size The largest message that can be sent or received
+   * @param _priority_queue Space for received frames of the types marked by setPriority(), or NULL to queue them with the others (Arduino only)
+   * @param _priority_queue_size The size of @p _priority_queue in bytes
    */
+  RF24NetworkBase( RF24& _radio, uint8_t* _queue, uint16_t _queue_size, uint8_t* _frag_buffer, uint16_t _max_payload_size, uint8_t* _priority_queue, uint16_t _priority_queue_size );
 
-  RF24Network( RF24& _radio );
+public:
 
   /**
    * Bring up the network using the current radio frequency/channel.
@@ -400,6 +724,43 @@ public:
 	  begin(USE_CURRENT_CHANNEL,_node_address);
   }
 
+  /**
+   * Bring up the network with an address that is fixed at build time
+   *
+   * Works like begin(), but the address is checked when compiling, and the node's place in the tree
+   * is worked out by the compiler instead of at runtime.
+   * @code
+   * network.begin<011>();    // Current channel
+   * network.begin<011>(90);  // Channel 90
+   * @endcode
+   * @param _channel The RF channel to operate on, or USE_CURRENT_CHANNEL
+   */
+  template<uint16_t _node_address>
+  void begin(uint8_t _channel = USE_CURRENT_CHANNEL){
+    static_assert(RF24NetworkAddress::valid(_node_address),"Invalid RF24Network node address");
+    constexpr uint16_t parent = RF24NetworkAddress::parent(_node_address);
+    constexpr uint8_t pipe = RF24NetworkAddress::parentPipe(_node_address);
+    constexpr uint64_t pipes[6] = { RF24NetworkAddress::pipeAddress(_node_address,0), RF24NetworkAddress::pipeAddress(_node_address,1),
+                                    RF24NetworkAddress::pipeAddress(_node_address,2), RF24NetworkAddress::pipeAddress(_node_address,3),
+                                    RF24NetworkAddress::pipeAddress(_node_address,4), RF24NetworkAddress::pipeAddress(_node_address,5) };
+    constexpr uint64_t parent_address = RF24NetworkAddress::pipeAddress(parent,pipe);
+    constexpr uint16_t mask = RF24NetworkAddress::mask(_node_address);
+    constexpr uint8_t level = RF24NetworkAddress::level(_node_address);
+
+    node_address = _node_address;
+    node_mask = mask;
+    parent_node = parent;
+    parent_pipe = pipe;
+    node_level = level;
+    #if defined (RF24NetworkMulticast)
+    multicast_level = level;
+    #endif
+    parent_pipe_address = parent_address;
+    child_pipe_address = pipes[5];
+    tx_pipe_address = 0;
+    begin_radio(_channel,pipes);
+  }
+
   /**
    * Main layer loop
    *
@@ -453,6 +814,73 @@ public:
    */
   uint16_t read(RF24NetworkHeader& header, void* message, uint16_t maxlen);
 
+  /**
+   * Access the next available message in place, without copying it
+   *
+   * The header and payload stay in the receive queue and remain valid until release() is called,
+   * so a handler can parse the payload directly. update() may be called in between.
+   *
+   * @code
+   * const uint8_t* data;
+   * uint16_t len;
+   * const RF24NetworkHeader* header = network.borrow(data,len);
+   * if(header){
+   *   if(header->type == 'T' && len >= sizeof(uint32_t)){
+   *     uint32_t time;
+   *     memcpy(&time,data,sizeof(time));
+   *   }
+   *   network.release();
+   * }
+   * @endcode
+   * @param[out] message Set to the payload of the next message
+   * @param[out] len Set to the payload size of the next message
+   * @return The header of the next message, or NULL if there is no message available
+   */
+  const RF24NetworkHeader* borrow(const uint8_t*& message, uint16_t& len);
+
+  /**
+   * Discard the next available message
+   *
+   * Used after borrow() to hand the message's space back to the receive queue. The message returned by the last
+   * borrow() is released, even if a message of a higher priority has arrived since.
+   * Does nothing if there is no message available.
+   */
+  void release(void);
+
+  /**
+   * Put messages of a type ahead of all others
+   *
+   * Messages of a priority type are kept in a queue of their own, and available(), peek(), read() and borrow()
+   * return them before any other message, however many others are queued. When the other queue is full, update()
+   * leaves incoming frames in the radio as before. With FLAG_BYPASS_HOLDS set, reading goes on, and priority
+   * messages still find room while the others are dropped.
+   *
+   * The system types (128 and up), such as the RF24Mesh address messages, are priority types by default.
+   * @code
+   * network.setPriority('A');   // Actuator commands
+   * @endcode
+   * @note The priority queue holds PRIORITY_QUEUE_DEPTH frames on Linux, and PRIORITY_BUFFER_SIZE bytes
+   * on Arduino. If it has no room at all, priority types are queued with the other messages.
+   * @param type The message type
+   * @param priority Whether messages of @p type are put ahead of the others
+   */
+  void setPriority(uint8_t type, bool priority = true);
+
+  /**
+   * Set the radio up for RF24Network again, after the sketch used it directly
+   *
+   * RF24Network skips the radio calls that would not change anything, so it assumes the radio is still set as
+   * it left it. write() checks again each time, but update() does not: a node that called radio.stopListening(),
+   * opened a writing pipe or wrote to the radio itself would stop receiving. Call this once done with the radio.
+   * @code
+   * radio.stopListening();
+   * radio.openWritingPipe(address);
+   * radio.write(&data,sizeof(data));
+   * network.resyncRadio();
+   * @endcode
+   */
+  void resyncRadio(void);
+
   /**
    * Send a message
    *
@@ -465,6 +893,8 @@ public:
    * RF24NetworkHeader header(to, 'T'); // Send header type 'T'
    * network.write(header,&time,sizeof(time));
    * @endcode
+   * @note With DUPLICATE_CACHE_SIZE, a recipient drops a message that has the same header and payload as one it
+   * received less than DUPLICATE_WINDOW ms before. Use a new header to send the same payload again right away.
    * @param[in,out] header The header (envelope) of this message.  The critical
    * thing to fill in is the @p to_node field so we know where to send the
    * message.  It is then updated with the details of the actual header sent.
@@ -474,6 +904,124 @@ public:
    */
   bool write(RF24NetworkHeader& header,const void* message, uint16_t len);
 
+  #if defined (NUM_ASYNC_WRITES)
+  /**
+   * Queue a message and return without waiting for it to be sent
+   *
+   * The message is sent by update(), one radio frame per call, including fragmentation, retries and waiting
+   * for the NETWORK_ACK of routed payloads, so the application loop keeps running meanwhile. Up to
+   * NUM_ASYNC_WRITES messages can be in progress at once, and may be delivered in any order.
+   *
+   * @code
+   * RF24NetworkHeader header(to, 'T');
+   * uint8_t handle = network.writeAsync(header,&time,sizeof(time));
+   * ...
+   * network.update();
+   * if(network.writeStatus(handle) == ASYNC_WRITE_OK){ ... }
+   * @endcode
+   * @param[in,out] header The header (envelope) of this message. The header id is renewed, so every message in progress has its own.
+   * @param message Pointer to the message. It is not copied, and must stay unchanged until the write has completed.
+   * @param len The size of the message
+   * @param callback Optional, called from update() with the handle and the result when the write completes.
+   * The handle is free again, and writeStatus() returns ASYNC_WRITE_INVALID for it.
+   * @return A handle for writeStatus(), or 0 if all slots are in use or the message is too large
+   */
+  uint8_t writeAsync(RF24NetworkHeader& header, const void* message, uint16_t len, void (*callback)(uint8_t handle, bool ok) = NULL);
+
+  /**
+   * Check on a message queued with writeAsync()
+   *
+   * Once ASYNC_WRITE_OK or ASYNC_WRITE_FAILED has been returned, the handle is released and may be reused.
+   *
+   * @param handle The handle returned by writeAsync()
+   * @return ASYNC_WRITE_PENDING, ASYNC_WRITE_OK, ASYNC_WRITE_FAILED or ASYNC_WRITE_INVALID
+   */
+  uint8_t writeStatus(uint8_t handle);
+  #endif
+
+  #if defined (BULK_WINDOW)
+  /**
+   * Start sending a stream of data of any size, such as a firmware image or a file
+   *
+   * The data is read from @p source 20 bytes at a time and sent by update(), one radio frame per call. Up to
+   * BULK_WINDOW frames are sent ahead of the recipient's acknowledgement, so frames follow each other along the
+   * route without waiting for a NETWORK_ACK. The recipient passes the data in order to its bulkSink(), and asks
+   * for missing data again from the offset where it is missing.
+   *
+   * If the transfer fails, call bulkWrite() again with the same type and size to resume it: the recipient still
+   * knows how far it got, and the transfer continues from there, even after the sender restarted.
+   *
+   * @code
+   * uint8_t readImage(uint32_t offset, uint8_t* buffer, uint8_t len){
+   *   memcpy_P(buffer,image + offset,len);
+   *   return len;
+   * }
+   * RF24NetworkHeader header(00, 'I');
+   * network.bulkWrite(header,sizeof(image),readImage);
+   * while(network.bulkStatus() == BULK_PENDING){
+   *   network.update();
+   * }
+   * @endcode
+   * @param[in,out] header The header of the transfer, with the recipient and a user type of 0-127
+   * @param size The number of bytes to send
+   * @param source Called by update() to read @p len bytes at @p offset into @p buffer, and returns the number of bytes read.
+   * Data can be asked for again from any offset not yet acknowledged by the recipient.
+   * @return False if a transfer is already in progress or @p size is 0
+   */
+  bool bulkWrite(RF24NetworkHeader& header, uint32_t size, uint8_t (*source)(uint32_t offset, uint8_t* buffer, uint8_t len));
+
+  /**
+   * Check on the transfer started with bulkWrite()
+   *
+   * @param[out] offset Optional, set to the number of bytes acknowledged by the recipient so far
+   * @return BULK_PENDING, BULK_OK, BULK_FAILED or BULK_IDLE
+   */
+  uint8_t bulkStatus(uint32_t* offset = NULL);
+
+  /**
+   * Receive bulk transfers
+   *
+   * One incoming transfer is handled at a time. Its data is not queued, but handed to @p sink from update() as it
+   * arrives, in order and exactly once. A new transfer is first announced with @p data NULL and @p len 0 at offset 0.
+   * A transfer from another node is refused until the current one is complete or has been idle for a second.
+   *
+   * @code
+   * bool writeImage(const RF24NetworkHeader& header, uint32_t size, uint32_t offset, const uint8_t* data, uint8_t len){
+   *   if(!data){
+   *     return size <= sizeof(image) && header.type == 'I';
+   *   }
+   *   memcpy(image + offset,data,len);
+   *   return true;
+   * }
+   * network.bulkSink(writeImage);
+   * @endcode
+   * @param sink Called with the header of the transfer, carrying the sender and the user type, the total size,
+   * and the next @p len bytes at @p offset. Returns false to refuse the transfer, the sender then fails. NULL stops receiving.
+   */
+  void bulkSink(bool (*sink)(const RF24NetworkHeader& header, uint32_t size, uint32_t offset, const uint8_t* data, uint8_t len));
+  #endif
+
+  #if defined (ENABLE_TYPE_HANDLERS)
+  /**
+   * Handle messages of one type as they arrive, instead of queueing them
+   *
+   * The handler is called from update() with the message still in the receive buffer, so it is not copied into the
+   * queue and read out again. Fragmented messages are handed over once they are complete. Messages of other types
+   * are queued as usual.
+   *
+   * @code
+   * void onReading(const RF24NetworkHeader& header, const uint8_t* message, uint16_t len){
+   *   memcpy(&readings[header.from_node & 07],message,rf24_min(len,sizeof(reading)));
+   * }
+   * network.setHandler('R',onReading);
+   * @endcode
+   * @param type The message type, a user type (0-127) or EXTERNAL_DATA_TYPE.
+   * @param handler Called with the header and the message, which is only valid during the call. NULL queues the type again.
+   * @return False for the system types, 128 and up, which update() handles itself
+   */
+  bool setHandler(uint8_t type, void (*handler)(const RF24NetworkHeader& header, const uint8_t* message, uint16_t len));
+  #endif
+
   /**@}*/
   /**
    * @name Advanced Configuration
@@ -483,19 +1031,12 @@ public:
   /**@{*/
   
 
-   /**
-   * Construct the network in dual head mode using two radio modules.
-   * @note Not working on RPi. Radios will share MISO, MOSI and SCK pins, but require separate CE,CS pins.
-   * @code
-   * 	RF24 radio(7,8);
-   * 	RF24 radio1(4,5);
-   * 	RF24Network(radio.radio1);
-   * @endcode
-   * @param _radio The underlying radio driver instance
-   * @param _radio1 The second underlying radio driver instance
-   */
-   
-  RF24Network( RF24& _radio, RF24& _radio1); 
+  #if defined (DUAL_HEAD_RADIO)
+protected:
+  /** Construct the network in dual head mode, see RF24Network( RF24& _radio, RF24& _radio1) */
+  RF24NetworkBase( RF24& _radio, RF24& _radio1, uint8_t* _queue, uint16_t _queue_size, uint8_t* _frag_buffer, uint16_t _max_payload_size, uint8_t* _priority_queue, uint16_t _priority_queue_size );
+public:
+  #endif
   
 	/**
 	* By default, multicast addresses are divided into levels. 
@@ -573,6 +1114,84 @@ public:
    *
    */
   void failures(uint32_t *_fails, uint32_t *_ok);
+
+  #if defined (ENABLE_NETWORK_STATS)
+  /**
+   * Copy the statistics of this instance, counted since it was created or since resetStats()
+   * @note This needs to be enabled via #define ENABLE_NETWORK_STATS in RF24Network_config.h
+   *
+   * @code
+   * RF24NetworkStats stats;
+   * network.stats(&stats);
+   * printf("child 3: %lu of %lu frames acked\n",stats.neighbors[3].tx_ok,stats.neighbors[3].tx_attempts);
+   * @endcode
+   * @param snapshot Filled in with the counters
+   */
+  void stats(RF24NetworkStats* snapshot);
+
+  /**
+   * Set the counters of stats() back to 0
+   */
+  void resetStats(void);
+  #endif
+
+  #if defined (NETWORK_TRACE_DEPTH)
+  /**
+   * Copy the latest events of the trace ring, oldest first. Events are recorded in binary as they happen,
+   * without formatting, so tracing can stay on without changing the timing of the network.
+   * @note This needs to be enabled via #define NETWORK_TRACE_DEPTH in RF24Network_config.h
+   *
+   * @code
+   * RF24NetworkTraceEvent events[16];
+   * uint16_t count = network.trace(events,16);
+   * @endcode
+   * @param events Filled in with up to @p max events
+   * @param max The size of @p events
+   * @return The number of events copied
+   */
+  uint16_t trace(RF24NetworkTraceEvent* events, uint16_t max);
+
+  #if defined (RF24_LINUX)
+  /**
+   * **Linux** <br>
+   * Print the events of the trace ring, oldest first
+   */
+  void printTrace(void);
+  #endif
+  #endif
+
+  #if defined (RF24_LINUX)
+  /**
+   * **Linux** <br>
+   * Write every frame update() reads, and every frame this node sends, to a pcap file.
+   *
+   * The file has the link type CAPTURE_LINKTYPE (LINKTYPE_USER0) and is written in the byte order of the host.
+   * The timestamps are millis(). Each packet starts with two bytes: the direction (CAPTURE_RX, CAPTURE_TX_OK or
+   * CAPTURE_TX_FAIL) and the pipe it was received or sent on. The frame follows: the 8 byte RF24NetworkHeader, little
+   * endian, and the payload. Received frames are as update() handles them, with a compact header expanded; sent frames
+   * are as they went to the radio.
+   *
+   * @code
+   * network.capture("gateway.pcap");
+   * // ... network.update() as usual
+   * network.capture(NULL);
+   * @endcode
+   * @param path The file to write, replaced if it exists, or NULL to stop capturing and close the file
+   * @return false if the file could not be created
+   */
+  bool capture(const char* path);
+
+  /**
+   * **Linux** <br>
+   * Feed the received frames of a capture() file to update() in place of the radio, bit for bit, until the end of the
+   * file. Sent frames in the file are skipped, while frames this node sends in reply still go to the radio. Frames are
+   * held back like radio payloads while the queues are full.
+   * @param path The file to read
+   * @param realtime true to keep the spacing the frames had when captured, false to feed them as fast as update() takes them
+   * @return false if the file could not be opened or is not a capture
+   */
+  bool replay(const char* path, bool realtime = false);
+  #endif
   
    #if defined (RF24NetworkMulticast)
   
@@ -644,7 +1263,7 @@ public:
     * @note Addresses are specified in octal: 011, 034
     * @return True if a supplied address is valid
 	*/
-   bool is_valid_address( uint16_t node );
+   bool is_valid_address( uint16_t node ){ return RF24NetworkAddress::valid(node); }
 
  /**@}*/
   /**
@@ -687,7 +1306,7 @@ public:
   
   /** The raw system frame buffer of received data. */
   
-  uint8_t frame_buffer[MAX_FRAME_SIZE];   
+  uint8_t frame_buffer[FRAME_BUFFER_SIZE];   
 
   /** 
    * **Linux** <br>
@@ -703,9 +1322,10 @@ public:
    *   network.external_queue.pop();
    * }
    * @endcode
+   * The queue holds up to FRAME_QUEUE_DEPTH frames. See RF24NetworkFrameQueue
    */
   #if defined (RF24_LINUX)
-    std::queue<RF24NetworkFrame> external_queue;
+    RF24NetworkFrameQueueSized<FRAME_QUEUE_DEPTH> external_queue;
   #endif
   
   #if !defined ( DISABLE_FRAGMENTATION ) &&  !defined (RF24_LINUX)
@@ -757,10 +1377,13 @@ public:
   * 
   * | FLAGS | Value | Description |
   * |-------|-------|-------------|
-  * |FLAG_HOLD_INCOMING| 1(bit_1) | INTERNAL: Set automatically when a fragmented payload will exceed the available cache |
+  * |FLAG_HOLD_INCOMING| 1(bit_1) | INTERNAL: Set automatically when a fragmented payload will exceed the available cache, or on Linux when the frame queue is full |
   * |FLAG_BYPASS_HOLDS| 2(bit_2) | EXTERNAL: Can be used to prevent holds from blocking. Note: Holds are disabled & re-enabled by RF24Mesh when renewing addresses. This will cause data loss if incoming data exceeds the available cache space|
   * |FLAG_FAST_FRAG| 4(bit_3) | INTERNAL: Replaces the fastFragTransfer variable, and allows for faster transfers between directly connected nodes. |
   * |FLAG_NO_POLL| 8(bit_4) | EXTERNAL/USER: Disables NETWORK_POLL responses on a node-by-node basis. |  
+  * |FLAG_SELECTIVE_REPEAT| 16(bit_5) | EXTERNAL/USER: Fragmented messages written with write() are not aborted when a fragment fails. The recipient reports the missing fragments, and only those are sent again. Recipients that send no report get the message again without the flag. Relays built without FORWARD_QUEUE_DEPTH and RX_BATCH_SIZE, such as AVR devices, can lose reports under heavy loss. |
+  * |FLAG_AGGREGATE| 32(bit_6) | EXTERNAL/USER: Messages of up to 8 bytes with types 0-64 are held for up to AGGREGATE_WINDOW ms, and sent in one NETWORK_AGGREGATE frame with the others for the same next hop. write() returns true once the message is held. |
+  * |FLAG_COMPRESS| 64(bit_7) | EXTERNAL/USER: Fragmented messages written with write() are compressed first when that saves fragments. Recipients must be built with ENABLE_COMPRESSION. |
   * 
   */
   uint8_t networkFlags;
@@ -768,9 +1391,13 @@ public:
   private:
 
   uint32_t txTime;
+  bool ack_waiting; /**< Set while write() waits for a NETWORK_ACK */
 
   bool write(uint16_t, uint8_t directTo);
   bool write_to_pipe( uint16_t node, uint8_t pipe, bool multicast );
+  void radio_listen(bool listen);
+  void radio_auto_ack(bool ack);
+  void radio_writing_pipe(uint64_t address);
   uint8_t enqueue(RF24NetworkHeader *header);
 
   bool is_direct_child( uint16_t node );
@@ -779,6 +1406,7 @@ public:
   uint16_t direct_child_route_to( uint16_t node );
   //uint8_t pipe_to_descendant( uint16_t node );
   void setup_address(void);
+  void begin_radio(uint8_t _channel, const uint64_t* pipes);
   bool _write(RF24NetworkHeader& header,const void* message, uint16_t len, uint16_t writeDirect);
     
   struct logicalToPhysicalStruct{
@@ -788,7 +1416,179 @@ public:
   };
   
   bool logicalToPhysicalAddress(logicalToPhysicalStruct *conversionInfo);
-  
+
+  bool dispatch(const RF24NetworkHeader& header, const uint8_t* message, uint16_t len);
+
+  uint8_t neighbor_index(uint16_t node);
+  uint16_t neighbor_of(uint16_t from_node);
+  void hold_incoming(void);
+  #if defined (FLOW_CONTROL_TIMEOUT)
+  uint8_t credit_available(void);
+  bool credit_ok(uint16_t next_hop);
+  void credit_send(uint16_t neighbor, uint8_t credit);
+  void credit_grant(void);
+  void credit_wait(uint16_t to_node);
+  uint8_t neighbor_credit[6]; /**< Last count sent by the parent (0) and the direct children (1-5) with NETWORK_CREDIT, 255 if unknown */
+  uint32_t neighbor_credit_time[6]; /**< millis() when it was sent */
+  uint8_t credit_refused; /**< Bit per neighbor that was sent a count of 0, and is waiting for more */
+  #endif
+  uint8_t priority_types[32]; /**< Bit per message type, set for the types of the priority queue */
+  bool priority_borrowed; /**< The last borrow() returned a message of the priority queue */
+  bool is_priority(uint8_t type) const { return priority_types[type>>3] & _BV(type&7); }
+  #if defined (ENABLE_TYPE_HANDLERS)
+  void (*type_handlers[256])(const RF24NetworkHeader& header, const uint8_t* message, uint16_t len); /**< Indexed by message type, NULL queues the message */
+  #endif
+
+  #if !defined (DISABLE_FRAGMENTATION)
+  /** Which fragments of a message have arrived, by the countdown sent in header.reserved */
+  struct RF24NetworkFragmentMap
+  {
+    uint8_t received[MAX_FRAGMENTS/8+1]; /**< Bit per fragment, the last fragment is bit 1 */
+    uint8_t total;     /**< Number of fragments, known once the first fragment arrived */
+    uint8_t last_size; /**< Size of the last fragment */
+    uint8_t type;      /**< The message type, carried by the last fragment */
+    bool nack;         /**< The sender wants NETWORK_FRAGMENT_NACK reports */
+    bool compressed;   /**< The fragments carry a compressed message, see FRAGMENT_COMPRESSED */
+  };
+  bool fragmentStore(RF24NetworkFragmentMap& map, uint8_t* buffer, const RF24NetworkHeader& header, const uint8_t* message, uint16_t len);
+  uint16_t fragmentAssemble(const RF24NetworkFragmentMap& map, uint8_t* buffer, const RF24NetworkHeader& header, bool& dropped);
+  void fragmentReport(const RF24NetworkHeader& header, const RF24NetworkFragmentMap* map);
+  bool write_selective(RF24NetworkHeader& header,const void* message, uint16_t len, uint16_t writeDirect, uint8_t compressed, bool& unreported);
+  uint16_t frag_report_id;      /**< Header id of the message write_selective() is sending */
+  bool frag_report_ready;       /**< A NETWORK_FRAGMENT_NACK arrived for it */
+  uint8_t frag_report_size;
+  uint8_t frag_report[MAX_FRAGMENTS/8+1];
+  #endif
+
+  #if defined (NUM_ASYNC_WRITES)
+  enum { ASYNC_SLOT_FREE, ASYNC_SLOT_SENDING, ASYNC_SLOT_WAIT_ACK, ASYNC_SLOT_OK, ASYNC_SLOT_FAILED };
+  /** A message queued by writeAsync() */
+  struct RF24NetworkAsyncWrite
+  {
+    RF24NetworkHeader header;
+    const uint8_t* message;
+    uint16_t len;
+    uint16_t offset; /**< Bytes of @p message already sent */
+    uint32_t time;   /**< millis() when the last frame was sent or failed */
+    void (*callback)(uint8_t handle, bool ok);
+    uint8_t state;
+    uint8_t retries; /**< Failed attempts of the current fragment */
+    RF24NetworkAsyncWrite(): state(ASYNC_SLOT_FREE) {}
+  };
+  RF24NetworkAsyncWrite async_writes[NUM_ASYNC_WRITES];
+  uint8_t async_next;      /**< Slot to look at first for the next frame, round robin */
+  bool async_sending;      /**< Set while update() sends an async frame, write() then leaves the NETWORK_ACK to update() */
+  bool async_ack_pending;  /**< Set by write() if a NETWORK_ACK is expected for the async frame */
+  void async_update(void);
+  bool async_fragmenting(uint8_t except);
+  void async_frame_done(uint8_t slot, bool ok);
+  #endif
+
+  bool rx_room(uint8_t staged, uint8_t size);
+  uint8_t payload_size(void);
+  uint8_t read_payload(uint8_t* buffer, uint8_t size);
+  bool next_frame(uint8_t& pipe_num);
+  #if defined (COMPACT_HEADERS)
+  uint8_t frame_compact(uint8_t* buffer, uint8_t size);
+  uint8_t frame_expand(uint8_t* buffer, uint8_t size);
+  #endif
+  #if defined (RX_BATCH_SIZE)
+  /** A frame read from the radio, not handled yet */
+  struct RF24NetworkRxFrame
+  {
+    uint8_t frame[FRAME_BUFFER_SIZE];
+    uint8_t size;
+    uint8_t pipe;     /**< The pipe it was received on */
+  };
+  RF24NetworkRxFrame rx_batch[RX_BATCH_SIZE];
+  uint8_t rx_batch_next;    /**< The next frame of rx_batch to handle */
+  uint8_t rx_batch_count;   /**< The number of frames in rx_batch */
+  #endif
+
+  #if defined (AGGREGATE_WINDOW)
+  uint8_t aggregate_buffer[MAX_FRAME_SIZE - sizeof(RF24NetworkHeader)]; /**< Payload of the next NETWORK_AGGREGATE frame */
+  uint8_t aggregate_size;   /**< Bytes used in aggregate_buffer, 0 if no messages are held */
+  uint8_t aggregate_count;
+  uint16_t aggregate_hop;   /**< The parent or direct child the held messages go to */
+  uint32_t aggregate_time;  /**< millis() when the first held message was written */
+  bool aggregate(RF24NetworkHeader& header, const void* message, uint16_t len);
+  bool aggregate_flush(void);
+  void aggregate_split(RF24NetworkHeader* header);
+  #endif
+
+  bool forward(uint16_t to_node);
+  #if defined (DUPLICATE_CACHE_SIZE)
+  /** A message received recently, to recognise copies of it */
+  struct RF24NetworkRecent
+  {
+    uint16_t from_node;
+    uint16_t id;
+    uint16_t sum;  /**< Checksum of the type and the payload */
+    uint32_t time; /**< millis() when it was received */
+  };
+  RF24NetworkRecent recent[DUPLICATE_CACHE_SIZE];
+  uint8_t recent_next; /**< The entry replaced next, round robin */
+  bool is_repeat(const RF24NetworkHeader* header);
+  #endif
+
+  #if defined (FORWARD_QUEUE_DEPTH)
+  /** A routed frame waiting to be sent on to the next hop */
+  struct RF24NetworkForward
+  {
+    uint8_t frame[MAX_FRAME_SIZE];
+    uint8_t size;     /**< Size of @p frame, 0 if the slot is free */
+    uint8_t retries;
+    uint16_t order;   /**< Frames to the same next hop are sent in this order */
+    uint16_t next_hop; /**< The parent or direct child the frame goes to */
+    RF24NetworkForward(): size(0) {}
+  };
+  RF24NetworkForward forward_queue[FORWARD_QUEUE_DEPTH];
+  uint16_t forward_order;   /**< order of the next frame put in the forward_queue */
+  bool forward_sending;     /**< Set while update() sends a queued frame, write_to_pipe() then stops after the radio's own retries */
+  uint32_t forward_backoff[6]; /**< millis() until which frames to the parent (0) or a direct child (1-5) wait after a failure */
+  void forward_update(void);
+  #endif
+
+  #if defined (BULK_WINDOW)
+  enum { BULK_ACK_PROGRESS, BULK_ACK_GAP, BULK_ACK_REFUSED };
+  /** The transfer started by bulkWrite() */
+  struct RF24NetworkBulkWrite
+  {
+    RF24NetworkHeader header;
+    uint32_t size;
+    uint32_t next;   /**< Offset of the next frame to send */
+    uint32_t acked;  /**< Offset acknowledged by the recipient */
+    uint32_t time;   /**< millis() of the last frame sent or progress acknowledged */
+    uint8_t (*source)(uint32_t offset, uint8_t* buffer, uint8_t len);
+    uint8_t state;
+    uint8_t timeouts; /**< Timeouts since the last progress */
+    bool opened;      /**< The recipient answered NETWORK_BULK_OPEN */
+    bool open_sent;
+    bool probing;     /**< After a timeout, only one frame is sent until the recipient answers */
+  };
+  /** The transfer being received */
+  struct RF24NetworkBulkRead
+  {
+    bool (*sink)(const RF24NetworkHeader& header, uint32_t size, uint32_t offset, const uint8_t* data, uint8_t len);
+    uint16_t from_node;
+    uint8_t type;
+    uint32_t size;
+    uint32_t offset;   /**< Bytes passed to the sink */
+    uint32_t time;     /**< millis() of the last frame received */
+    uint32_t gap_time; /**< millis() of the last NETWORK_BULK_ACK asking for missing data */
+    uint32_t acked;    /**< Offset sent in the last NETWORK_BULK_ACK */
+    uint8_t window;    /**< Window of the sender in frames, acknowledged once it has arrived */
+    bool gap;          /**< Missing data was asked for, and has not arrived yet */
+    bool refused;
+  };
+  RF24NetworkBulkWrite bulk_tx;
+  RF24NetworkBulkRead bulk_rx;
+  bool bulk_sending; /**< Set while bulk_update() sends a frame */
+  void bulk_update(void);
+  void bulk_frame(RF24NetworkHeader* header);
+  void bulk_ack(RF24NetworkHeader* header, uint8_t status);
+  #endif
+
   
   RF24& radio; /**< Underlying radio driver, provides link/physical layers */
 #if defined (DUAL_HEAD_RADIO)
@@ -801,11 +1601,28 @@ public:
   //const static int frame_size = 32; /**< How large is each frame over the air */
   uint8_t frame_size;
   const static unsigned int max_frame_payload_size = MAX_FRAME_SIZE-sizeof(RF24NetworkHeader);
+  uint16_t max_payload_size; /**< The largest message this instance sends or receives, set by the derived class */
 
   #if defined (RF24_LINUX)
-    std::queue<RF24NetworkFrame> frame_queue;
-	std::map< uint16_t, RF24NetworkFrame> frameFragmentsCache;
-    bool appendFragmentToFrame(RF24NetworkFrame frame);
+    RF24NetworkFrameQueueSized<FRAME_QUEUE_DEPTH> frame_queue;
+    RF24NetworkFrameQueueSized<PRIORITY_QUEUE_DEPTH> priority_queue; /**< Frames of the types marked by setPriority() */
+    #if !defined (DISABLE_FRAGMENTATION)
+    /** Done slots remember a delivered message until they time out, so copies of its fragments are not taken for a new one */
+    enum { FRAGMENT_SLOT_EMPTY, FRAGMENT_SLOT_USED, FRAGMENT_SLOT_DELETED, FRAGMENT_SLOT_DONE };
+    /** A message being reassembled from fragments */
+    struct RF24NetworkFragment
+    {
+      RF24NetworkFrame frame;
+      RF24NetworkFragmentMap map;
+      uint32_t updated; /**< millis() when the last fragment was added */
+      uint8_t state;
+      RF24NetworkFragment(): state(FRAGMENT_SLOT_EMPTY) {}
+    };
+    RF24NetworkFragment frameFragmentsCache[FRAGMENT_CACHE_SLOTS]; /**< Keyed by from_node and header id */
+    RF24NetworkFragment* fragmentCacheFind(uint16_t from_node, uint16_t id, bool create);
+    void fragmentCacheDelete(RF24NetworkFragment* f);
+    #endif
+    RF24NetworkFrameQueue& queue_for(uint8_t type);
   
   #else
     #if  defined(__AVR_ATtiny25__) || defined(__AVR_ATtiny45__) || defined(__AVR_ATtiny85__) || defined(__AVR_ATtiny24__) || defined(__AVR_ATtiny44__) || defined(__AVR_ATtiny84__)
@@ -817,17 +1634,28 @@ public:
 	  #define NUM_USER_PAYLOADS 5
 	#endif
 	  
-	#if defined (DISABLE_USER_PAYLOADS)
-    uint8_t frame_queue[1]; /**< Space for a small set of frames that need to be delivered to the app layer */
-	#else
-	uint8_t frame_queue[MAIN_BUFFER_SIZE]; /**< Space for a small set of frames that need to be delivered to the app layer */
-	#endif
-	
-	uint8_t* next_frame; /**< Pointer into the @p frame_queue where we should place the next received frame */
+	/** A ring of received frames in a byte buffer, see queue_alloc() */
+	struct RF24NetworkByteQueue
+	{
+	  uint8_t* buffer; /**< Space for a small set of frames that need to be delivered to the app layer */
+	  uint16_t size; /**< The size of @p buffer in bytes, 0 if the queue is not used */
+	  uint16_t head; /**< Offset of the oldest frame in the @p buffer */
+	  uint16_t tail; /**< Offset in the @p buffer where we should place the next received frame */
+	  uint16_t wrap; /**< When storing has wrapped around, the offset where the frames after @p head end, otherwise 0 */
+	  bool empty(void) const { return head == tail && !wrap; }
+	};
+	RF24NetworkByteQueue frame_queue;
+	RF24NetworkByteQueue priority_queue; /**< Frames of the types marked by setPriority() */
+	uint16_t queue_record_size(uint16_t message_size);
+	uint16_t queue_space(const RF24NetworkByteQueue& queue);
+	uint8_t* queue_alloc(RF24NetworkByteQueue& queue, uint16_t message_size);
+	RF24NetworkByteQueue& queue_for(uint8_t type, uint16_t message_size);
 	
 	#if !defined ( DISABLE_FRAGMENTATION )
       RF24NetworkFrame frag_queue;
-      uint8_t frag_queue_message_buffer[MAX_PAYLOAD_SIZE]; //frame size + 1 
+      uint8_t* frag_queue_message_buffer; /**< max_payload_size bytes, NULL if fragmentation is not used */
+      RF24NetworkFragmentMap frag_map; /**< Fragments of the message in @p frag_queue */
+      bool frag_done; /**< The message in @p frag_queue is complete */
     #endif
   
   #endif
@@ -838,16 +1666,167 @@ public:
   uint16_t parent_node; /**< Our parent's node address */
   uint8_t parent_pipe; /**< The pipe our parent uses to listen to us */
   uint16_t node_mask; /**< The bits which contain signfificant node address information */
+  uint64_t parent_pipe_address; /**< Writing pipe address of our parent, set by begin() */
+  uint64_t child_pipe_address; /**< Writing pipe address of our direct children, without the digit of the child, set by begin() */
+  uint8_t node_level; /**< Number of octal digits of node_address, its depth in the tree */
+  uint64_t tx_pipe_address; /**< Address loaded by openWritingPipe(), 0 once the radio has listened again */
+  enum { RADIO_LISTENING = 1, RADIO_AUTO_ACK = 2, RADIO_LISTENING_STALE = 4, RADIO_AUTO_ACK_STALE = 8 };
+  uint8_t radio_state; /**< What RF24Network last set on the radio: listening, and auto-ack on pipe 0, unless marked stale */
+  void radio_stale(void);
   
   #if defined ENABLE_NETWORK_STATS
   static uint32_t nFails;
   static uint32_t nOK;
+  RF24NetworkStats net_stats;
+  void stats_tx(uint16_t node, bool ok);
+  void stats_ack(uint32_t rtt);
+  void stats_type(uint8_t type, bool tx);
   #endif  
+
+  #if defined (RF24_LINUX)
+  FILE* capture_file;
+  void capture_frame(uint8_t direction, uint8_t pipe, const uint8_t* frame, uint8_t size);
+  FILE* replay_file;
+  bool replay_realtime;
+  uint32_t replay_start;  /**< millis() when replay() started */
+  uint32_t replay_first;  /**< Timestamp of the first packet of the file in ms, 0xFFFFFFFF until it is read */
+  uint32_t replay_time;   /**< When the frame in replay_frame is due, in ms after replay_start */
+  uint8_t replay_frame[FRAME_BUFFER_SIZE + 2]; /**< The next received frame of the file, behind its direction and pipe */
+  uint8_t replay_size;    /**< Bytes in replay_frame, 0 if the next one was not read yet */
+  bool replay_next(uint8_t& pipe_num);
+  #endif
+
+  #if defined (NETWORK_TRACE_DEPTH)
+  RF24NetworkTraceEvent trace_ring[NETWORK_TRACE_DEPTH];
+  uint32_t trace_count; /**< Events recorded, the next goes in trace_ring[trace_count % NETWORK_TRACE_DEPTH] */
+  void trace_event(uint8_t event, uint16_t node, uint16_t id, uint8_t arg)
+  {
+    RF24NetworkTraceEvent& e = trace_ring[trace_count++ & (NETWORK_TRACE_DEPTH - 1)];
+    e.time = millis();
+    e.node = node;
+    e.id = id;
+    e.event = event;
+    e.arg = arg;
+  }
+  #endif
   
 public:
 
    
 
+};
+
+/**
+ * Network layer with its own buffer sizes
+ *
+ * RF24Network takes its buffer sizes from RF24Network_config.h, so every instance in a build has the same.
+ * RF24NetworkSized sets them per instance: a leaf node can run with a small queue and no fragmentation,
+ * while a gateway built from the same code keeps large buffers.
+ * @code
+ * RF24NetworkSized<34,24> network(radio);   // Room for one frame, no fragmentation
+ * RF24NetworkSized<250,240> network(radio); // With MAX_PAYLOAD_SIZE of at least 240
+ * @endcode
+ *
+ * @tparam _main_buffer_size The size of the queue of received frames, see MAIN_BUFFER_SIZE (Arduino only)
+ * @tparam _max_payload_size The largest message sent or received, a multiple of 24 and at most MAX_PAYLOAD_SIZE.
+ * 24 disables fragmentation for the instance, and no reassembly buffer is allocated.
+ * @tparam _priority_buffer_size The size of the queue of frames of the types marked by setPriority(), see PRIORITY_BUFFER_SIZE.
+ * 0 queues them with the others (Arduino only)
+ * @note Features such as multicast or fragmentation support are still compiled in or out for the whole build
+ * by RF24Network_config.h. On Linux, received frames are queued in FRAME_QUEUE_DEPTH slots, so only
+ * @p _max_payload_size applies.
+ */
+#if defined (RF24_LINUX)
+  #define RF24_NETWORK_SIZED_BUFFERS NULL, 0, NULL, _max_payload_size, NULL, 0
+#elif defined (DISABLE_FRAGMENTATION)
+  #define RF24_NETWORK_SIZED_BUFFERS queue_buffer, sizeof(queue_buffer), NULL, _max_payload_size, _priority_buffer_size ? priority_buffer : NULL, _priority_buffer_size
+#else
+  #define RF24_NETWORK_SIZED_BUFFERS queue_buffer, sizeof(queue_buffer), _max_payload_size > 24 ? frag_buffer : NULL, _max_payload_size, _priority_buffer_size ? priority_buffer : NULL, _priority_buffer_size
+#endif
+
+template<uint16_t _main_buffer_size, uint16_t _max_payload_size = _main_buffer_size - 10, uint16_t _priority_buffer_size = 0>
+class RF24NetworkSized : public RF24NetworkBase
+{
+  static_assert(_max_payload_size >= 24 && _max_payload_size % 24 == 0, "The payload size must be a multiple of 24");
+  #if !defined (DISABLE_FRAGMENTATION)
+  static_assert(_max_payload_size <= uint16_t(MAX_PAYLOAD_SIZE), "The payload size must not be larger than MAX_PAYLOAD_SIZE");
+  #endif
+  #if !defined (RF24_LINUX) && !defined (DISABLE_USER_PAYLOADS)
+  static_assert(_main_buffer_size >= _max_payload_size + 10, "The buffer must hold a message of the largest payload size");
+  #endif
+
+public:
+  /**
+   * Construct the network
+   *
+   * @param _radio The underlying radio driver instance
+   */
+  RF24NetworkSized( RF24& _radio ): RF24NetworkBase(_radio, RF24_NETWORK_SIZED_BUFFERS) {}
+
+  #if defined (DUAL_HEAD_RADIO)
+  /**
+   * Construct the network in dual head mode using two radio modules
+   *
+   * @param _radio The underlying radio driver instance
+   * @param _radio1 The second underlying radio driver instance
+   */
+  RF24NetworkSized( RF24& _radio, RF24& _radio1 ): RF24NetworkBase(_radio, _radio1, RF24_NETWORK_SIZED_BUFFERS) {}
+  #endif
+
+private:
+  #if !defined (RF24_LINUX)
+    #if defined (DISABLE_USER_PAYLOADS)
+    uint8_t queue_buffer[1];
+    #else
+    uint8_t queue_buffer[_main_buffer_size];
+    #endif
+    #if !defined (DISABLE_FRAGMENTATION)
+    uint8_t frag_buffer[_max_payload_size > 24 ? _max_payload_size : 1];
+    #endif
+    uint8_t priority_buffer[_priority_buffer_size ? _priority_buffer_size : 1];
+  #endif
+};
+#undef RF24_NETWORK_SIZED_BUFFERS
+
+/**
+ * The network layer with the buffer sizes of RF24Network_config.h
+ *
+ * See RF24NetworkBase for the interface, and RF24NetworkSized to choose the sizes per instance.
+ */
+#if !defined (PRIORITY_BUFFER_SIZE)
+  #define PRIORITY_BUFFER_SIZE 0
+#endif
+#if defined (DISABLE_FRAGMENTATION)
+class RF24Network : public RF24NetworkSized<MAIN_BUFFER_SIZE, 24, PRIORITY_BUFFER_SIZE>
+#else
+class RF24Network : public RF24NetworkSized<MAIN_BUFFER_SIZE, MAX_PAYLOAD_SIZE, PRIORITY_BUFFER_SIZE>
+#endif
+{
+public:
+  /**
+   * Construct the network
+   *
+   * @param _radio The underlying radio driver instance
+   *
+   */
+
+  RF24Network( RF24& _radio ): RF24NetworkSized(_radio) {}
+
+  #if defined (DUAL_HEAD_RADIO)
+   /**
+   * Construct the network in dual head mode using two radio modules.
+   * @note Not working on RPi. Radios will share MISO, MOSI and SCK pins, but require separate CE,CS pins.
+   * @code
+   * 	RF24 radio(7,8);
+   * 	RF24 radio1(4,5);
+   * 	RF24Network(radio.radio1);
+   * @endcode
+   * @param _radio The underlying radio driver instance
+   * @param _radio1 The second underlying radio driver instance
+   */
+   
+  RF24Network( RF24& _radio, RF24& _radio1): RF24NetworkSized(_radio,_radio1) {}
+  #endif
 };
 
 /**
@@ -1098,7 +2077,10 @@ public:
  * | <b> #define DISABLE_USER_PAYLOADS </b> | This option will disable user-caching of payloads entirely. Use with RF24Ethernet to reduce memory usage. (TCP/IP is an external data type, and not cached) |
  * | <b> #define ENABLE_SLEEP_MODE </b> | Uncomment this option to enable sleep mode for AVR devices. (ATTiny,Uno, etc) |
  * | <b> #define DUAL_HEAD_RADIO </b> | Uncomment this option to enable use of dual radios |
- * | **#define ENABLE_NETWORK_STATS** | Enable counting of all successful or failed transmissions, routed or sent directly |
+ * | **#define ENABLE_NETWORK_STATS** | Enable counting of all successful or failed transmissions, routed or sent directly, and the per neighbor and per type counters of stats() |
+ *
+ * The buffer sizes can also be chosen per instance instead of for the whole build, see RF24NetworkSized.
+ * A leaf node using `RF24NetworkSized<34,24>` needs no reassembly buffer and only one frame of queue space.
  *
  ** @page Tuning Performance and Data Loss: Tuning the Network
  * Tips and examples for tuning the network and general operation.
@@ -1234,6 +2216,14 @@ public:
  * @endcode
  * c: First and third leaf nodes configured with default timeout periods or slightly increased timout periods.
  *
+ * @section Benchmark Measuring Changes
+ *
+ * The effect of txTimeout, routeTimeout, MAIN_BUFFER_SIZE and other settings can be measured without hardware.
+ * Running 'make bench' on Linux builds the library against the RF24Virtual radio (see RF24Virtual.h) and runs
+ * routed, fragmented, routed-ACK and multicast traffic over the tree 00 - 01 - 011 - 0111. It reports frames/s,
+ * payload bytes/s, p50/p99 delivery latency and retries per delivered byte. Virtual time is used, so runs are
+ * repeatable. 'tests/virtual/NetworkBench 50' repeats the run with 5% of transmissions lost.
+ *
  * @section DualHead Dual Headed Operation
  *
  * The library now supports a dual radio configuration to further enhance network performance, while reducing errors on
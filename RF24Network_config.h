@@ -35,24 +35,126 @@
     /** Maximum size of fragmented network frames and fragmentation cache. This MUST BE divisible by 24.
     * @note: Must be a multiple of 24.
     * @note: If used with RF24Ethernet, this value is used to set the buffer sizes.
+    * @note: At most 1512, a message has no more than 63 fragments.
     */
     #define MAX_PAYLOAD_SIZE  MAIN_BUFFER_SIZE-10
 
+    /** Linux only: The number of frames each of the frame_queue and external_queue can hold. Each frame uses MAX_PAYLOAD_SIZE + 10 bytes. */
+    #define FRAME_QUEUE_DEPTH 32
+
+    /** Linux only: The number of frames the priority_queue can hold, see setPriority(). 0 queues all frames in the frame_queue */
+    #define PRIORITY_QUEUE_DEPTH 8
+
+    /** Arduino only: The size in bytes of the queue for the message types marked by setPriority(), 34 holds one frame.
+     * It is left out on AVR devices to save the RAM. Comment out to queue all frames in the main buffer */
+    #if !defined (ARDUINO_ARCH_AVR)
+      #define PRIORITY_BUFFER_SIZE 24 + 10
+    #endif
+
+    /** Linux only: The number of fragmented messages that can be reassembled at the same time, and the time in ms after
+     * which a partial message is dropped if no more fragments arrive */
+    #define FRAGMENT_CACHE_SLOTS 16
+    #define FRAGMENT_CACHE_TIMEOUT 1000
+
+    /** The number of messages that can be queued with writeAsync() at the same time. Each uses about 40 bytes of RAM,
+     * which is why it is left out on AVR devices. Comment out to disable writeAsync() */
+    #if !defined (ARDUINO_ARCH_AVR)
+      #define NUM_ASYNC_WRITES 4
+    #endif
+
+    /** The number of frames a bulk transfer sends ahead of the recipient's last acknowledgement, see bulkWrite().
+     * The transfer state uses about 80 bytes of RAM, which is why it is left out on AVR devices. Comment out to disable bulk transfers */
+    #if !defined (ARDUINO_ARCH_AVR)
+      #define BULK_WINDOW 8
+    #endif
+
+    /** Allow setHandler() to take messages of a type straight from update(), without queueing them.
+     * The handlers are kept in a table of 256 function pointers, which does not fit the RAM of small AVR devices */
+    #if !defined (ARDUINO_ARCH_AVR)
+      #define ENABLE_TYPE_HANDLERS
+    #endif
+
+    /** Let FLAG_COMPRESS compress fragmented messages before they are sent, and uncompress them on arrival.
+     * A sender needs MAX_PAYLOAD_SIZE bytes more stack in write(), which is why it is left out on AVR devices.
+     * Comment out to disable, compressed messages are then dropped */
+    #if !defined (ARDUINO_ARCH_AVR)
+      #define ENABLE_COMPRESSION
+    #endif
+
+    /** With FLAG_AGGREGATE, how many ms a small message may be held for others to the same next hop to share its
+     * frame. The held messages take about 30 bytes of RAM, which is why it is left out on AVR devices, so FLAG_AGGREGATE
+     * must not be used to send to them. Comment out to disable aggregation, NETWORK_AGGREGATE frames are then dropped */
+    #if !defined (ARDUINO_ARCH_AVR)
+      #define AGGREGATE_WINDOW 2
+    #endif
+
+    /** The number of payloads update() reads from the radio before it handles any of them, so the RX FIFO is
+     * empty while the node forwards or answers. The radio holds 3. Each uses 34 bytes of RAM, 37 with COMPACT_HEADERS.
+     * It is left out on AVR devices to save the RAM. Comment out to handle each payload as it is read */
+    #if !defined (ARDUINO_ARCH_AVR)
+      #define RX_BATCH_SIZE 3
+    #endif
+
+    /** The number of routed frames a relay can hold for forwarding. They are sent on by update() after the received
+     * frames are read, and tried again with a backoff if the next hop does not answer. Each uses 38 bytes of RAM.
+     * It is left out on AVR devices to save the RAM. Comment out to forward routed frames as they arrive */
+    #if !defined (ARDUINO_ARCH_AVR)
+      #define FORWARD_QUEUE_DEPTH 3
+    #endif
+
+    /** With FORWARD_QUEUE_DEPTH, the number of recent messages a node remembers by sender, header id, type and a
+     * checksum of the payload, to drop the copy a relay sends when only the radio ACK of a routed frame was lost.
+     * A copy that arrives more than DUPLICATE_WINDOW ms after the message is delivered again. Each uses 10 bytes of RAM.
+     * @note A message written again with the same header and payload within DUPLICATE_WINDOW ms is dropped as a copy
+     * too. Use a new RF24NetworkHeader, which has a new id, to send the same payload twice.
+     * Comment out to deliver every copy */
+    #if defined (FORWARD_QUEUE_DEPTH)
+      #define DUPLICATE_CACHE_SIZE 4
+      #define DUPLICATE_WINDOW 250
+    #endif
+
+    /** Flow control between neighbors: a node whose receive queue is full tells the parent or child that sent to it
+     * with NETWORK_CREDIT, which then holds back frames to it instead of burning retries, until the node has room
+     * again or this many ms have passed. While a neighbor has no room, write() returns false without trying the radio.
+     * Nodes built without it take NETWORK_CREDIT for a user message, so all nodes of a network must be built with it.
+     * Uncomment to enable */
+    //#define FLOW_CONTROL_TIMEOUT 200
+
     /** Disable user payloads. Saves memory when used with RF24Ethernet or software that uses external data.*/
     //#define DISABLE_USER_PAYLOADS 
 
-    /** Enable tracking of success and failures for all transmissions, routed and user initiated */
+    /** Enable tracking of success and failures for all transmissions, routed and user initiated, and the per neighbor
+     * and per type counters of stats(). Uses about 300 bytes of RAM per instance. Uncomment to enable */
     //#define ENABLE_NETWORK_STATS
+
+    /** With ENABLE_NETWORK_STATS, the number of header types stats() counts separately */
+    #define NETWORK_STATS_TYPES 8
+
+    /** The number of events kept by the binary trace ring, see trace(). A power of 2, each uses 12 bytes of RAM.
+     * Unlike the SERIAL_DEBUG options it does not change the timing, and can be left on. Comment out to disable */
+    #if !defined (ARDUINO_ARCH_AVR)
+      #define NETWORK_TRACE_DEPTH 64
+    #endif
     
     /** Enable dynamic payloads - If using different types of NRF24L01 modules, some may be incompatible when using this feature **/
     #define ENABLE_DYNAMIC_PAYLOADS
 
+    /** Send frames that go straight to their recipient with a 5 byte header, which leaves out the recipient and the
+     * reserved byte, so a single frame carries up to 27 bytes of payload to the parent or a direct child.
+     * This changes what is sent over the air: nodes built without it, including RF24Mesh and RF24Ethernet nodes
+     * already deployed, cannot read these frames. All nodes of a network must be built with the same setting.
+     * Uncomment to enable */
+    //#define COMPACT_HEADERS
+
     /** Debug Options */
     //#define SERIAL_DEBUG
     //#define SERIAL_DEBUG_MINIMAL
     //#define SERIAL_DEBUG_ROUTING
     //#define SERIAL_DEBUG_FRAGMENTATION
     //#define SERIAL_DEBUG_FRAGMENTATION_L2
+
+    /** Linux only: Build against the in-memory RF24Virtual transport instead of the RF24 driver. See RF24Virtual.h */
+    //#define RF24_NETWORK_VIRTUAL_RADIO
     /*************************************/
  
   #else // Different set of defaults for ATTiny - fragmentation is disabled and user payloads are set to 3 max
@@ -74,7 +176,9 @@
 
 #ifdef __cplusplus
 
-#if (defined (__linux) || defined (linux)) && !defined (__ARDUINO_X86__)
+#if defined (RF24_NETWORK_VIRTUAL_RADIO)
+    #include "RF24Virtual.h"
+#elif (defined (__linux) || defined (linux)) && !defined (__ARDUINO_X86__)
     #include <RF24/RF24_config.h>
 	
 //ATXMega
@@ -111,6 +215,12 @@
     #else
       #define IF_SERIAL_DEBUG_ROUTING(x)
     #endif
+
+    #if defined (NETWORK_TRACE_DEPTH)
+      #define IF_NETWORK_TRACE(x) ({x;})
+    #else
+      #define IF_NETWORK_TRACE(x)
+    #endif
     
 
 #endif //RF24_CONFIG_H
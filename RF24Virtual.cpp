@@ -0,0 +1,547 @@
+/*
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ version 2 as published by the Free Software Foundation.
+ */
+
+#include "RF24Network_config.h"
+
+#if defined (RF24_NETWORK_VIRTUAL_RADIO)
+
+#include <stdlib.h>
+#include <ucontext.h>
+#include "RF24Virtual.h"
+
+#define ADDRESS_MASK 0xFFFFFFFFFFULL
+#define SETTLE_TIME 130              // PLL settling when switching between RX and TX
+#define ACK_TIME (SETTLE_TIME + 10 * 8)  // An empty ACK payload at 1Mbps
+
+RF24VirtualMedium* RF24VirtualMedium::active = NULL;
+
+/******************************************************************/
+
+/**
+ * A node's thread of execution. Tasks are switched cooperatively with
+ * swapcontext(), so only one runs at a time and runs are repeatable.
+ */
+struct RF24VirtualTask
+{
+  ucontext_t context;
+  uint64_t wake;        /**< Virtual time at which the task continues */
+  RF24Virtual* radio;   /**< NULL for the driver task */
+  void* stack;
+};
+
+#define TASK_STACK_SIZE (256 * 1024)
+
+/******************************************************************/
+
+uint32_t millis(void)
+{
+  return RF24VirtualMedium::active ? (uint32_t)(RF24VirtualMedium::active->now() / 1000) : 0;
+}
+
+uint32_t micros(void)
+{
+  return RF24VirtualMedium::active ? (uint32_t)RF24VirtualMedium::active->now() : 0;
+}
+
+void delay(uint32_t ms)
+{
+  delayMicroseconds(ms * 1000);
+}
+
+void delayMicroseconds(uint32_t us)
+{
+  if(RF24VirtualMedium::active){
+    RF24VirtualMedium::active->run(us);
+  }
+}
+
+/******************************************************************/
+
+RF24VirtualMedium::RF24VirtualMedium(uint32_t seed): loss(0), latency(0), fifoDepth(3), spiTime(10),
+                   pollInterval(50), clock(0), rng(seed ? seed : 1)
+{
+  RF24VirtualTask* driver = new RF24VirtualTask();
+  driver->wake = 0;
+  driver->radio = NULL;
+  driver->stack = NULL;
+  tasks.push_back(driver);
+  running = driver;
+  active = this;
+}
+
+RF24VirtualMedium::~RF24VirtualMedium()
+{
+  // Tasks still suspended inside their poll function are simply abandoned
+  for(size_t i = 0; i < tasks.size(); i++){
+    free(tasks[i]->stack);
+    delete tasks[i];
+  }
+  if(active == this){
+    active = NULL;
+  }
+}
+
+/******************************************************************/
+
+void RF24VirtualMedium::attach(RF24Virtual* radio)
+{
+  radios.push_back(radio);
+}
+
+void RF24VirtualMedium::detach(RF24Virtual* radio)
+{
+  for(size_t i = 0; i < radios.size(); i++){
+    if(radios[i] == radio){
+      radios.erase(radios.begin() + i);
+      break;
+    }
+  }
+  if(radio->task){
+    radio->task->radio = NULL;
+    radio->task->wake = (uint64_t)-1;
+  }
+}
+
+/******************************************************************/
+
+void RF24VirtualMedium::task_main(void)
+{
+  RF24VirtualMedium* medium = active;
+  RF24VirtualTask* self = medium->running;
+
+  while(self->radio){
+    RF24Virtual* radio = self->radio;
+    if(radio->job){
+      // Cleared once done, call() waits for that
+      radio->job();
+      radio->job = NULL;
+    }else
+    if(radio->poll){
+      radio->poll(radio->pollContext);
+    }
+    medium->elapse(medium->pollInterval);
+  }
+  // Detached, never scheduled again
+  medium->elapse(0);
+}
+
+/******************************************************************/
+
+void RF24VirtualMedium::elapse(uint32_t us)
+{
+  // Start a task for every radio that has a main loop
+  for(size_t i = 0; i < radios.size(); i++){
+    RF24Virtual* r = radios[i];
+    if(r->task || !r->poll){
+      continue;
+    }
+    RF24VirtualTask* t = new RF24VirtualTask();
+    t->wake = clock;
+    t->radio = r;
+    t->stack = malloc(TASK_STACK_SIZE);
+    getcontext(&t->context);
+    t->context.uc_stack.ss_sp = t->stack;
+    t->context.uc_stack.ss_size = TASK_STACK_SIZE;
+    t->context.uc_link = NULL;
+    makecontext(&t->context, task_main, 0);
+    r->task = t;
+    tasks.push_back(t);
+  }
+
+  RF24VirtualTask* self = running;
+  self->wake = clock + us;
+
+  // Resume whichever task wakes up first, ties go to the earliest task
+  RF24VirtualTask* next = self;
+  for(size_t i = 0; i < tasks.size(); i++){
+    if(tasks[i]->wake < next->wake){
+      next = tasks[i];
+    }
+  }
+  clock = next->wake;
+  if(next != self){
+    running = next;
+    swapcontext(&self->context, &next->context);
+  }
+}
+
+/******************************************************************/
+
+void RF24VirtualMedium::run(uint32_t us)
+{
+  elapse(us);
+}
+
+/******************************************************************/
+
+// CRC-16-CCITT, used with the packet id to tell retransmissions from new payloads
+static uint16_t crc16(const uint8_t* data, uint8_t len)
+{
+  uint16_t crc = 0xFFFF;
+  while(len--){
+    crc ^= (uint16_t)(*data++) << 8;
+    for(uint8_t i = 0; i < 8; i++){
+      crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+  }
+  return crc;
+}
+
+/******************************************************************/
+
+bool RF24VirtualMedium::lost(void)
+{
+  if(!loss){
+    return false;
+  }
+  // xorshift32
+  rng ^= rng << 13;
+  rng ^= rng >> 17;
+  rng ^= rng << 5;
+  return (rng % 1000) < loss;
+}
+
+/******************************************************************/
+
+bool RF24VirtualMedium::transmit(RF24Virtual* sender, const RF24Virtual::Payload& payload, bool noack)
+{
+  uint64_t address = sender->tx_address & ADDRESS_MASK;
+  uint16_t crc = crc16(payload.data, payload.len);
+  bool acked = false;
+
+  for(size_t i = 0; i < radios.size(); i++){
+    RF24Virtual* r = radios[i];
+    if(r == sender || !r->listening || r->channel != sender->channel){
+      continue;
+    }
+    for(uint8_t pipe = 0; pipe < 6; pipe++){
+      if(!(r->rx_open & _BV(pipe))){
+        continue;
+      }
+      // Pipes 2-5 only have their own LSB, the rest comes from pipe 1
+      uint64_t rx = r->rx_address[pipe];
+      if(pipe > 1){
+        rx = (r->rx_address[1] & ~0xFFULL) | (rx & 0xFF);
+      }
+      if((rx & ADDRESS_MASK) != address){
+        continue;
+      }
+      if(lost()){
+        break;
+      }
+      bool ack = !noack && (r->auto_ack & _BV(pipe));
+
+      if(ack && r->last_sender[pipe] == sender && r->last_pid[pipe] == sender->pid && r->last_crc[pipe] == crc){
+        // Retransmission of a payload we already have, just ACK it again
+        acked = true;
+        break;
+      }
+      if(r->rx_fifo.size() >= fifoDepth){
+        r->rxOverflows++;
+        break;
+      }
+      // The payload is only handed to the receiver once its ACK has gone out
+      RF24Virtual::Payload p = payload;
+      p.pipe = pipe;
+      p.due = clock + (ack ? ACK_TIME : 0) + latency;
+      r->rx_fifo.push_back(p);
+      if(ack){
+        r->last_sender[pipe] = sender;
+        r->last_pid[pipe] = sender->pid;
+        r->last_crc[pipe] = crc;
+        acked = true;
+      }
+      break;
+    }
+  }
+
+  if(noack || !(sender->auto_ack & _BV(0))){
+    return true;
+  }
+  // The ACK comes back on the pipe 0 address
+  return acked && (sender->rx_address[0] & ADDRESS_MASK) == address && !lost();
+}
+
+/******************************************************************/
+/******************************************************************/
+
+RF24Virtual::RF24Virtual(RF24VirtualMedium& _medium): poll(NULL), pollContext(NULL), medium(_medium), task(NULL)
+{
+  begin();
+  medium.attach(this);
+}
+
+RF24Virtual::~RF24Virtual()
+{
+  medium.detach(this);
+}
+
+/******************************************************************/
+
+bool RF24Virtual::begin(void)
+{
+  txPayloads = txAttempts = txFailures = rxPayloads = rxOverflows = configCalls = 0;
+  channel = 76;
+  listening = false;
+  auto_ack = 0x3F;
+  rx_open = 0x03;
+  memset(rx_address, 0, sizeof(rx_address));
+  pipe0_reading_address = 0;
+  tx_address = 0;
+  retry_delay = 5;
+  retry_count = 15;
+  pid = 0;
+  tx_pending = false;
+  tx_noack = false;
+  rx_fifo.clear();
+  memset(last_sender, 0, sizeof(last_sender));
+  memset(last_pid, 0, sizeof(last_pid));
+  memset(last_crc, 0, sizeof(last_crc));
+  return true;
+}
+
+bool RF24Virtual::isValid(void)
+{
+  return true;
+}
+
+void RF24Virtual::setChannel(uint8_t _channel)
+{
+  medium.elapse(medium.spiTime);
+  channel = rf24_min(_channel, 125);
+}
+
+uint8_t RF24Virtual::getChannel(void)
+{
+  medium.elapse(medium.spiTime);
+  return channel;
+}
+
+void RF24Virtual::setRetries(uint8_t delay, uint8_t count)
+{
+  medium.elapse(medium.spiTime);
+  retry_delay = delay & 0xF;
+  retry_count = count & 0xF;
+}
+
+void RF24Virtual::setAutoAck(bool enable)
+{
+  configCalls++;
+  medium.elapse(medium.spiTime);
+  auto_ack = enable ? 0x3F : 0;
+}
+
+void RF24Virtual::setAutoAck(uint8_t pipe, bool enable)
+{
+  configCalls++;
+  medium.elapse(medium.spiTime);
+  if(pipe < 6){
+    if(enable){ auto_ack |= _BV(pipe); }else{ auto_ack &= ~_BV(pipe); }
+  }
+}
+
+void RF24Virtual::enableDynamicPayloads(void)
+{
+  medium.elapse(medium.spiTime);
+}
+
+void RF24Virtual::enableDynamicAck(void)
+{
+  medium.elapse(medium.spiTime);
+}
+
+/******************************************************************/
+
+void RF24Virtual::openReadingPipe(uint8_t number, uint64_t address)
+{
+  medium.elapse(medium.spiTime);
+  if(number > 5){
+    return;
+  }
+  if(number == 0){
+    pipe0_reading_address = address;
+  }
+  rx_address[number] = address;
+  rx_open |= _BV(number);
+}
+
+void RF24Virtual::openWritingPipe(uint64_t address)
+{
+  configCalls++;
+  medium.elapse(medium.spiTime);
+  // Like the chip, the TX address is also loaded into pipe 0 to receive ACKs
+  tx_address = address;
+  rx_address[0] = address;
+}
+
+void RF24Virtual::startListening(void)
+{
+  configCalls++;
+  medium.elapse(medium.spiTime);
+  if(pipe0_reading_address){
+    rx_address[0] = pipe0_reading_address;
+  }else{
+    rx_open &= ~_BV(0);
+  }
+  // Nothing is received until the receiver has settled
+  if(!listening){
+    medium.elapse(SETTLE_TIME);
+    listening = true;
+  }
+}
+
+void RF24Virtual::stopListening(void)
+{
+  configCalls++;
+  medium.elapse(medium.spiTime);
+  listening = false;
+  rx_open |= _BV(0);
+}
+
+/******************************************************************/
+
+bool RF24Virtual::available(void)
+{
+  return available(NULL);
+}
+
+bool RF24Virtual::available(uint8_t* pipe_num)
+{
+  medium.elapse(medium.spiTime);
+  if(rx_fifo.empty() || rx_fifo.front().due > medium.now()){
+    return false;
+  }
+  if(pipe_num){
+    *pipe_num = rx_fifo.front().pipe;
+  }
+  return true;
+}
+
+uint8_t RF24Virtual::getDynamicPayloadSize(void)
+{
+  medium.elapse(medium.spiTime);
+  return rx_fifo.empty() ? 0 : rx_fifo.front().len;
+}
+
+void RF24Virtual::read(void* buf, uint8_t len)
+{
+  medium.elapse(medium.spiTime);
+  if(rx_fifo.empty()){
+    return;
+  }
+  const Payload& p = rx_fifo.front();
+  memcpy(buf, p.data, rf24_min(len, p.len));
+  rx_fifo.pop_front();
+  rxPayloads++;
+}
+
+bool RF24Virtual::rxFifoFull(void)
+{
+  medium.elapse(medium.spiTime);
+  return rx_fifo.size() >= medium.fifoDepth;
+}
+
+uint8_t RF24Virtual::flush_rx(void)
+{
+  medium.elapse(medium.spiTime);
+  rx_fifo.clear();
+  return 0;
+}
+
+uint8_t RF24Virtual::flush_tx(void)
+{
+  medium.elapse(medium.spiTime);
+  tx_pending = false;
+  return 0;
+}
+
+/******************************************************************/
+
+void RF24Virtual::call(std::function<void()> fn)
+{
+  if(!poll || medium.running == task){
+    fn();
+    return;
+  }
+  job = fn;
+  while(job){
+    medium.elapse(medium.pollInterval);
+  }
+}
+
+/******************************************************************/
+
+bool RF24Virtual::attempt(void)
+{
+  // PLL settling, then preamble, address, control field, payload and CRC at 1Mbps
+  txAttempts++;
+  medium.elapse(SETTLE_TIME + (tx_payload.len + 10) * 8);
+  bool ok = medium.transmit(this, tx_payload, tx_noack);
+  if(ok && !tx_noack && (auto_ack & _BV(0))){
+    medium.elapse(ACK_TIME);
+  }
+  return ok;
+}
+
+bool RF24Virtual::writeFast(const void* buf, uint8_t len, const bool multicast)
+{
+  medium.elapse(medium.spiTime);
+
+  // A payload that reached max retries is replaced by the new one
+  if(tx_pending){
+    tx_pending = false;
+    txFailures++;
+  }
+  tx_payload.len = rf24_min(len, 32);
+  memcpy(tx_payload.data, buf, tx_payload.len);
+  tx_noack = multicast;
+  pid = (pid + 1) & 3;
+  txPayloads++;
+
+  for(uint8_t i = 0; i <= retry_count; i++){
+    if(i){
+      medium.elapse((retry_delay + 1) * 250);
+    }
+    if(attempt()){
+      return true;
+    }
+  }
+  tx_pending = true;
+  return false;
+}
+
+bool RF24Virtual::txStandBy(void)
+{
+  medium.elapse(medium.spiTime);
+  if(tx_pending){
+    tx_pending = false;
+    txFailures++;
+    return false;
+  }
+  return true;
+}
+
+bool RF24Virtual::txStandBy(uint32_t timeout, bool startTx)
+{
+  medium.elapse(medium.spiTime);
+  if(!tx_pending){
+    return true;
+  }
+  // Keep re-using the payload until the timeout expires
+  uint32_t start = millis();
+  while(millis() - start < timeout){
+    medium.elapse((retry_delay + 1) * 250);
+    if(attempt()){
+      tx_pending = false;
+      return true;
+    }
+  }
+  tx_pending = false;
+  txFailures++;
+  return false;
+}
+
+#endif // RF24_NETWORK_VIRTUAL_RADIO
@@ -0,0 +1,256 @@
+/*
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ version 2 as published by the Free Software Foundation.
+ */
+
+#ifndef __RF24VIRTUAL_H__
+#define __RF24VIRTUAL_H__
+
+/**
+ * @file RF24Virtual.h
+ *
+ * In-memory radio transport for running RF24Network without hardware
+ *
+ * When RF24_NETWORK_VIRTUAL_RADIO is defined (Linux only), RF24Network is built against
+ * RF24Virtual instead of the RF24 driver. RF24Virtual implements the subset of the RF24
+ * interface that RF24Network uses, and delivers payloads between radios attached to the same
+ * RF24VirtualMedium by pipe address, with configurable loss, latency and RX FIFO depth.
+ *
+ * Time is virtual: millis(), micros(), delay() and delayMicroseconds() are provided here and
+ * advance the medium clock. Every node runs as a cooperative task, and the medium always resumes
+ * the task with the earliest wake-up time, so runs are deterministic and do not depend on the host.
+ *
+ * @code
+ * RF24VirtualMedium medium;
+ * RF24 radio0(medium), radio1(medium);   // RF24 is RF24Virtual in this build
+ * RF24Network node00(radio0), node01(radio1);
+ * node00.begin(90,00); node01.begin(90,01);
+ * radio0.poll = pollNetwork; radio0.pollContext = &node00;
+ * radio1.poll = pollNetwork; radio1.pollContext = &node01;
+ *
+ * radio0.call([&]{ node00.write(header,&data,sizeof(data)); });
+ * medium.run(10000);
+ * @endcode
+ */
+
+#if defined (RF24_NETWORK_VIRTUAL_RADIO)
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include <deque>
+#include <functional>
+
+/* Replaces RF24/RF24_config.h for the virtual build. Define RF24_VIRTUAL_MCU to build the
+   MCU (non-Linux) code paths of RF24Network instead, so they can be tested on the host too. */
+#if !defined (RF24_VIRTUAL_MCU)
+  #define RF24_LINUX
+#endif
+
+#define _BV(x) (1<<(x))
+#define rf24_max(a,b) (a>b?a:b)
+#define rf24_min(a,b) (a<b?a:b)
+
+#define PROGMEM
+#define PSTR(x) (x)
+#define printf_P printf
+#define sprintf_P sprintf
+#define strlen_P strlen
+#define pgm_read_byte(addr) (*(const unsigned char *)(addr))
+#define pgm_read_word(p) (*(p))
+
+#if defined (SERIAL_DEBUG)
+  #define IF_SERIAL_DEBUG(x) ({x;})
+#else
+  #define IF_SERIAL_DEBUG(x)
+#endif
+
+uint32_t millis(void);
+uint32_t micros(void);
+void delay(uint32_t ms);
+void delayMicroseconds(uint32_t us);
+
+class RF24VirtualMedium;
+struct RF24VirtualTask;
+
+/**
+ * Virtual radio
+ *
+ * Mirrors the RF24 calls made by RF24Network. Payloads are sent with the same
+ * enhanced-shockburst rules as the nRF24L01: auto-ack on pipe 0 is required to receive
+ * ACKs, the writing pipe address is loaded into pipe 0, startListening() restores the
+ * pipe 0 reading address, and retransmissions are filtered by packet id at the receiver.
+ */
+class RF24Virtual
+{
+public:
+
+  /**
+   * Attach a new radio to a medium
+   *
+   * @param _medium The medium this radio transmits on
+   */
+  RF24Virtual(RF24VirtualMedium& _medium);
+  ~RF24Virtual();
+
+  /**
+   * @name Transport interface
+   *
+   *  The calls RF24Network makes on its radio
+   */
+  /**@{*/
+  bool begin(void);
+  bool isValid(void);
+  void setChannel(uint8_t channel);
+  uint8_t getChannel(void);
+  void setRetries(uint8_t delay, uint8_t count);
+  void setAutoAck(bool enable);
+  void setAutoAck(uint8_t pipe, bool enable);
+  void enableDynamicPayloads(void);
+  void enableDynamicAck(void);
+  void openReadingPipe(uint8_t number, uint64_t address);
+  void openWritingPipe(uint64_t address);
+  void startListening(void);
+  void stopListening(void);
+  bool available(void);
+  bool available(uint8_t* pipe_num);
+  uint8_t getDynamicPayloadSize(void);
+  void read(void* buf, uint8_t len);
+  bool writeFast(const void* buf, uint8_t len, const bool multicast = 0);
+  bool txStandBy(void);
+  bool txStandBy(uint32_t timeout, bool startTx = 0);
+  bool rxFifoFull(void);
+  uint8_t flush_rx(void);
+  uint8_t flush_tx(void);
+  /**@}*/
+
+  /**
+   * The node's main loop, usually calls RF24Network::update().
+   *
+   * Each radio with a poll function gets its own task on the medium, which calls poll()
+   * repeatedly, every pollInterval of virtual time, interleaved with the other nodes.
+   */
+  void (*poll)(void* context);
+  void* pollContext; /**< Passed to poll() */
+
+  /**
+   * Run a function in this node's task, between two calls to poll()
+   *
+   * Use this from the test or benchmark driver for anything that touches the node's
+   * RF24Network, such as write() or read(), so it never interleaves with update().
+   * Returns once the function has run. Radios without a poll function run it directly.
+   *
+   * @param job The function to run
+   */
+  void call(std::function<void()> job);
+
+  /**
+   * @name Counters
+   */
+  /**@{*/
+  uint32_t txPayloads;  /**< Payloads handed to writeFast() */
+  uint32_t txAttempts;  /**< Over-the-air transmissions, including retries */
+  uint32_t txFailures;  /**< Payloads dropped after the final retry or txStandBy() timeout */
+  uint32_t rxPayloads;  /**< Payloads read from the RX FIFO */
+  uint32_t rxOverflows; /**< Payloads not accepted because the RX FIFO was full */
+  uint32_t configCalls; /**< startListening(), stopListening(), setAutoAck() and openWritingPipe() calls */
+  /**@}*/
+
+private:
+  friend class RF24VirtualMedium;
+
+  struct Payload{
+    uint8_t data[32];
+    uint8_t len;
+    uint8_t pipe;
+    uint64_t due;
+  };
+
+  RF24VirtualMedium& medium;
+  uint8_t channel;
+  bool listening;
+  uint8_t auto_ack; /**< Bit per pipe */
+  uint8_t rx_open;  /**< Bit per pipe */
+  uint64_t rx_address[6];
+  uint64_t pipe0_reading_address;
+  uint64_t tx_address;
+  uint8_t retry_delay;
+  uint8_t retry_count;
+
+  uint8_t pid;                 /**< Packet id of the payload in the TX FIFO */
+  bool tx_pending;             /**< The last payload reached max retries and is still in the TX FIFO */
+  Payload tx_payload;
+  bool tx_noack;
+
+  std::deque<Payload> rx_fifo;
+  const void* last_sender[6];  /**< Used to drop retransmitted payloads */
+  uint8_t last_pid[6];
+  uint16_t last_crc[6];
+
+  RF24VirtualTask* task;
+  std::function<void()> job;
+
+  bool attempt(void);
+};
+
+/**
+ * Shared virtual medium
+ *
+ * Delivers payloads between attached radios and keeps the virtual clock.
+ * The most recently constructed medium drives millis() and delay().
+ */
+class RF24VirtualMedium
+{
+public:
+
+  /**
+   * @param seed Seed for the loss generator, so runs can be repeated exactly
+   */
+  RF24VirtualMedium(uint32_t seed = 1);
+  ~RF24VirtualMedium();
+
+  uint16_t loss;          /**< Chance in 1000 that a single transmission or its ACK is lost */
+  uint32_t latency;       /**< Microseconds before a delivered payload shows up in the RX FIFO */
+  uint8_t fifoDepth;      /**< RX FIFO depth of each radio (3 on nRF24L01) */
+  uint32_t spiTime;       /**< Microseconds charged for each radio call */
+  uint32_t pollInterval;  /**< Microseconds between two calls to a node's poll function */
+
+  /**
+   * @return The virtual clock in microseconds
+   */
+  uint64_t now(void) const { return clock; }
+
+  /**
+   * Let the nodes run for a while
+   *
+   * @param us Microseconds of virtual time to run for
+   */
+  void run(uint32_t us);
+
+  static RF24VirtualMedium* active; /**< Medium used by millis() and delay() */
+
+private:
+  friend class RF24Virtual;
+
+  std::vector<RF24Virtual*> radios;
+  std::vector<RF24VirtualTask*> tasks;  /**< tasks[0] is the driver (main) */
+  RF24VirtualTask* running;
+  uint64_t clock;
+  uint32_t rng;
+
+  void attach(RF24Virtual* radio);
+  void detach(RF24Virtual* radio);
+  void elapse(uint32_t us);
+  static void task_main(void);
+  bool lost(void);
+  bool transmit(RF24Virtual* sender, const RF24Virtual::Payload& payload, bool noack);
+};
+
+typedef RF24Virtual RF24;
+
+#endif // RF24_NETWORK_VIRTUAL_RADIO
+
+#endif // __RF24VIRTUAL_H__
@@ -0,0 +1,1163 @@
+/*
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ version 2 as published by the Free Software Foundation.
+ */
+
+/**
+ * Hardware-free tests for RF24Network on the RF24Virtual medium
+ *
+ * Runs a small tree (00 - 01 - 011 - 0111) in one process and checks
+ * direct, routed, fragmented, compressed, multicast, asynchronous and bulk
+ * delivery, compact headers, forwarding at relays, aggregation of small messages, flow control,
+ * priority messages, a leaf with its own buffer sizes, per-type handlers, statistics and the trace.
+ */
+
+// STL headers
+// C headers
+#include <stdio.h>
+#include <string.h>
+// Framework headers
+// Library headers
+#include <RF24Network.h>
+// Project headers
+#include "VirtualNet.h"
+
+static int failures = 0;
+
+#define VIRTUAL_ASSERT(x) do{ if(!(x)){ printf("  FAIL %s:%d: %s\n",__FILE__,__LINE__,#x); failures++; } }while(0)
+
+RF24VirtualMedium medium;
+VirtualNode n00(medium), n01(medium), n011(medium), n0111(medium);
+
+void setUp(void)
+{
+  medium.loss = 0;
+  n00.begin(00);
+  n01.begin(01);
+  n011.begin(011);
+  n0111.begin(0111);
+  medium.run(50000);
+}
+
+// Read the next message on @p node, returns its size or -1 if nothing arrived in time
+template<class Node>
+int receive(Node& node, RF24NetworkHeader& header, void* buf, uint16_t len)
+{
+  int result = -1;
+  uint32_t start = millis();
+  while ( result < 0 && millis() - start < 200 )
+  {
+    medium.run(1000);
+    node.radio.call([&]{
+      if ( node.network.available() )
+        result = node.network.read(header,buf,len);
+    });
+  }
+  return result;
+}
+
+void testDirect(void)
+{
+  printf("%s\n",__FUNCTION__);
+  uint32_t value = 0x12345678, got = 0;
+  RF24NetworkHeader header(/*to node*/ 01, /*type*/ 'T');
+  VIRTUAL_ASSERT( n00.write(header,&value,sizeof(value)) );
+
+  RF24NetworkHeader rx;
+  VIRTUAL_ASSERT( receive(n01,rx,&got,sizeof(got)) == sizeof(got) );
+  VIRTUAL_ASSERT( got == value );
+  VIRTUAL_ASSERT( rx.from_node == 00 && rx.type == 'T' );
+}
+
+#if defined (COMPACT_HEADERS)
+void testCompactHeader(void)
+{
+  printf("%s\n",__FUNCTION__);
+  // A message for a direct child fits one frame with a compact header
+  uint8_t value[MAX_FRAME_SIZE - COMPACT_HEADER_SIZE], got[sizeof(value)] = {0};
+  for ( uint8_t i = 0; i < sizeof(value); i++ )
+    value[i] = i * 7;
+  uint32_t frames = n00.radio.txPayloads;
+  RF24NetworkHeader header(/*to node*/ 01, /*type*/ 'C');
+  VIRTUAL_ASSERT( n00.write(header,value,sizeof(value)) );
+  VIRTUAL_ASSERT( n00.radio.txPayloads - frames == 1 );
+
+  RF24NetworkHeader rx;
+  VIRTUAL_ASSERT( receive(n01,rx,got,sizeof(got)) == sizeof(value) );
+  VIRTUAL_ASSERT( memcmp(got,value,sizeof(value)) == 0 );
+  VIRTUAL_ASSERT( rx.from_node == 00 && rx.to_node == 01 && rx.type == 'C' && rx.id == header.id );
+}
+#endif
+
+void testRoutedAck(void)
+{
+  printf("%s\n",__FUNCTION__);
+  uint32_t value = 0xCAFEF00D, got = 0;
+  // Types 65-127 are acknowledged end to end with NETWORK_ACK
+  RF24NetworkHeader header(/*to node*/ 0111, /*type*/ 65);
+  VIRTUAL_ASSERT( n00.write(header,&value,sizeof(value)) );
+
+  RF24NetworkHeader rx;
+  VIRTUAL_ASSERT( receive(n0111,rx,&got,sizeof(got)) == sizeof(got) );
+  VIRTUAL_ASSERT( got == value );
+  VIRTUAL_ASSERT( rx.from_node == 00 );
+}
+
+#if defined (FORWARD_QUEUE_DEPTH)
+void testForwardQueue(void)
+{
+  printf("%s\n",__FUNCTION__);
+  // n011 is away for a moment, n01 keeps the routed frame and keeps receiving
+  n011.radio.call([]{ n011.radio.stopListening(); });
+  uint32_t value = 0x0F0F0F0F, local = 0x01010101, got = 0;
+  RF24NetworkHeader header(/*to node*/ 0111, /*type*/ 32);
+  VIRTUAL_ASSERT( n00.write(header,&value,sizeof(value)) );
+  RF24NetworkHeader direct(/*to node*/ 01, /*type*/ 'D');
+  VIRTUAL_ASSERT( n00.write(direct,&local,sizeof(local)) );
+
+  RF24NetworkHeader rx;
+  VIRTUAL_ASSERT( receive(n01,rx,&got,sizeof(got)) == sizeof(got) && got == local );
+  VIRTUAL_ASSERT( n01.radio.txFailures > 0 );
+
+  n011.radio.call([]{ n011.radio.startListening(); });
+  VIRTUAL_ASSERT( receive(n0111,rx,&got,sizeof(got)) == sizeof(got) );
+  VIRTUAL_ASSERT( got == value && rx.from_node == 00 );
+
+  // A burst to the same next hop arrives in order
+  for ( uint32_t i = 0; i < 3; i++ )
+    VIRTUAL_ASSERT( n00.write(header,&i,sizeof(i)) );
+  for ( uint32_t i = 0; i < 3; i++ )
+    VIRTUAL_ASSERT( receive(n0111,rx,&got,sizeof(got)) == sizeof(got) && got == i );
+}
+
+static const int onceCount = 40;
+static int onceCopies[onceCount];
+
+// Main loop of the receiving node, counts the copies of each message
+void onceReceive(void* context)
+{
+  RF24Network& network = *reinterpret_cast<RF24Network*>(context);
+  network.update();
+  while ( network.available() )
+  {
+    RF24NetworkHeader rx;
+    int value = -1;
+    if ( network.read(rx,&value,sizeof(value)) == sizeof(value) && rx.type == 'O' && value >= 0 && value < onceCount )
+      onceCopies[value]++;
+  }
+}
+
+void testForwardOnce(void)
+{
+  printf("%s\n",__FUNCTION__);
+  // Relays send a routed frame again when its radio ACK is lost, the recipient still gets each message once
+  memset(onceCopies,0,sizeof(onceCopies));
+  n0111.radio.poll = onceReceive;
+  medium.loss = 100;
+  for ( int i = 0; i < onceCount; i++ )
+  {
+    RF24NetworkHeader header(/*to node*/ 0111, /*type*/ 'O');
+    n00.write(header,&i,sizeof(i));
+  }
+  medium.run(300000);
+  int delivered = 0;
+  for ( int i = 0; i < onceCount; i++ )
+  {
+    VIRTUAL_ASSERT( onceCopies[i] <= 1 );
+    delivered += onceCopies[i];
+  }
+  VIRTUAL_ASSERT( delivered >= onceCount * 3 / 4 );
+}
+#endif
+
+void testFragmented(void)
+{
+  printf("%s\n",__FUNCTION__);
+  uint8_t message[MAX_PAYLOAD_SIZE], got[MAX_PAYLOAD_SIZE];
+  for ( unsigned i = 0; i < sizeof(message); i++ )
+    message[i] = i * 7 + 3;
+  memset(got,0,sizeof(got));
+
+  RF24NetworkHeader header(/*to node*/ 00, /*type*/ 'F');
+  VIRTUAL_ASSERT( n011.write(header,message,sizeof(message)) );
+
+  RF24NetworkHeader rx;
+  VIRTUAL_ASSERT( receive(n00,rx,got,sizeof(got)) == sizeof(message) );
+  VIRTUAL_ASSERT( memcmp(got,message,sizeof(message)) == 0 );
+  VIRTUAL_ASSERT( rx.type == 'F' );
+
+  // To a neighbor the fragments go out back to back, the radio is set up for them once
+  uint32_t calls = n00.radio.configCalls;
+  RF24NetworkHeader down(/*to node*/ 01, /*type*/ 'F');
+  VIRTUAL_ASSERT( n00.write(down,message,sizeof(message)) );
+  VIRTUAL_ASSERT( n00.radio.configCalls - calls <= 5 );
+  VIRTUAL_ASSERT( receive(n01,rx,got,sizeof(got)) == sizeof(message) );
+  VIRTUAL_ASSERT( memcmp(got,message,sizeof(message)) == 0 );
+}
+
+#if defined (ENABLE_COMPRESSION)
+void testCompress(void)
+{
+  printf("%s\n",__FUNCTION__);
+  // Repeated sensor records, routed through n01, take fewer fragments compressed
+  char message[MAX_PAYLOAD_SIZE];
+  uint8_t got[MAX_PAYLOAD_SIZE];
+  for ( unsigned i = 0; i < sizeof(message) / 16; i++ )
+    snprintf(message + i * 16,17,"id=%03u;T=21.%u;H",i * 37,i % 10);
+  n011.network.networkFlags |= FLAG_COMPRESS;
+  uint32_t frames = n011.radio.txPayloads;
+  RF24NetworkHeader header(/*to node*/ 00, /*type*/ 'Z');
+  VIRTUAL_ASSERT( n011.write(header,message,sizeof(message)) );
+  VIRTUAL_ASSERT( n011.radio.txPayloads - frames < sizeof(message) / 24 );
+
+  RF24NetworkHeader rx;
+  VIRTUAL_ASSERT( receive(n00,rx,got,sizeof(got)) == sizeof(message) );
+  VIRTUAL_ASSERT( memcmp(got,message,sizeof(message)) == 0 && rx.type == 'Z' );
+
+  // With selective repeat too
+  n011.network.networkFlags |= FLAG_SELECTIVE_REPEAT;
+  RF24NetworkHeader again(/*to node*/ 00, /*type*/ 'Z');
+  VIRTUAL_ASSERT( n011.write(again,message,sizeof(message)) );
+  n011.network.networkFlags &= ~(FLAG_SELECTIVE_REPEAT | FLAG_COMPRESS);
+  VIRTUAL_ASSERT( receive(n00,rx,got,sizeof(got)) == sizeof(message) );
+  VIRTUAL_ASSERT( memcmp(got,message,sizeof(message)) == 0 );
+}
+#endif
+
+void testMulticast(void)
+{
+  printf("%s\n",__FUNCTION__);
+  uint32_t value = 42, got = 0;
+  RF24NetworkHeader header(/*to node*/ 0, /*type*/ 'M');
+  bool ok = false;
+  n00.radio.call([&]{ ok = n00.network.multicast(header,&value,sizeof(value),1); });
+  VIRTUAL_ASSERT( ok );
+
+  RF24NetworkHeader rx;
+  VIRTUAL_ASSERT( receive(n01,rx,&got,sizeof(got)) == sizeof(got) );
+  VIRTUAL_ASSERT( got == value );
+}
+
+void testBorrow(void)
+{
+  printf("%s\n",__FUNCTION__);
+  uint32_t first = 0x11111111, second = 0x22222222;
+  RF24NetworkHeader header(/*to node*/ 01, /*type*/ 'B');
+  VIRTUAL_ASSERT( n00.write(header,&first,sizeof(first)) );
+  VIRTUAL_ASSERT( n00.write(header,&second,sizeof(second)) );
+  medium.run(10000);
+
+  n01.radio.call([&]{
+    const uint8_t* data;
+    uint16_t len = 0;
+    const RF24NetworkHeader* rx = n01.network.borrow(data,len);
+    VIRTUAL_ASSERT( rx && rx->type == 'B' && len == sizeof(first) );
+    VIRTUAL_ASSERT( rx && memcmp(data,&first,sizeof(first)) == 0 );
+    // Still queued until released
+    RF24NetworkHeader peeked;
+    VIRTUAL_ASSERT( n01.network.peek(peeked) == sizeof(first) && peeked.id == rx->id );
+    n01.network.release();
+
+    rx = n01.network.borrow(data,len);
+    VIRTUAL_ASSERT( rx && memcmp(data,&second,sizeof(second)) == 0 );
+    n01.network.release();
+    VIRTUAL_ASSERT( n01.network.borrow(data,len) == NULL );
+  });
+}
+
+void testRadioShared(void)
+{
+  printf("%s\n",__FUNCTION__);
+  // The sketches use the radio themselves between network calls
+  n00.radio.call([]{
+    n00.radio.setAutoAck(0,true);
+    n00.radio.openWritingPipe(0xF0F0F0F0E1LL);
+  });
+  n01.radio.call([]{
+    n01.radio.stopListening();
+    n01.network.resyncRadio();
+  });
+  uint32_t value = 0x5A5A0101, got = 0;
+  RF24NetworkHeader header(/*to node*/ 01, /*type*/ 'U'), rx;
+  VIRTUAL_ASSERT( n00.write(header,&value,sizeof(value)) );
+  VIRTUAL_ASSERT( receive(n01,rx,&got,sizeof(got)) == sizeof(got) && got == value );
+
+  // write() sets the radio up again without help, and listens once done
+  n00.radio.call([]{ n00.radio.stopListening(); });
+  RF24NetworkHeader again(/*to node*/ 01, /*type*/ 'U');
+  VIRTUAL_ASSERT( n00.write(again,&value,sizeof(value)) );
+  VIRTUAL_ASSERT( receive(n01,rx,&got,sizeof(got)) == sizeof(got) && got == value );
+  RF24NetworkHeader back(/*to node*/ 00, /*type*/ 'U');
+  VIRTUAL_ASSERT( n01.write(back,&value,sizeof(value)) );
+  VIRTUAL_ASSERT( receive(n00,rx,&got,sizeof(got)) == sizeof(got) && got == value );
+}
+
+void testQueueFull(void)
+{
+  printf("%s\n",__FUNCTION__);
+  // n01 runs update() but nobody reads, so its frame queue fills up
+  const int count = 40;
+  int sent = 0;
+  for ( int i = 0; i < count; i++ )
+  {
+    RF24NetworkHeader header(/*to node*/ 01, /*type*/ 'Q');
+    if ( n00.write(header,&i,sizeof(i)) )
+      sent++;
+  }
+  VIRTUAL_ASSERT( sent > 0 && sent < count );
+#if defined (RF24_LINUX)
+  VIRTUAL_ASSERT( sent >= FRAME_QUEUE_DEPTH );
+  // Between two update() calls, which clear the flag before reading the radio again
+  n01.radio.call([]{ VIRTUAL_ASSERT( n01.network.networkFlags & FLAG_HOLD_INCOMING ); });
+#endif
+
+  // Everything that was acknowledged is delivered in order once there is room again
+  int received = 0, value = -1;
+  RF24NetworkHeader rx;
+  while ( receive(n01,rx,&value,sizeof(value)) == sizeof(value) )
+  {
+    VIRTUAL_ASSERT( value == received );
+    received++;
+  }
+  VIRTUAL_ASSERT( received == sent );
+  VIRTUAL_ASSERT( !(n01.network.networkFlags & FLAG_HOLD_INCOMING) );
+}
+
+#if defined (RF24_LINUX)
+void testExternalFull(void)
+{
+  printf("%s\n",__FUNCTION__);
+  // Nobody reads the external data of n01, which keeps taking other messages
+  uint8_t data[8] = { 0xE0 };
+  for ( int i = 0; i < FRAME_QUEUE_DEPTH + 4; i++ )
+  {
+    RF24NetworkHeader header(/*to node*/ 01, /*type*/ EXTERNAL_DATA_TYPE);
+    n00.write(header,data,sizeof(data));
+  }
+  VIRTUAL_ASSERT( n01.network.external_queue.size() == FRAME_QUEUE_DEPTH );
+  VIRTUAL_ASSERT( !(n01.network.networkFlags & FLAG_HOLD_INCOMING) );
+  int value = 0xE1;
+  RF24NetworkHeader header(/*to node*/ 01, /*type*/ 'Q'), rx;
+  VIRTUAL_ASSERT( n00.write(header,&value,sizeof(value)) );
+  VIRTUAL_ASSERT( receive(n01,rx,&value,sizeof(value)) == sizeof(value) && value == 0xE1 );
+#if defined (ENABLE_NETWORK_STATS)
+  RF24NetworkStats stats;
+  n01.radio.call([&]{ n01.network.stats(&stats); });
+  VIRTUAL_ASSERT( stats.queue_drops == 4 );
+#endif
+  n01.radio.call([]{
+    while ( n01.network.external_queue.size() )
+      n01.network.external_queue.pop();
+  });
+}
+#endif
+
+#if defined (FLOW_CONTROL_TIMEOUT)
+void testFlowControl(void)
+{
+  printf("%s\n",__FUNCTION__);
+  // n01 fills up and tells n00, which then stops sending instead of burning retries
+  int sent = 0;
+  for ( int i = 0; i < 40; i++ )
+  {
+    RF24NetworkHeader header(/*to node*/ 01, /*type*/ 'Q');
+    if ( !n00.write(header,&i,sizeof(i)) )
+      break;
+    sent++;
+  }
+  VIRTUAL_ASSERT( sent > 0 && sent < 40 );
+  uint32_t attempts = n00.radio.txAttempts;
+  int value = 0;
+  RF24NetworkHeader header(/*to node*/ 01, /*type*/ 'Q');
+  VIRTUAL_ASSERT( !n00.write(header,&value,sizeof(value)) );
+  VIRTUAL_ASSERT( n00.radio.txAttempts == attempts );
+
+  // Once there is room again, n01 lets n00 send
+  int received = 0;
+  RF24NetworkHeader rx;
+  while ( receive(n01,rx,&value,sizeof(value)) == sizeof(value) )
+    received++;
+  VIRTUAL_ASSERT( received == sent );
+  medium.run(10000);
+  value = 0xF10;
+  VIRTUAL_ASSERT( n00.write(header,&value,sizeof(value)) );
+  VIRTUAL_ASSERT( receive(n01,rx,&value,sizeof(value)) == sizeof(value) && value == 0xF10 );
+}
+#endif
+
+// Without a priority buffer, priority types are queued with the others
+#if defined (RF24_LINUX) || PRIORITY_BUFFER_SIZE
+void testPriority(void)
+{
+  printf("%s\n",__FUNCTION__);
+  n01.radio.call([]{ n01.network.setPriority('A'); });
+  // Telemetry queued ahead of an actuator command
+  for ( int i = 0; i < 3; i++ )
+  {
+    RF24NetworkHeader header(/*to node*/ 01, /*type*/ 'Q');
+    VIRTUAL_ASSERT( n00.write(header,&i,sizeof(i)) );
+  }
+  int command = 0xAC, value = -1;
+  RF24NetworkHeader actuator(/*to node*/ 01, /*type*/ 'A');
+  VIRTUAL_ASSERT( n00.write(actuator,&command,sizeof(command)) );
+
+  RF24NetworkHeader rx;
+  VIRTUAL_ASSERT( receive(n01,rx,&value,sizeof(value)) == sizeof(value) && rx.type == 'A' && value == command );
+  for ( int i = 0; i < 3; i++ )
+    VIRTUAL_ASSERT( receive(n01,rx,&value,sizeof(value)) == sizeof(value) && rx.type == 'Q' && value == i );
+
+  // With the holds bypassed, a command still finds room behind a full queue
+  n01.radio.call([]{ n01.network.networkFlags |= FLAG_BYPASS_HOLDS; });
+  for ( int i = 0; i < 40; i++ )
+  {
+    RF24NetworkHeader header(/*to node*/ 01, /*type*/ 'Q');
+    n00.write(header,&i,sizeof(i));
+  }
+  VIRTUAL_ASSERT( n00.write(actuator,&command,sizeof(command)) );
+  VIRTUAL_ASSERT( receive(n01,rx,&value,sizeof(value)) == sizeof(value) && rx.type == 'A' );
+  while ( receive(n01,rx,&value,sizeof(value)) > 0 )
+    VIRTUAL_ASSERT( rx.type == 'Q' );
+  n01.radio.call([]{ n01.network.networkFlags &= ~FLAG_BYPASS_HOLDS; n01.network.setPriority('A',false); });
+}
+#endif
+
+void testQueueWrap(void)
+{
+  printf("%s\n",__FUNCTION__);
+  // Keep a few frames of different sizes queued, so storing wraps around the buffer
+  uint8_t message[24], got[24];
+  int next = 0;
+  RF24NetworkHeader rx;
+  for ( int i = 0; i < 60; i++ )
+  {
+    uint16_t len = 4 + (i * 7) % 21;
+    memcpy(message,&i,sizeof(i));
+    for ( uint16_t j = sizeof(i); j < len; j++ )
+      message[j] = i + j;
+    RF24NetworkHeader header(/*to node*/ 01, /*type*/ 'W');
+    VIRTUAL_ASSERT( n00.write(header,message,len) );
+
+    if ( i < 3 )
+      continue;
+    int size = receive(n01,rx,got,sizeof(got));
+    VIRTUAL_ASSERT( size == 4 + (next * 7) % 21 );
+    VIRTUAL_ASSERT( memcmp(got,&next,sizeof(next)) == 0 );
+    for ( int j = sizeof(next); j < size; j++ )
+      VIRTUAL_ASSERT( got[j] == (uint8_t)(next + j) );
+    next++;
+  }
+  while ( receive(n01,rx,got,sizeof(got)) > 0 )
+  {
+    VIRTUAL_ASSERT( memcmp(got,&next,sizeof(next)) == 0 );
+    next++;
+  }
+  VIRTUAL_ASSERT( next == 60 );
+}
+
+static uint8_t selectiveMessage[MAX_PAYLOAD_SIZE];
+#if defined (FORWARD_QUEUE_DEPTH) || defined (RX_BATCH_SIZE)
+static int selectiveReceived = 0; /**< Messages received intact */
+
+// Main loop of the receiving node, reads messages as they arrive
+void selectiveReceive(void* context)
+{
+  RF24Network& network = *reinterpret_cast<RF24Network*>(context);
+  network.update();
+  while ( network.available() )
+  {
+    RF24NetworkHeader rx;
+    uint8_t got[MAX_PAYLOAD_SIZE];
+    uint16_t size = network.read(rx,got,sizeof(got));
+    if ( rx.type == 'R' && size == sizeof(selectiveMessage) && memcmp(got,selectiveMessage,size) == 0 )
+      selectiveReceived++;
+  }
+}
+#endif
+
+void testSelectiveRepeat(void)
+{
+  printf("%s\n",__FUNCTION__);
+  uint8_t* message = selectiveMessage;
+  uint8_t got[MAX_PAYLOAD_SIZE];
+  for ( unsigned i = 0; i < sizeof(selectiveMessage); i++ )
+    message[i] = i * 3 + 7;
+
+  // Fragments are reassembled in any order, all of them carry the id of the message
+  RF24NetworkHeader header(/*to node*/ 01, /*type*/ NETWORK_LAST_FRAGMENT);
+  header.reserved = 'S';
+  VIRTUAL_ASSERT( n00.write(header,message+48,10) );
+  header.type = NETWORK_MORE_FRAGMENTS;
+  header.reserved = 2;
+  VIRTUAL_ASSERT( n00.write(header,message+24,24) );
+  header.type = NETWORK_FIRST_FRAGMENT;
+  header.reserved = 3;
+  VIRTUAL_ASSERT( n00.write(header,message,24) );
+
+  RF24NetworkHeader rx;
+  VIRTUAL_ASSERT( receive(n01,rx,got,sizeof(got)) == 58 );
+  VIRTUAL_ASSERT( rx.type == 'S' && memcmp(got,message,58) == 0 );
+
+  // Senders that use NETWORK_MORE_FRAGMENTS_NACK for their middle fragments are not sent reports they did not ask for
+  uint32_t frames = n01.radio.txPayloads;
+  RF24NetworkHeader legacy(/*to node*/ 01, /*type*/ NETWORK_FIRST_FRAGMENT);
+  legacy.reserved = 3;
+  VIRTUAL_ASSERT( n00.write(legacy,message,24) );
+  legacy.type = NETWORK_MORE_FRAGMENTS_NACK;
+  legacy.reserved = 2;
+  VIRTUAL_ASSERT( n00.write(legacy,message+24,24) );
+  legacy.type = NETWORK_LAST_FRAGMENT;
+  legacy.reserved = 'N';
+  VIRTUAL_ASSERT( n00.write(legacy,message+48,10) );
+  VIRTUAL_ASSERT( receive(n01,rx,got,sizeof(got)) == 58 );
+  VIRTUAL_ASSERT( rx.type == 'N' && memcmp(got,message,58) == 0 );
+  VIRTUAL_ASSERT( n01.radio.txPayloads == frames );
+
+#if defined (FORWARD_QUEUE_DEPTH) || defined (RX_BATCH_SIZE)
+  // Over a lossy route, only the missing fragments are sent again. Relays that forward each frame as it arrives
+  // transmit while the next hop transmits to them, so on AVR the reports and fragments are lost to each other
+  medium.loss = 300;
+  selectiveReceived = 0;
+  n00.radio.poll = selectiveReceive;
+  n0111.network.networkFlags |= FLAG_SELECTIVE_REPEAT;
+  const int count = 20;
+  int sent = 0;
+  for ( int i = 0; i < count; i++ )
+  {
+    RF24NetworkHeader header(/*to node*/ 00, /*type*/ 'R');
+    if ( n0111.write(header,message,sizeof(selectiveMessage)) )
+      sent++;
+  }
+  medium.run(100000);
+  n0111.network.networkFlags &= ~FLAG_SELECTIVE_REPEAT;
+  VIRTUAL_ASSERT( selectiveReceived == count );
+  VIRTUAL_ASSERT( sent >= count * 3 / 4 );
+#endif
+}
+
+#if defined (NUM_ASYNC_WRITES)
+static int asyncCallbacks = 0;
+static bool asyncCallbackOk = false;
+static uint32_t asyncValues[3] = { 0xA0000001, 0xA0000002, 0xA0000003 };
+static uint8_t asyncMessage[MAX_PAYLOAD_SIZE];
+static int asyncSeen = 0; /**< Bit per message received intact */
+
+void asyncDone(uint8_t handle, bool ok)
+{
+  asyncCallbacks++;
+  asyncCallbackOk = ok;
+}
+
+// Main loop of the receiving node, reads messages as they arrive
+void asyncReceive(void* context)
+{
+  RF24Network& network = *reinterpret_cast<RF24Network*>(context);
+  network.update();
+  while ( network.available() )
+  {
+    RF24NetworkHeader rx;
+    uint8_t got[MAX_PAYLOAD_SIZE];
+    uint16_t size = network.read(rx,got,sizeof(got));
+    if ( rx.type == 'F' && size == sizeof(asyncMessage) && memcmp(got,asyncMessage,size) == 0 )
+      asyncSeen |= 8;
+    for ( int i = 0; i < 3; i++ )
+      if ( rx.type == 65 && size == sizeof(asyncValues[i]) && memcmp(got,&asyncValues[i],size) == 0 )
+        asyncSeen |= 1 << i;
+  }
+}
+
+// Wait for writeAsync() @p handle to complete on @p node, returns its final writeStatus()
+uint8_t asyncResult(VirtualNode& node, uint8_t handle)
+{
+  uint8_t status = ASYNC_WRITE_PENDING;
+  uint32_t start = millis();
+  while ( status == ASYNC_WRITE_PENDING && millis() - start < 500 )
+  {
+    medium.run(1000);
+    node.radio.call([&]{ status = node.network.writeStatus(handle); });
+  }
+  return status;
+}
+
+void testAsync(void)
+{
+  printf("%s\n",__FUNCTION__);
+  asyncCallbacks = 0;
+  asyncSeen = 0;
+  for ( unsigned i = 0; i < sizeof(asyncMessage); i++ )
+    asyncMessage[i] = i * 5 + 1;
+  n0111.radio.poll = asyncReceive;
+
+  // Three acknowledged messages and a fragmented one queued at once, queueing takes no time
+  uint8_t handles[3] = { 0 }, fragmented = 0, extra = 1;
+  uint64_t start = medium.now(), queued = 0;
+  n00.radio.call([&]{
+    for ( int i = 0; i < 3; i++ )
+    {
+      RF24NetworkHeader header(/*to node*/ 0111, /*type*/ 65);
+      handles[i] = n00.network.writeAsync(header,&asyncValues[i],sizeof(asyncValues[i]));
+    }
+    RF24NetworkHeader header(/*to node*/ 0111, /*type*/ 'F');
+    fragmented = n00.network.writeAsync(header,asyncMessage,sizeof(asyncMessage),asyncDone);
+    extra = n00.network.writeAsync(header,asyncMessage,sizeof(asyncMessage));
+    queued = medium.now();
+  });
+  VIRTUAL_ASSERT( queued - start < 1000 );
+  VIRTUAL_ASSERT( handles[0] && handles[1] && handles[2] && fragmented );
+  VIRTUAL_ASSERT( extra == 0 || NUM_ASYNC_WRITES > 4 );
+
+  for ( int i = 0; i < 3; i++ )
+    VIRTUAL_ASSERT( asyncResult(n00,handles[i]) == ASYNC_WRITE_OK );
+  medium.run(200000);
+  VIRTUAL_ASSERT( asyncCallbacks == 1 && asyncCallbackOk );
+  VIRTUAL_ASSERT( asyncSeen == 15 );
+  // Results are collected once
+  n00.radio.call([&]{ VIRTUAL_ASSERT( n00.network.writeStatus(handles[0]) == ASYNC_WRITE_INVALID ); });
+
+  // Failures are reported too
+  medium.loss = 1000;
+  uint8_t handle = 0;
+  n00.radio.call([&]{
+    RF24NetworkHeader header(/*to node*/ 01, /*type*/ 'L');
+    handle = n00.network.writeAsync(header,&asyncValues[0],sizeof(asyncValues[0]));
+  });
+  VIRTUAL_ASSERT( asyncResult(n00,handle) == ASYNC_WRITE_FAILED );
+}
+#endif
+
+#if defined (BULK_WINDOW)
+static uint8_t bulkData[1000];
+static uint8_t bulkGot[sizeof(bulkData)];
+static uint32_t bulkReceived = 0; /**< Bytes handed to the sink, in order */
+static int bulkAnnounced = 0;
+static bool bulkOrderOk = true;
+
+uint8_t bulkSource(uint32_t offset, uint8_t* buffer, uint8_t len)
+{
+  memcpy(buffer,bulkData + offset,len);
+  return len;
+}
+
+bool bulkSink(const RF24NetworkHeader& header, uint32_t size, uint32_t offset, const uint8_t* data, uint8_t len)
+{
+  if ( !data )
+  {
+    bulkAnnounced++;
+    bulkReceived = 0;
+    return size == sizeof(bulkData) && header.from_node == 0111;
+  }
+  bulkOrderOk = bulkOrderOk && offset == bulkReceived && offset + len <= size;
+  memcpy(bulkGot + offset,data,len);
+  bulkReceived += len;
+  return true;
+}
+
+// Wait for the bulk transfer of @p node to complete, returns its final bulkStatus()
+uint8_t bulkResult(VirtualNode& node, uint32_t stopAt = 0)
+{
+  uint8_t status = BULK_PENDING;
+  uint32_t offset = 0, start = millis();
+  while ( status == BULK_PENDING && millis() - start < 5000 && (!stopAt || offset < stopAt) )
+  {
+    medium.run(1000);
+    node.radio.call([&]{ status = node.network.bulkStatus(&offset); });
+  }
+  return status;
+}
+
+bool bulkStart(VirtualNode& node, uint8_t type)
+{
+  bool ok = false;
+  node.radio.call([&]{
+    RF24NetworkHeader header(/*to node*/ 00, type);
+    ok = node.network.bulkWrite(header,sizeof(bulkData),bulkSource);
+  });
+  return ok;
+}
+
+void testBulk(void)
+{
+  printf("%s\n",__FUNCTION__);
+  for ( unsigned i = 0; i < sizeof(bulkData); i++ )
+    bulkData[i] = i * 7 + i / 256;
+  n00.radio.call([&]{ n00.network.bulkSink(bulkSink); });
+
+  // Across three hops, and over a lossy route
+  for ( int loss = 0; loss <= 200; loss += 200 )
+  {
+    medium.loss = loss;
+    bulkAnnounced = 0;
+    bulkOrderOk = true;
+    memset(bulkGot,0,sizeof(bulkGot));
+    VIRTUAL_ASSERT( bulkStart(n0111,'B' + loss / 200) );
+    VIRTUAL_ASSERT( !bulkStart(n0111,'X') );
+    VIRTUAL_ASSERT( bulkResult(n0111) == BULK_OK );
+    VIRTUAL_ASSERT( bulkAnnounced == 1 && bulkOrderOk );
+    VIRTUAL_ASSERT( bulkReceived == sizeof(bulkData) && memcmp(bulkGot,bulkData,sizeof(bulkData)) == 0 );
+  }
+
+  // An interrupted transfer continues where the recipient got to
+  medium.loss = 0;
+  bulkAnnounced = 0;
+  bulkOrderOk = true;
+  memset(bulkGot,0,sizeof(bulkGot));
+  VIRTUAL_ASSERT( bulkStart(n0111,'R') );
+  VIRTUAL_ASSERT( bulkResult(n0111,300) == BULK_PENDING );
+  medium.loss = 1000;
+  VIRTUAL_ASSERT( bulkResult(n0111) == BULK_FAILED );
+  uint32_t interrupted = bulkReceived;
+  VIRTUAL_ASSERT( interrupted >= 300 && interrupted < sizeof(bulkData) );
+  medium.loss = 0;
+  VIRTUAL_ASSERT( bulkStart(n0111,'R') );
+  VIRTUAL_ASSERT( bulkResult(n0111) == BULK_OK );
+  VIRTUAL_ASSERT( bulkAnnounced == 1 && bulkOrderOk );
+  VIRTUAL_ASSERT( bulkReceived == sizeof(bulkData) && memcmp(bulkGot,bulkData,sizeof(bulkData)) == 0 );
+
+  // Refused by the sink
+  VIRTUAL_ASSERT( bulkStart(n01,'N') );
+  VIRTUAL_ASSERT( bulkResult(n01) == BULK_FAILED );
+  n00.radio.call([&]{ n00.network.bulkSink(NULL); });
+}
+#endif
+
+uint64_t pipe_address( uint16_t node, uint8_t pipe ); // RF24Network.cpp
+
+static_assert( RF24NetworkAddress::level(0111) == 3 && RF24NetworkAddress::mask(0111) == 0777, "level" );
+static_assert( RF24NetworkAddress::parent(0111) == 011 && RF24NetworkAddress::parentPipe(0111) == 1, "parent" );
+static_assert( RF24NetworkAddress::parent(05) == 00 && RF24NetworkAddress::parentPipe(05) == 5, "parent of level 1" );
+static_assert( RF24NetworkAddress::valid(05555) && !RF24NetworkAddress::valid(016) && !RF24NetworkAddress::valid(0711), "valid" );
+static_assert( RF24NetworkAddress::pipeAddress(00,0) == 0xCCCCCCCCC3ULL && RF24NetworkAddress::pipeAddress(01,5) == 0xCCCCCC3CE3ULL, "pipe" );
+
+void testCompileTimeAddress(void)
+{
+  printf("%s\n",__FUNCTION__);
+  // The compile-time math agrees with the runtime code for every address
+  bool valid = true, pipes = true;
+  for ( uint32_t node = 0; node <= 0xFFFF; node++ )
+  {
+    bool expected = true;
+    for ( uint16_t digits = node; digits; digits >>= 3 )
+    {
+      uint8_t digit = digits & 07;
+    #if defined (RF24NetworkMulticast)
+      if ( digit > 5 )
+    #else
+      if ( digit < 1 || digit > 5 )
+    #endif
+        expected = false;
+    }
+    valid &= RF24NetworkAddress::valid(node) == expected;
+    if ( expected )
+      for ( uint8_t pipe = 0; pipe < 6; pipe++ )
+        pipes &= RF24NetworkAddress::pipeAddress(node,pipe) == pipe_address(node,pipe);
+  }
+  VIRTUAL_ASSERT( valid );
+  VIRTUAL_ASSERT( pipes );
+
+  // A node brought up with a compile-time address is reachable through the tree
+  n0111.radio.call([]{ n0111.network.begin<0111>(90); });
+  uint32_t value = 0x0111, got = 0;
+  RF24NetworkHeader header(/*to node*/ 0111, /*type*/ 65);
+  VIRTUAL_ASSERT( n00.write(header,&value,sizeof(value)) );
+  RF24NetworkHeader rx;
+  VIRTUAL_ASSERT( receive(n0111,rx,&got,sizeof(got)) == sizeof(got) );
+  VIRTUAL_ASSERT( got == value );
+
+  RF24NetworkHeader reply(/*to node*/ 00, /*type*/ 'C');
+  VIRTUAL_ASSERT( n0111.write(reply,&value,sizeof(value)) );
+  VIRTUAL_ASSERT( receive(n00,rx,&got,sizeof(got)) == sizeof(got) && rx.from_node == 0111 );
+}
+
+#if defined (ENABLE_TYPE_HANDLERS)
+static int handled = 0;
+static uint16_t handledSize = 0;
+static uint8_t handledMessage[MAX_PAYLOAD_SIZE];
+
+void handleMessage(const RF24NetworkHeader& header, const uint8_t* message, uint16_t len)
+{
+  handled++;
+  handledSize = len;
+  memcpy(handledMessage,message,len);
+}
+
+void testHandlers(void)
+{
+  printf("%s\n",__FUNCTION__);
+  handled = 0;
+  bool ok = false;
+  n00.radio.call([&]{ ok = n00.network.setHandler('H',handleMessage) && !n00.network.setHandler(NETWORK_LAST_FRAGMENT,handleMessage) &&
+                           !n00.network.setHandler(NETWORK_ACK,handleMessage); });
+  VIRTUAL_ASSERT( ok );
+
+  uint32_t value = 0x48484848;
+  RF24NetworkHeader header(/*to node*/ 00, /*type*/ 'H');
+  VIRTUAL_ASSERT( n01.write(header,&value,sizeof(value)) );
+  medium.run(10000);
+  VIRTUAL_ASSERT( handled == 1 && handledSize == sizeof(value) && memcmp(handledMessage,&value,sizeof(value)) == 0 );
+
+  // Fragmented messages are handed over once complete
+  uint8_t message[MAX_PAYLOAD_SIZE];
+  for ( unsigned i = 0; i < sizeof(message); i++ )
+    message[i] = i * 5 + 1;
+  VIRTUAL_ASSERT( n011.write(header,message,sizeof(message)) );
+  medium.run(50000);
+  VIRTUAL_ASSERT( handled == 2 && handledSize == sizeof(message) && memcmp(handledMessage,message,sizeof(message)) == 0 );
+
+  // Nothing was queued, other types still are
+  uint8_t got[MAX_PAYLOAD_SIZE];
+  RF24NetworkHeader rx, other(/*to node*/ 00, /*type*/ 'O');
+  VIRTUAL_ASSERT( n01.write(other,&value,sizeof(value)) );
+  VIRTUAL_ASSERT( receive(n00,rx,got,sizeof(got)) == sizeof(value) && rx.type == 'O' );
+  VIRTUAL_ASSERT( receive(n00,rx,got,sizeof(got)) == -1 );
+
+  n00.radio.call([&]{ n00.network.setHandler('H',NULL); });
+  VIRTUAL_ASSERT( n01.write(header,&value,sizeof(value)) );
+  VIRTUAL_ASSERT( receive(n00,rx,got,sizeof(got)) == sizeof(value) && rx.type == 'H' );
+  VIRTUAL_ASSERT( handled == 2 );
+}
+#endif
+
+// A leaf with room for one frame and no fragmentation, next to nodes with the default sizes
+VirtualNodeOf< RF24NetworkSized<34,24> > n02(medium);
+
+void testSized(void)
+{
+  printf("%s\n",__FUNCTION__);
+  n02.begin(02);
+  medium.run(50000);
+#if !defined (RF24_LINUX)
+  VIRTUAL_ASSERT( sizeof(n02.network) < sizeof(n00.network) );
+#endif
+
+  uint8_t message[MAX_PAYLOAD_SIZE], got[MAX_PAYLOAD_SIZE];
+  memset(message,0x5A,sizeof(message));
+  RF24NetworkHeader header(/*to node*/ 00, /*type*/ 'S');
+  // Larger than the leaf's payload size
+  VIRTUAL_ASSERT( !n02.write(header,message,48) );
+  VIRTUAL_ASSERT( n02.write(header,message,24) );
+  RF24NetworkHeader rx;
+  VIRTUAL_ASSERT( receive(n00,rx,got,sizeof(got)) == 24 && rx.from_node == 02 );
+
+  // Fragments are dropped by the leaf, single frames still arrive
+  RF24NetworkHeader down(/*to node*/ 02, /*type*/ 'S');
+  n00.write(down,message,sizeof(message));
+  VIRTUAL_ASSERT( receive(n02,rx,got,sizeof(got)) == -1 );
+  uint32_t value = 0x02020202;
+  VIRTUAL_ASSERT( n00.write(down,&value,sizeof(value)) );
+  VIRTUAL_ASSERT( receive(n02,rx,got,sizeof(got)) == sizeof(value) && memcmp(got,&value,sizeof(value)) == 0 );
+}
+
+#if defined (ENABLE_COMPRESSION)
+// A leaf that takes messages of up to 72 bytes
+VirtualNodeOf< RF24NetworkSized<82,72> > n03(medium);
+
+void testCompressSized(void)
+{
+  printf("%s\n",__FUNCTION__);
+  n03.begin(03);
+  medium.run(50000);
+
+  // 32 bytes over and over, two fragments compressed at any size
+  uint8_t message[MAX_PAYLOAD_SIZE], got[MAX_PAYLOAD_SIZE];
+  for ( unsigned i = 0; i < sizeof(message); i++ )
+    message[i] = i % 32 * 7;
+  n00.network.networkFlags |= FLAG_COMPRESS;
+  RF24NetworkHeader header(/*to node*/ 03, /*type*/ 'z');
+  VIRTUAL_ASSERT( n00.write(header,message,72) );
+  RF24NetworkHeader rx;
+  VIRTUAL_ASSERT( receive(n03,rx,got,sizeof(got)) == 72 && memcmp(got,message,72) == 0 );
+
+  // Larger than the leaf takes, though its fragments fit
+  RF24NetworkHeader large(/*to node*/ 03, /*type*/ 'z');
+  uint32_t frames = n00.radio.txPayloads;
+  n00.write(large,message,sizeof(message));
+  n00.network.networkFlags &= ~FLAG_COMPRESS;
+  VIRTUAL_ASSERT( n00.radio.txPayloads - frames == 2 );
+  VIRTUAL_ASSERT( receive(n03,rx,got,sizeof(got)) == -1 );
+
+  // Compressed fragments that do not uncompress
+  RF24NetworkHeader fragment(/*to node*/ 03, /*type*/ NETWORK_FIRST_FRAGMENT);
+  fragment.reserved = 2 | FRAGMENT_COMPRESSED;
+  uint8_t block[24];
+  memset(block,0xFF,sizeof(block));
+  block[0] = 48;
+  block[1] = 0;
+  VIRTUAL_ASSERT( n00.write(fragment,block,sizeof(block)) );
+  fragment.type = NETWORK_LAST_FRAGMENT;
+  fragment.reserved = 'z';
+  VIRTUAL_ASSERT( n00.write(fragment,block,4) );
+  VIRTUAL_ASSERT( receive(n03,rx,got,sizeof(got)) == -1 );
+#if defined (ENABLE_NETWORK_STATS)
+  RF24NetworkStats stats;
+  n03.radio.call([&]{ n03.network.stats(&stats); });
+  VIRTUAL_ASSERT( stats.frag_oversize == 1 && stats.frag_corrupt == 1 && stats.frag_invalid == 0 );
+#endif
+
+  // Messages that fit still arrive
+  uint32_t value = 0x03030303;
+  VIRTUAL_ASSERT( n00.write(header,&value,sizeof(value)) );
+  VIRTUAL_ASSERT( receive(n03,rx,got,sizeof(got)) == sizeof(value) && memcmp(got,&value,sizeof(value)) == 0 );
+}
+#endif
+
+#if defined (AGGREGATE_WINDOW)
+void testAggregate(void)
+{
+  printf("%s\n",__FUNCTION__);
+  // Small messages from n011 share a frame to n01, which hands them on one by one
+  n011.network.networkFlags |= FLAG_AGGREGATE;
+  uint32_t frames = n011.radio.txPayloads;
+  for ( uint16_t i = 0; i < 4; i++ )
+  {
+    RF24NetworkHeader header(/*to node*/ i < 2 ? 00 : 01, /*type*/ 'a' - 64 + i);
+    VIRTUAL_ASSERT( n011.write(header,&i,sizeof(i)) );
+  }
+  medium.run(10000);
+  n011.network.networkFlags &= ~FLAG_AGGREGATE;
+  VIRTUAL_ASSERT( n011.radio.txPayloads - frames == 1 );
+
+  RF24NetworkHeader rx;
+  uint16_t got = 0;
+  for ( uint16_t i = 0; i < 4; i++ )
+  {
+    VIRTUAL_ASSERT( receive(i < 2 ? n00 : n01,rx,&got,sizeof(got)) == sizeof(got) );
+    VIRTUAL_ASSERT( got == i && rx.type == 'a' - 64 + i && rx.from_node == 011 );
+  }
+}
+#endif
+
+#if defined (ENABLE_NETWORK_STATS)
+void testStats(void)
+{
+  printf("%s\n",__FUNCTION__);
+  n00.radio.call([]{ n00.network.resetStats(); });
+  n01.radio.call([]{ n01.network.resetStats(); });
+  n011.radio.call([]{ n011.network.resetStats(); });
+
+  // Routed through n01, and acknowledged end to end
+  uint32_t value = 0x5747, got = 0;
+  RF24NetworkHeader header(/*to node*/ 00, /*type*/ 66);
+  VIRTUAL_ASSERT( n011.write(header,&value,sizeof(value)) );
+  RF24NetworkHeader rx;
+  VIRTUAL_ASSERT( receive(n00,rx,&got,sizeof(got)) == sizeof(got) );
+
+  RF24NetworkStats stats;
+  n011.radio.call([&]{ n011.network.stats(&stats); });
+  VIRTUAL_ASSERT( stats.neighbors[0].tx_attempts >= 1 && stats.neighbors[0].tx_ok >= 1 );
+  // The NETWORK_ACK counts as received
+  VIRTUAL_ASSERT( stats.types_used == 2 && stats.types[0].type == 66 && stats.types[0].tx == 1 );
+  VIRTUAL_ASSERT( stats.types[1].type == NETWORK_ACK && stats.types[1].rx == 1 );
+  uint32_t acks = 0;
+  for ( int i = 0; i < 8; i++ )
+    acks += stats.ack_rtt[i];
+  VIRTUAL_ASSERT( acks == 1 && stats.ack_timeouts == 0 );
+  n01.radio.call([&]{ n01.network.stats(&stats); });
+  // The last hop sends the NETWORK_ACK itself
+  VIRTUAL_ASSERT( stats.neighbors[1].rx_frames == 1 && stats.neighbors[1].routed == 1 );
+  VIRTUAL_ASSERT( stats.neighbors[0].tx_ok == 1 && stats.neighbors[1].tx_ok == 1 );
+  n00.radio.call([&]{ n00.network.stats(&stats); });
+  VIRTUAL_ASSERT( stats.neighbors[1].rx_frames == 1 && stats.types[0].type == 66 && stats.types[0].rx == 1 );
+  VIRTUAL_ASSERT( stats.queue_high_water > 0 );
+
+  // A repeated last fragment, and a fragment of a message too large for n01
+  RF24NetworkHeader fragment(/*to node*/ 01, /*type*/ NETWORK_LAST_FRAGMENT);
+  fragment.reserved = 'f';
+  VIRTUAL_ASSERT( n00.write(fragment,&value,sizeof(value)) );
+  VIRTUAL_ASSERT( n00.write(fragment,&value,sizeof(value)) );
+  uint8_t block[24] = {0};
+  fragment.type = NETWORK_MORE_FRAGMENTS;
+  fragment.reserved = 100;
+  VIRTUAL_ASSERT( n00.write(fragment,block,sizeof(block)) );
+  medium.run(10000);
+  n01.radio.call([&]{ n01.network.stats(&stats); });
+  VIRTUAL_ASSERT( stats.frag_invalid == 1 && stats.frag_oversize == 1 );
+}
+#endif
+
+#if defined (NETWORK_TRACE_DEPTH)
+// Whether @p events has one of @p event for @p node and @p id, with @p arg
+bool traced(const RF24NetworkTraceEvent* events, uint16_t count, uint8_t event, uint16_t node, uint16_t id, uint8_t arg)
+{
+  for ( uint16_t i = 0; i < count; i++ )
+    if ( events[i].event == event && events[i].node == node && events[i].id == id && events[i].arg == arg )
+      return true;
+  return false;
+}
+
+void testTrace(void)
+{
+  printf("%s\n",__FUNCTION__);
+  // Routed through n01 and acknowledged end to end
+  uint32_t value = 0x7ACE, got = 0;
+  RF24NetworkHeader header(/*to node*/ 00, /*type*/ 67);
+  VIRTUAL_ASSERT( n011.write(header,&value,sizeof(value)) );
+  RF24NetworkHeader rx;
+  VIRTUAL_ASSERT( receive(n00,rx,&got,sizeof(got)) == sizeof(got) );
+
+  RF24NetworkTraceEvent events[NETWORK_TRACE_DEPTH];
+  uint16_t count = 0;
+  n011.radio.call([&]{ count = n011.network.trace(events,NETWORK_TRACE_DEPTH); });
+  // n01 listens for its child 011 on pipe 1
+  VIRTUAL_ASSERT( traced(events,count,TRACE_ROUTE,01,header.id,1) );
+  VIRTUAL_ASSERT( traced(events,count,TRACE_MAC_TX,01,header.id,1) );
+  VIRTUAL_ASSERT( traced(events,count,TRACE_ACK_WAIT,00,header.id,0) );
+  VIRTUAL_ASSERT( traced(events,count,TRACE_ACK_DONE,00,header.id,1) );
+  VIRTUAL_ASSERT( events[count - 1].event == TRACE_ACK_DONE );
+  n01.radio.call([&]{ count = n01.network.trace(events,NETWORK_TRACE_DEPTH); });
+  VIRTUAL_ASSERT( traced(events,count,TRACE_MAC_RX,011,header.id,67) );
+  VIRTUAL_ASSERT( traced(events,count,TRACE_MAC_TX,00,header.id,1) );
+  n00.radio.call([&]{ count = n00.network.trace(events,2); });
+  VIRTUAL_ASSERT( count == 2 && traced(events,count,TRACE_MAC_RX,011,header.id,67) );
+}
+#if defined (NUM_ASYNC_WRITES)
+void testAsyncDuringAck(void)
+{
+  printf("%s\n",__FUNCTION__);
+  // An async message queued before a blocking routed write waits until its NETWORK_ACK is in
+  uint32_t value = 0xA5, async_value = 0x5A;
+  RF24NetworkHeader header(/*to node*/ 00, /*type*/ 67);
+  RF24NetworkHeader async_header(/*to node*/ 01, /*type*/ 'A');
+  uint8_t handle = 0;
+  bool ok = false;
+  n011.radio.call([&]{
+    handle = n011.network.writeAsync(async_header,&async_value,sizeof(async_value));
+    ok = n011.network.write(header,&value,sizeof(value));
+  });
+  VIRTUAL_ASSERT( handle && ok );
+  VIRTUAL_ASSERT( asyncResult(n011,handle) == ASYNC_WRITE_OK );
+  uint32_t got = 0;
+  RF24NetworkHeader rx;
+  VIRTUAL_ASSERT( receive(n00,rx,&got,sizeof(got)) == sizeof(got) && got == value );
+  VIRTUAL_ASSERT( receive(n01,rx,&got,sizeof(got)) == sizeof(got) && got == async_value );
+
+  RF24NetworkTraceEvent events[NETWORK_TRACE_DEPTH];
+  uint16_t count = 0;
+  n011.radio.call([&]{ count = n011.network.trace(events,NETWORK_TRACE_DEPTH); });
+  bool waiting = false, sent_while_waiting = false;
+  for ( uint16_t i = 0; i < count; i++ )
+  {
+    if ( events[i].event == TRACE_ACK_WAIT )
+      waiting = true;
+    else if ( events[i].event == TRACE_ACK_DONE )
+      waiting = false;
+    else if ( events[i].event == TRACE_MAC_TX && events[i].id == async_header.id && waiting )
+      sent_while_waiting = true;
+  }
+  VIRTUAL_ASSERT( traced(events,count,TRACE_MAC_TX,01,async_header.id,1) && !sent_while_waiting );
+}
+#endif
+#endif
+
+#if defined (RF24_LINUX)
+void testCapture(void)
+{
+  printf("%s\n",__FUNCTION__);
+  const char* path = "/tmp/rf24network_capture_test.pcap";
+  bool ok = false;
+  n01.radio.call([&]{ ok = n01.network.capture(path); });
+  VIRTUAL_ASSERT( ok );
+  uint32_t values[2] = { 0xCA97, 0x4E91 }, got = 0;
+  for ( int i = 0; i < 2; i++ )
+  {
+    RF24NetworkHeader header(/*to node*/ 01, /*type*/ 'C');
+    VIRTUAL_ASSERT( n00.write(header,&values[i],sizeof(values[i])) );
+    RF24NetworkHeader rx;
+    VIRTUAL_ASSERT( receive(n01,rx,&got,sizeof(got)) == sizeof(got) && got == values[i] );
+  }
+  n01.radio.call([&]{ n01.network.capture(NULL); });
+
+  uint32_t file_header[6] = { 0 };
+  FILE* file = fopen(path,"rb");
+  VIRTUAL_ASSERT( file && fread(file_header,sizeof(file_header),1,file) == 1 );
+  fclose(file);
+  VIRTUAL_ASSERT( file_header[0] == 0xa1b2c3d4 && file_header[5] == CAPTURE_LINKTYPE );
+
+  // The same messages again, from the file instead of the radio
+  n01.radio.call([&]{ ok = n01.network.replay(path); });
+  VIRTUAL_ASSERT( ok );
+  for ( int i = 0; i < 2; i++ )
+  {
+    RF24NetworkHeader rx;
+    VIRTUAL_ASSERT( receive(n01,rx,&got,sizeof(got)) == sizeof(got) && got == values[i] && rx.type == 'C' );
+  }
+  VIRTUAL_ASSERT( remove(path) == 0 );
+  n01.radio.call([&]{ ok = n01.network.replay(path); });
+  VIRTUAL_ASSERT( !ok );
+}
+#endif
+
+void testLoss(void)
+{
+  printf("%s\n",__FUNCTION__);
+  medium.loss = 1000;
+  uint32_t value = 1;
+  RF24NetworkHeader header(/*to node*/ 01, /*type*/ 'L');
+  VIRTUAL_ASSERT( !n00.write(header,&value,sizeof(value)) );
+  VIRTUAL_ASSERT( n00.radio.txFailures > 0 );
+}
+
+int main(int argc, char** argv)
+{
+  void (*tests[])(void) = { testDirect,
+#if defined (COMPACT_HEADERS)
+    testCompactHeader,
+#endif
+    testRoutedAck,
+#if defined (FORWARD_QUEUE_DEPTH)
+    testForwardQueue, testForwardOnce,
+#endif
+    testFragmented,
+#if defined (ENABLE_COMPRESSION)
+    testCompress,
+#endif
+    testMulticast, testBorrow, testRadioShared, testQueueFull,
+#if defined (RF24_LINUX)
+    testExternalFull,
+#endif
+#if defined (FLOW_CONTROL_TIMEOUT)
+    testFlowControl,
+#endif
+#if defined (RF24_LINUX) || PRIORITY_BUFFER_SIZE
+    testPriority,
+#endif
+    testQueueWrap, testSelectiveRepeat,
+#if defined (NUM_ASYNC_WRITES)
+    testAsync,
+#endif
+#if defined (BULK_WINDOW)
+    testBulk,
+#endif
+    testCompileTimeAddress, testSized,
+#if defined (ENABLE_COMPRESSION)
+    testCompressSized,
+#endif
+#if defined (ENABLE_TYPE_HANDLERS)
+    testHandlers,
+#endif
+#if defined (AGGREGATE_WINDOW)
+    testAggregate,
+#endif
+#if defined (ENABLE_NETWORK_STATS)
+    testStats,
+#endif
+#if defined (NETWORK_TRACE_DEPTH)
+    testTrace,
+#if defined (NUM_ASYNC_WRITES)
+    testAsyncDuringAck,
+#endif
+#endif
+#if defined (RF24_LINUX)
+    testCapture,
+#endif
+    testLoss };
+
+  for ( unsigned i = 0; i < sizeof(tests)/sizeof(tests[0]); i++ )
+  {
+    setUp();
+    tests[i]();
+  }
+
+  printf("%s\n", failures ? "FAILED" : "OK");
+  return failures ? 1 : 0;
+}
+// vim:cin:ai:sts=2 sw=2 ft=cpp
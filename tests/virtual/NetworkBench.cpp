@@ -0,0 +1,230 @@
+/*
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ version 2 as published by the Free Software Foundation.
+ */
+
+/**
+ * End-to-end benchmark for RF24Network on the RF24Virtual medium
+ *
+ * Drives write(), update() and read() across the tree 00 - 01 - 011 - 0111
+ * and reports delivered frames/s, payload bytes/s, p50/p99 delivery latency
+ * and radio retries per delivered byte. All rates use virtual time, so the
+ * numbers only change when the network layer does. The host CPU time per
+ * message is printed as well, to catch regressions in the hot paths.
+ *
+ * Usage: NetworkBench [loss per mille] [messages per run]
+ */
+
+// STL headers
+#include <vector>
+#include <algorithm>
+// C headers
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+// Framework headers
+// Library headers
+#include <RF24Network.h>
+// Project headers
+#include "VirtualNet.h"
+
+RF24VirtualMedium medium;
+VirtualNode n00(medium), n01(medium), n011(medium), n0111(medium);
+VirtualNode* nodes[] = { &n00, &n01, &n011, &n0111 };
+const int num_nodes = sizeof(nodes)/sizeof(nodes[0]);
+
+/** Messages handed to the application, on any node */
+struct Delivered
+{
+  std::vector<uint32_t> latency;
+  uint32_t frames;
+  uint32_t bytes;
+  uint64_t last;
+};
+Delivered delivered;
+
+uint8_t message[MAX_PAYLOAD_SIZE]; /**< Being sent */
+
+// Main loop of every node: update() and read everything, each message starts with its send time
+void benchPoll(void* context)
+{
+  VirtualNode& node = *reinterpret_cast<VirtualNode*>(context);
+  node.network.update();
+  while ( node.network.available() )
+  {
+    RF24NetworkHeader header;
+    uint8_t buffer[MAX_PAYLOAD_SIZE];
+    uint16_t len = node.network.read(header,buffer,sizeof(buffer));
+    uint32_t sent = 0;
+    memcpy(&sent,buffer,sizeof(sent));
+    delivered.latency.push_back(micros() - sent);
+    delivered.frames++;
+    delivered.bytes += len;
+    delivered.last = medium.now();
+  }
+}
+
+void setUp(void)
+{
+  for ( int i = 0; i < num_nodes; i++ )
+  {
+    static const uint16_t addresses[] = { 00, 01, 011, 0111 };
+    nodes[i]->begin(addresses[i]);
+    nodes[i]->radio.poll = benchPoll;
+    nodes[i]->radio.pollContext = nodes[i];
+  }
+  medium.run(50000);
+  delivered = Delivered();
+}
+
+// Total over-the-air transmissions and retransmissions of all radios
+void radioCounters(uint32_t& payloads, uint32_t& attempts)
+{
+  payloads = attempts = 0;
+  for ( int i = 0; i < num_nodes; i++ )
+  {
+    payloads += nodes[i]->radio.txPayloads;
+    attempts += nodes[i]->radio.txAttempts;
+  }
+}
+
+/**
+ * Send @p count messages of @p len bytes from @p from with @p send, then
+ * let the network settle and print one line of results
+ */
+void run(const char* name, VirtualNode& from, uint16_t len, int count, bool (*send)(VirtualNode&, uint16_t))
+{
+  setUp();
+  uint64_t start = medium.now();
+  clock_t cpu = clock();
+
+  for ( int i = 0; i < count; i++ )
+  {
+    for ( unsigned j = sizeof(uint32_t); j < len; j++ )
+      message[j] = i + j;
+    from.radio.call([&]{
+      uint32_t now = micros();
+      memcpy(message,&now,sizeof(now));
+      send(from,len);
+    });
+  }
+  medium.run(500000);
+  cpu = clock() - cpu;
+
+  uint32_t payloads, attempts;
+  radioCounters(payloads,attempts);
+
+  std::vector<uint32_t>& lat = delivered.latency;
+  std::sort(lat.begin(),lat.end());
+  uint32_t p50 = lat.empty() ? 0 : lat[lat.size() / 2];
+  uint32_t p99 = lat.empty() ? 0 : lat[(lat.size() * 99) / 100];
+  double seconds = delivered.last > start ? (delivered.last - start) / 1e6 : 0;
+
+  printf("%-14s %5u/%-5d %9.1f %10.1f %9u %9u %10.4f %9.2f\n", name,
+         delivered.frames, count,
+         seconds ? delivered.frames / seconds : 0.0,
+         seconds ? delivered.bytes / seconds : 0.0,
+         p50, p99,
+         delivered.bytes ? (double)(attempts - payloads) / delivered.bytes : 0.0,
+         count ? (cpu * 1e6 / CLOCKS_PER_SEC) / count : 0.0);
+}
+
+/******************************************************************/
+
+// 0111 -> 00, three hops, no network ACK
+bool sendRouted(VirtualNode& from, uint16_t len)
+{
+  RF24NetworkHeader header(/*to node*/ 00, /*type*/ 'B');
+  return from.network.write(header,message,len);
+}
+
+// 00 -> 0111, acknowledged end to end with NETWORK_ACK
+bool sendRoutedAck(VirtualNode& from, uint16_t len)
+{
+  RF24NetworkHeader header(/*to node*/ 0111, /*type*/ 65);
+  return from.network.write(header,message,len);
+}
+
+// 00 -> level 1, relayed down to levels 2 and 3
+bool sendMulticast(VirtualNode& from, uint16_t len)
+{
+  RF24NetworkHeader header(/*to node*/ 0, /*type*/ 'M');
+  return from.network.multicast(header,message,len,1);
+}
+
+#if defined (BULK_WINDOW)
+uint32_t bulkSize, bulkStart;
+
+uint8_t bulkSource(uint32_t offset, uint8_t* buffer, uint8_t len)
+{
+  memset(buffer,offset,len);
+  return len;
+}
+
+// Counts a frame every MAX_PAYLOAD_SIZE bytes, with the latency since the start of the transfer
+bool bulkSink(const RF24NetworkHeader& header, uint32_t size, uint32_t offset, const uint8_t* data, uint8_t len)
+{
+  if ( data )
+  {
+    if ( (offset + len) / MAX_PAYLOAD_SIZE != offset / MAX_PAYLOAD_SIZE )
+    {
+      delivered.latency.push_back(micros() - bulkStart);
+      delivered.frames++;
+    }
+    delivered.bytes += len;
+    delivered.last = medium.now();
+  }
+  return true;
+}
+
+// 0111 -> 00, all messages as one bulk transfer, sent by the first call
+bool sendBulk(VirtualNode& from, uint16_t len)
+{
+  if ( from.network.bulkStatus() == BULK_PENDING )
+    return true;
+  RF24NetworkHeader header(/*to node*/ 00, /*type*/ 'B');
+  bulkStart = micros();
+  from.network.bulkWrite(header,bulkSize,bulkSource);
+  while ( from.network.bulkStatus() == BULK_PENDING )
+    from.network.update();
+  return from.network.bulkStatus() == BULK_OK;
+}
+#endif
+
+/******************************************************************/
+
+int main(int argc, char** argv)
+{
+  int count = 200;
+  if ( argc > 1 )
+    medium.loss = atoi(argv[1]);
+  if ( argc > 2 )
+    count = atoi(argv[2]);
+
+  printf("loss %u/1000, MAX_PAYLOAD_SIZE %u, MAIN_BUFFER_SIZE %u\n", medium.loss, MAX_PAYLOAD_SIZE, MAIN_BUFFER_SIZE);
+  printf("%-14s %11s %9s %10s %9s %9s %10s %9s\n", "test", "delivered", "frames/s", "bytes/s", "p50(us)", "p99(us)", "retry/byte", "cpu(us)");
+
+  run("routed-24",   n0111, 24,               count, sendRouted);
+  run("routed-frag", n0111, MAX_PAYLOAD_SIZE, count, sendRouted);
+  n0111.network.networkFlags |= FLAG_SELECTIVE_REPEAT;
+  run("routed-frag-sr", n0111, MAX_PAYLOAD_SIZE, count, sendRouted);
+  n0111.network.networkFlags &= ~FLAG_SELECTIVE_REPEAT;
+#if defined (BULK_WINDOW)
+  bulkSize = count * MAX_PAYLOAD_SIZE;
+  n00.network.bulkSink(bulkSink);
+  run("routed-bulk", n0111, MAX_PAYLOAD_SIZE, count, sendBulk);
+  n00.network.bulkSink(NULL);
+#endif
+  run("routed-ack",  n00,   24,               count, sendRoutedAck);
+  // Relays deliver too, so one multicast counts up to three times
+  for ( int i = 0; i < num_nodes; i++ )
+    nodes[i]->network.multicastRelay = 1;
+  run("multicast",   n00,   24,               count, sendMulticast);
+  for ( int i = 0; i < num_nodes; i++ )
+    nodes[i]->network.multicastRelay = 0;
+
+  return 0;
+}
+// vim:cin:ai:sts=2 sw=2 ft=cpp
@@ -0,0 +1,62 @@
+/*
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ version 2 as published by the Free Software Foundation.
+ */
+
+#ifndef __VIRTUALNET_H__
+#define __VIRTUALNET_H__
+
+// STL headers
+// C headers
+#include <stdio.h>
+// Framework headers
+// Library headers
+#include <RF24Network.h>
+// Project headers
+
+/**
+ * One simulated node: a virtual radio and the network running on it
+ *
+ * @tparam Network RF24Network, or an RF24NetworkSized with its own buffer sizes
+ */
+
+template<class Network>
+struct VirtualNodeOf
+{
+  RF24 radio;
+  Network network;
+
+  static void poll(void* context)
+  {
+    reinterpret_cast<Network*>(context)->update();
+  }
+
+  VirtualNodeOf(RF24VirtualMedium& medium): radio(medium), network(radio)
+  {
+  }
+
+  // (Re)start the node at @p address, it runs its own task from then on
+  void begin(uint16_t address)
+  {
+    radio.call([this,address]{
+      radio.begin();
+      network.begin(90,address);
+    });
+    radio.poll = poll;
+    radio.pollContext = &network;
+  }
+
+  // Send from this node's task, returns the result of RF24Network::write()
+  bool write(RF24NetworkHeader& header, const void* message, uint16_t len)
+  {
+    bool ok = false;
+    radio.call([&]{ ok = network.write(header,message,len); });
+    return ok;
+  }
+};
+
+typedef VirtualNodeOf<RF24Network> VirtualNode;
+
+#endif // __VIRTUALNET_H__
+// vim:cin:ai:sts=2 sw=2 ft=cpp